@@ -2,24 +2,78 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "lib/xalloc.h"
-#include "lib/stack.h"
 #include "lib/contracts.h"
 #include "lib/c0v_stack.h"
 #include "lib/c0vm.h"
 #include "lib/c0vm_c0ffi.h"
 #include "lib/c0vm_abort.h"
+#include "lib/c0vm_instr.h"
+#include "lib/analyze.h"
+#include "lib/gc.h"
+#include "lib/jit.h"
+#include "lib/profile.h"
+#include "lib/snapshot.h"
+#include "lib/strings.h"
+#include "lib/trace.h"
+
+/* By default the interpreter is direct-threaded: every function's code
+ * is pre-decoded into an array of handler addresses (one per byte of
+ * bytecode), and each handler jumps straight to the next one.  This
+ * needs GCC's labels-as-values, so other compilers, or building with
+ * -DC0VM_SWITCH, get the plain switch loop, which is kept as the
+ * reference implementation. */
+#if defined(__GNUC__) && !defined(C0VM_SWITCH)
+#define C0VM_THREADED
+#endif
+
+/* Building with -DC0VM_JIT compiles functions to machine code once
+ * they have been called often enough (see lib/jit.h).  The compiled
+ * code is entered from the threaded code, so the switch loop never
+ * uses it, and it only exists on x86-64 Linux. */
+#if defined(C0VM_JIT) && !defined(C0VM_THREADED)
+#undef C0VM_JIT
+#endif
+
+/* Default limit on nested calls, overridden by $C0VM_MAX_DEPTH */
+#define C0VM_MAX_DEPTH 1000000
+
+/* Default number of calls before a function is compiled, overridden
+ * by $C0VM_JIT_THRESHOLD */
+#define C0VM_JIT_THRESHOLD 100
 
 /* call stack frames */
 typedef struct frame_info frame;
 struct frame_info {
-  c0v_stack_t S; /* Operand stack of C0 values */
+  c0v_mark mark; /* Caller's locals and operand stack window */
+  struct function_info *F;  /* Function being run */
   ubyte *P;      /* Function body */
   size_t pc;     /* Program counter */
-  c0_value *V;   /* The local variables */
+#ifdef C0VM_THREADED
+  void **T;      /* Threaded code for P */
+#endif
 };
 
+// Call native fn on the n arguments at args, which are still where
+// they were on the operand stack.  Natives take c0_ffi_values, which
+// are the VM's own values unless they are tagged.
+static c0_value call_native(native_fn *fn, c0_value *args, size_t n) {
+#ifndef C0VM_TAGGED
+  (void)n;
+  return fn(args);
+#else
+  c0_ffi_value buf[8];
+  c0_ffi_value *a = n <= 8 ? buf : xcalloc(n, sizeof(c0_ffi_value));
+  for (size_t i = 0; i < n; i++) a[i] = val2ffi(args[i]);
+  c0_value v = ffi2val(fn(a));
+  if (a != buf) free(a);
+  return v;
+#endif
+}
+
 // Helper function to push integers onto the operand stack.
 void push_int(c0v_stack_t S, int32_t i) {
   c0v_push(S, int2val(i));
@@ -31,27 +85,909 @@ int32_t pop_int(c0v_stack_t S) {
   return val2int(c0v_pop(S));
 }
 
-// Main execution function.
-int execute(struct bc0_file *bc0) {
-  REQUIRES(bc0 != NULL);
+// Does a basic block start at pc, so that the tracer records it?  What
+// runs from there to the next one follows from the code.
+static bool block_start(struct function_info *fi, size_t pc) {
+  if (pc == 0 || (fi->pcinfo[pc] & PC_TARGET)) return true;
+  if (!(fi->pcinfo[pc] & PC_INSTR)) return false;
+  size_t q = pc;
+  do q--; while (q > 0 && !(fi->pcinfo[q] & PC_INSTR));
+  switch (fi->code[q]) {
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT: case IF_ICMPGE:
+  case IF_ICMPGT: case IF_ICMPLE: case INVOKESTATIC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+#ifdef C0VM_THREADED
+/* Superinstructions: common cc0 instruction sequences are fused into
+ * one handler at the pc of their first instruction. The other pcs of
+ * the sequence keep their own handlers, so jumping into the middle of
+ * one still works. Fusions that skip kind checks are only made where
+ * analyze.c proved the kinds. */
+enum fusion {
+  FUSE_VLOAD_VLOAD_ICMP,          /* compare two locals and branch */
+  FUSE_VLOAD_BIPUSH_ICMP,         /* compare a local to a constant */
+  FUSE_VLOAD_BIPUSH_IADD_VSTORE,  /* add a constant to a local */
+  FUSE_VLOAD_BIPUSH_ISUB_VSTORE,  /* subtract a constant from a local */
+  FUSE_ALDC_INVOKENATIVE,         /* call a native on a string literal */
+  FUSE_COUNT
+};
+
+static const struct {
+  const char *name;
+  size_t instrs;                  /* instructions replaced */
+} fusion_info[FUSE_COUNT] = {
+  [FUSE_VLOAD_VLOAD_ICMP] = { "vload vload if_icmp", 3 },
+  [FUSE_VLOAD_BIPUSH_ICMP] = { "vload bipush if_icmp", 3 },
+  [FUSE_VLOAD_BIPUSH_IADD_VSTORE] = { "vload bipush iadd vstore", 4 },
+  [FUSE_VLOAD_BIPUSH_ISUB_VSTORE] = { "vload bipush isub vstore", 4 },
+  [FUSE_ALDC_INVOKENATIVE] = { "aldc invokenative", 2 },
+};
+
+struct vm_counts {
+  size_t fusion_sites[FUSE_COUNT];  /* fused at load time */
+  size_t fusion_runs[FUSE_COUNT];   /* times each ran */
+  size_t hoisted_loops;             /* loops with checks hoisted */
+  size_t hoisted_accesses;          /* array accesses in them */
+  size_t hoisted_entries;           /* loops entered unchecked */
+};
+
+/* Counted by the thread running a program, and added into the totals
+ * of the process when execute returns */
+static __thread struct vm_counts counts;
+static struct vm_counts counts_total;
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_counts(struct vm_counts *to, const struct vm_counts *c) {
+  for (size_t f = 0; f < FUSE_COUNT; f++) {
+    to->fusion_sites[f] += c->fusion_sites[f];
+    to->fusion_runs[f] += c->fusion_runs[f];
+  }
+  to->hoisted_loops += c->hoisted_loops;
+  to->hoisted_accesses += c->hoisted_accesses;
+  to->hoisted_entries += c->hoisted_entries;
+}
+
+static void flush_counts(void) {
+  pthread_mutex_lock(&counts_lock);
+  add_counts(&counts_total, &counts);
+  pthread_mutex_unlock(&counts_lock);
+  memset(&counts, 0, sizeof(counts));
+}
+
+/* Handlers for the superinstructions, IF_ICMP* ones by opcode */
+struct fused_handlers {
+  void *vload_vload_icmp[256];
+  void *vload_bipush_icmp[256];
+  void *vload_bipush_iadd_vstore;
+  void *vload_bipush_isub_vstore;
+  void *aldc_invokenative;
+};
+
+// Is there an instruction op at pc?
+static bool op_at(struct function_info *fi, size_t pc, ubyte op) {
+  return pc < fi->code_length && (fi->pcinfo[pc] & PC_INSTR)
+      && fi->code[pc] == op;
+}
+
+// The superinstruction starting at pc, or NULL if none applies.
+static void *fuse(struct bc0_file *bc0, struct function_info *fi, size_t pc,
+                  const struct fused_handlers *F) {
+  ubyte *P = fi->code;
+  enum fusion f;
+  void *h;
+
+  if (op_at(fi, pc, VLOAD) && (op_at(fi, pc + 2, VLOAD)
+                               || op_at(fi, pc + 2, BIPUSH))
+      && pc + 4 < fi->code_length && (fi->pcinfo[pc + 4] & PC_PROVEN)) {
+    bool var = P[pc + 2] == VLOAD;
+    if ((h = (var ? F->vload_vload_icmp : F->vload_bipush_icmp)[P[pc + 4]])
+        != NULL) {
+      f = var ? FUSE_VLOAD_VLOAD_ICMP : FUSE_VLOAD_BIPUSH_ICMP;
+    } else if (!var && op_at(fi, pc + 4, IADD) && op_at(fi, pc + 5, VSTORE)) {
+      f = FUSE_VLOAD_BIPUSH_IADD_VSTORE;
+      h = F->vload_bipush_iadd_vstore;
+    } else if (!var && op_at(fi, pc + 4, ISUB) && op_at(fi, pc + 5, VSTORE)) {
+      f = FUSE_VLOAD_BIPUSH_ISUB_VSTORE;
+      h = F->vload_bipush_isub_vstore;
+    } else {
+      return NULL;
+    }
+  } else if (op_at(fi, pc, ALDC) && op_at(fi, pc + 3, INVOKENATIVE)
+             && bc0->native_pool[(P[pc + 4] << 8) | P[pc + 5]].num_args == 1) {
+    f = FUSE_ALDC_INVOKENATIVE;
+    h = F->aldc_invokenative;
+  } else {
+    return NULL;
+  }
+
+  counts.fusion_sites[f]++;
+  return h;
+}
+
+// Report the superinstructions to stderr, registered with atexit so
+// that it also happens when the program ends with an error; the thread
+// that ends the process may still be in the middle of a run.
+static void print_fusion_stats(void) {
+  struct vm_counts all;
+  pthread_mutex_lock(&counts_lock);
+  all = counts_total;
+  pthread_mutex_unlock(&counts_lock);
+  add_counts(&all, &counts);
+  size_t saved = 0;
+  fprintf(stderr, "%-26s %8s %12s\n", "fusion", "sites", "executed");
+  for (size_t f = 0; f < FUSE_COUNT; f++) {
+    fprintf(stderr, "%-26s %8zu %12zu\n", fusion_info[f].name,
+            all.fusion_sites[f], all.fusion_runs[f]);
+    saved += all.fusion_runs[f] * (fusion_info[f].instrs - 1);
+  }
+  fprintf(stderr, "dispatches saved: %zu\n", saved);
+  fprintf(stderr, "bounds checks hoisted: %zu accesses in %zu loops, "
+          "entered unchecked %zu times\n",
+          all.hoisted_accesses, all.hoisted_loops, all.hoisted_entries);
+}
+
+/* Handlers for loops with hoisted bounds checks */
+struct loop_handlers {
+  void *guard;      /* at the head of the loop */
+  void *leave;      /* everywhere outside it, in its own threaded code */
+  void *aadds;      /* &A[i] with no checks */
+};
+
+// Give every loop over arrays in function fn (see analyze.h) a guard at
+// its head, and threaded code of its own in which the loop's accesses
+// &A[i] are unchecked, for the guard to switch to.  That code is the
+// function's own inside the loop, so nested loops still have their
+// guards; anywhere outside it switches back.
+static void hoist_bounds_checks(struct bc0_file *bc0, size_t fn,
+                                const struct loop_handlers *H) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  fi->loops = array_loops(bc0, fn, &fi->loop_count);
+
+  for (size_t k = 0; k < fi->loop_count; k++) {
+    struct array_loop *L = &fi->loops[k];
+    L->head_handler = fi->dispatch[L->head];
+    fi->dispatch[L->head] = H->guard;
+  }
+  for (size_t k = 0; k < fi->loop_count; k++) {
+    struct array_loop *L = &fi->loops[k];
+    L->fast = xcalloc(fi->code_length, sizeof(void*));
+    for (size_t pc = 0; pc < fi->code_length; pc++)
+      L->fast[pc] = L->head <= pc && pc <= L->end ? fi->dispatch[pc]
+                                                  : H->leave;
+    L->fast[L->head] = L->head_handler;
+    for (size_t a = 0; a < L->access_count; a++)
+      L->fast[L->accesses[a]] = H->aadds;
+    counts.hoisted_loops++;
+    counts.hoisted_accesses += L->access_count;
+  }
+}
+
+// Can the loop's accesses &A[i] go unchecked from its head on?  Works
+// out bound as the loop's own code does, but without any errors.
+static bool loop_guard(struct bc0_file *bc0, struct array_loop *L,
+                       ubyte *P, c0_value *V) {
+  c0_value stack[LOOP_BOUND_DEPTH];
+  size_t n = 0;
+  for (size_t pc = L->bound_start; pc < L->bound_end; ) {
+    switch (P[pc]) {
+    case VLOAD:
+      stack[n++] = V[P[pc + 1]];
+      pc += 2;
+      break;
+    case BIPUSH:
+      stack[n++] = int2val((int32_t)(int8_t)P[pc + 1]);
+      pc += 2;
+      break;
+    case ILDC:
+      stack[n++] = int2val(bc0->int_pool[(P[pc + 1] << 8) | P[pc + 2]]);
+      pc += 3;
+      break;
+    case ARRAYLENGTH: {
+      c0_array *a = val2ptr(stack[n - 1]);
+      if (a == NULL) return false;
+      stack[n - 1] = int2val(a->count);
+      pc++;
+      break;
+    }
+    default: {  /* IADD, ISUB or IMUL */
+      int32_t y = val2int(stack[--n]);
+      int32_t x = val2int(stack[n - 1]);
+      stack[n - 1] = int2val(P[pc] == IADD ? x + y
+                             : P[pc] == ISUB ? x - y : x * y);
+      pc++;
+      break;
+    }
+    }
+  }
+  int32_t bound = val2int(stack[0]);
+
+  if (val2int(V[L->index]) < 0) return false;
+  for (size_t a = 0; a < L->array_count; a++) {
+    c0_array *array = val2ptr(V[L->arrays[a]]);
+    if (array == NULL || bound > array->count) return false;
+  }
+  return true;
+}
+
+// Fill in the threaded code for every function in the program. Where
+// analyze.c proved the operand kinds, an unchecked handler is used if
+// there is one, and then superinstructions replace whatever they can.
+// Offsets that do not start an instruction jump to the invalid handler.
+// Calls to the natives in natives[] (by function table index) run
+// inline instead.  Bounds checks are hoisted out of the loops that
+// allow it.  When profiling, every instruction goes to the profile
+// handler instead.  Calls whose result is returned at once go to the
+// tail call handler.  When tracing, the start of every basic block
+// goes to the trace handler, and the handler it would have had follows
+// the function's threaded code, at code_length + pc.
+static void predecode(struct bc0_file *bc0, void *const handlers[256],
+                      void *const unchecked[256],
+                      const struct fused_handlers *fused,
+                      const struct loop_handlers *loops,
+                      void *const natives[NATIVE_FUNCTION_COUNT],
+                      void *invalid, void *profile, void *tail_call,
+                      void *trace) {
+  for (size_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *fi = &bc0->function_pool[i];
+    if (fi->dispatch != NULL) continue;
+
+    size_t n = fi->code_length;
+    fi->dispatch = xcalloc(trace != NULL ? 2 * n : n, sizeof(void*));
+    for (size_t pc = 0; pc < n; pc++) {
+      ubyte op = fi->code[pc];
+      void *h;
+      if (!(fi->pcinfo[pc] & PC_INSTR) || handlers[op] == NULL)
+        fi->dispatch[pc] = invalid;
+      else if (profile != NULL)
+        fi->dispatch[pc] = profile;
+      else if (fi->pcinfo[pc] & PC_TAIL)
+        fi->dispatch[pc] = tail_call;
+      else if ((h = fuse(bc0, fi, pc, fused)) != NULL)
+        fi->dispatch[pc] = h;
+      else if (op == INVOKENATIVE
+               && (h = natives[bc0->native_pool[(fi->code[pc + 1] << 8)
+                                                | fi->code[pc + 2]]
+                               .function_table_index]) != NULL)
+        fi->dispatch[pc] = h;
+      else if ((fi->pcinfo[pc] & PC_PROVEN) && unchecked[op] != NULL)
+        fi->dispatch[pc] = unchecked[op];
+      else
+        fi->dispatch[pc] = handlers[op];
+      if (trace != NULL && block_start(fi, pc)) {
+        fi->dispatch[n + pc] = fi->dispatch[pc];
+        fi->dispatch[pc] = trace;
+      }
+    }
+    if (profile == NULL) hoist_bounds_checks(bc0, i, loops);
+  }
+}
+
+/* Labels as values and computed goto are GNU extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+static void flush_counts(void) {}  /* only threaded code counts */
+#endif
+
+// A positive integer setting from the environment, def if it is unset.
+static size_t env_setting(const char *name, size_t def) {
+  char *s = getenv(name);
+  if (s == NULL) return def;
+
+  char *end;
+  unsigned long n = strtoul(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n == 0) {
+    fprintf(stderr, "Error: %s must be a positive integer\n", name);
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)n;
+}
+
+// Point bc0->strings at the interned copy, in strings, of every string
+// an aldc in the program loads.
+static void intern_strings(struct bc0_file *bc0,
+                           struct string_arena *strings) {
+  if (bc0->strings == NULL)
+    bc0->strings = xcalloc(bc0->string_count + 1, sizeof(char*));
+  for (size_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *fi = &bc0->function_pool[i];
+    for (size_t pc = 0; pc < fi->code_length; pc++) {
+      if (!(fi->pcinfo[pc] & PC_INSTR) || fi->code[pc] != ALDC) continue;
+      uint16_t s = (uint16_t)((fi->code[pc + 1] << 8) | fi->code[pc + 2]);
+      bc0->strings[s] = vm_string_intern(strings, &bc0->string_pool[s]);
+    }
+  }
+}
+
+#ifdef C0VM_JIT
+// Compile function fn and send every pc that has machine code to the
+// JIT handler. Its own handlers are kept for the instructions the
+// compiled code leaves to the interpreter.
+static void jit_enable(struct bc0_file *bc0, size_t fn, void *handler) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  if (fi->jit != NULL) return;  /* in an earlier execute */
+  fi->jit = jit_compile(bc0, fn);
+  if (fi->jit == NULL) return;
+  for (size_t pc = 0; pc < fi->code_length; pc++) {
+    if (!fi->jit->native[pc]) continue;
+    fi->dispatch[pc] = handler;
+    for (size_t k = 0; k < fi->loop_count; k++)
+      fi->loops[k].fast[pc] = handler;
+  }
+}
+#endif
 
-  // Operand stack of C0 values.
+/*** Snapshots (see snapshot.h) ***/
+
+/* The pcs where a run stops to take its snapshot, while it is armed:
+ * a flag per pc, for the functions that have any, which the switch
+ * loop looks at, and the slots of threaded code sent to do_SNAPSHOT
+ * instead, with what they held before. */
+struct breakpoints {
+  ubyte **at;
+  void ***slots;
+  void **saved;
+  size_t slot_count, slot_cap;
+  uintptr_t *foreign;       /* pointers natives returned, see below */
+  size_t foreign_count, foreign_cap;
+};
+
+/* What the natives that return memory of their own return */
+enum native_result { RESULT_OTHER, RESULT_STRING, RESULT_ARRAY,
+                     RESULT_STRINGS, RESULT_ARGS };
+
+static const ubyte native_results[NATIVE_FUNCTION_COUNT] = {
+  [NATIVE_ARGS_PARSE] = RESULT_ARGS,
+  [NATIVE_READLINE] = RESULT_STRING,
+  [NATIVE_FILE_READLINE] = RESULT_STRING,
+  [NATIVE_STRING_FROM_CHARARRAY] = RESULT_STRING,
+  [NATIVE_STRING_FROMBOOL] = RESULT_STRING,
+  [NATIVE_STRING_FROMCHAR] = RESULT_STRING,
+  [NATIVE_STRING_FROMINT] = RESULT_STRING,
+  [NATIVE_STRING_JOIN] = RESULT_STRING,
+  [NATIVE_STRING_SUB] = RESULT_STRING,
+  [NATIVE_STRING_TOLOWER] = RESULT_STRING,
+  [NATIVE_STRING_TO_CHARARRAY] = RESULT_ARRAY,
+  [NATIVE_PARSE_INTS] = RESULT_ARRAY,
+  [NATIVE_PARSE_TOKENS] = RESULT_STRINGS,
+};
+
+/* What args_parse returns */
+struct c0_args {
+  int32_t argc;
+  c0_array *argv;
+};
+
+// A copy in the heap of array a, and of its strings if it has them.
+// Only the values on the stack up to roots_end are live meanwhile.
+static c0_array *adopt_array(c0vm_ctx *ctx, c0_array *a, bool strings,
+                             c0_value *roots_end) {
+  c0_array *copy = gc_new_array(ctx->heap, a->count, a->elt_size,
+                                ctx->stack->data, roots_end);
+  memcpy(copy->elems, a->elems, (size_t)a->count * (size_t)a->elt_size);
+  char **elems = copy->elems;
+  if (strings)
+    for (int i = 0; i < a->count; i++)
+      if (elems[i] != NULL) elems[i] = vm_string_copy(ctx->strings, elems[i]);
+  return copy;
+}
+
+// While a snapshot is armed, whatever a native returns must be the
+// VM's own, or it would not be in the snapshot: strings are copied
+// into the arena, and arrays and the result of args_parse into the
+// heap.  Any other pointer (a file, an image, an int* from parse_int)
+// is noted, and no snapshot is taken while the program can still
+// reach it.  The result goes where the stack's top is, and it is
+// pushed there by the caller.
+static c0_value adopt_result(c0vm_ctx *ctx, uint16_t index, c0_value v) {
+  if (!val_is_ptr(v) || val2ptr_unchecked(v) == NULL) return v;
+  void *p = val2ptr_unchecked(v);
+  struct breakpoints *B = ctx->breakpoints;
+  c0v_stack_t S = ctx->stack;
+
+  switch (native_results[index]) {
+  case RESULT_STRING:
+    return ptr2val(vm_string_copy(ctx->strings, p));
+  case RESULT_ARRAY:
+  case RESULT_STRINGS:
+    return ptr2val(adopt_array(ctx, p, native_results[index] == RESULT_STRINGS,
+                               S->top));
+  case RESULT_ARGS: {
+    struct c0_args *args = p;
+    struct c0_args *copy = gc_new(ctx->heap, sizeof(struct c0_args),
+                                  S->data, S->top);
+    *S->top = ptr2val(copy);  /* live while the argv is copied */
+    copy->argc = args->argc;
+    copy->argv = args->argv == NULL ? NULL
+      : adopt_array(ctx, args->argv, true, S->top + 1);
+    return ptr2val(copy);
+  }
+  default:
+    if (B->foreign_count == B->foreign_cap) {
+      B->foreign_cap = B->foreign_cap == 0 ? 16 : 2 * B->foreign_cap;
+      B->foreign = xrealloc(B->foreign, B->foreign_cap * sizeof(uintptr_t));
+    }
+    B->foreign[B->foreign_count++] = (uintptr_t)p;
+    return v;
+  }
+}
+
+// Arm the breakpoints of ctx: before the instruction at its pc, or
+// before every call to its native.
+static void arm(c0vm_ctx *ctx, struct bc0_file *bc0) {
+  struct breakpoints *B = xcalloc(1, sizeof(struct breakpoints));
+  B->at = xcalloc(bc0->function_count, sizeof(ubyte*));
+  bool found = false;
+  for (size_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *fi = &bc0->function_pool[i];
+    for (size_t pc = 0; pc < fi->code_length; pc++) {
+      bool here;
+      if (!(fi->pcinfo[pc] & PC_INSTR)) here = false;
+      else if (ctx->snapshot_native < 0)
+        here = i == ctx->snapshot_fn && pc == ctx->snapshot_pc;
+      else
+        here = fi->code[pc] == INVOKENATIVE
+          && bc0->native_pool[(fi->code[pc + 1] << 8) | fi->code[pc + 2]]
+               .function_table_index == ctx->snapshot_native;
+      if (!here) continue;
+      if (B->at[i] == NULL) B->at[i] = xcalloc(fi->code_length, 1);
+      B->at[i][pc] = 1;
+      found = true;
+    }
+  }
+  ctx->breakpoints = B;
+  if (!found && ctx->err != NULL)
+    fprintf(ctx->err, "c0vm: the program never gets to where the snapshot "
+            "is to be taken\n");
+}
+
+#ifdef C0VM_THREADED
+// How many instructions the superinstruction h runs, 0 if it is not one
+static size_t fused_length(const struct fused_handlers *fused, void *h) {
+  if (h == fused->aldc_invokenative) return 2;
+  if (h == fused->vload_bipush_iadd_vstore
+      || h == fused->vload_bipush_isub_vstore)
+    return 4;
+  for (size_t op = 0; op < 256; op++)
+    if (h != NULL && (h == fused->vload_vload_icmp[op]
+                      || h == fused->vload_bipush_icmp[op]))
+      return 3;
+  return 0;
+}
+
+static void patch(struct breakpoints *B, void **slot) {
+  if (B->slot_count == B->slot_cap) {
+    B->slot_cap = B->slot_cap == 0 ? 16 : 2 * B->slot_cap;
+    B->slots = xrealloc(B->slots, B->slot_cap * sizeof(void**));
+    B->saved = xrealloc(B->saved, B->slot_cap * sizeof(void*));
+  }
+  B->slots[B->slot_count] = slot;
+  B->saved[B->slot_count++] = *slot;
+}
+
+// Send the breakpoints of ctx to handler, in the function's own
+// threaded code and that of its loops.  A superinstruction that runs
+// the instruction at a breakpoint stops as well, so the snapshot may
+// be taken up to three instructions early.  Superinstructions behind
+// the trace handler (see predecode) count too.
+static void patch_breakpoints(c0vm_ctx *ctx, struct bc0_file *bc0,
+                              void *handler,
+                              const struct fused_handlers *fused,
+                              void *trace) {
+  struct breakpoints *B = ctx->breakpoints;
+  for (size_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *fi = &bc0->function_pool[i];
+    if (B->at[i] == NULL) continue;
+    for (size_t pc = 0; pc < fi->code_length; pc++) {
+      if (B->at[i][pc] != 1) continue;
+      size_t q = pc;
+      for (size_t back = 1; back <= 3 && q > 0; back++) {
+        do q--; while (q > 0 && !(fi->pcinfo[q] & PC_INSTR));
+        void *h = fi->dispatch[q];
+        for (size_t k = 0; k < fi->loop_count; k++)
+          if (fi->loops[k].head == q) h = fi->loops[k].head_handler;
+        if (h == trace) h = fi->dispatch[fi->code_length + q];
+        if (fused_length(fused, h) > back) B->at[i][q] = 2;
+      }
+    }
+    for (size_t pc = 0; pc < fi->code_length; pc++) {
+      if (B->at[i][pc] == 0) continue;
+      patch(B, &fi->dispatch[pc]);
+      for (size_t k = 0; k < fi->loop_count; k++)
+        patch(B, &fi->loops[k].fast[pc]);
+    }
+  }
+  for (size_t i = 0; i < B->slot_count; i++) *B->slots[i] = handler;
+}
+#endif
+
+static void disarm(c0vm_ctx *ctx, struct bc0_file *bc0) {
+  struct breakpoints *B = ctx->breakpoints;
+  while (B->slot_count > 0) {
+    B->slot_count--;
+    *B->slots[B->slot_count] = B->saved[B->slot_count];
+  }
+  for (size_t i = 0; i < bc0->function_count; i++) free(B->at[i]);
+  free(B->at);
+  free(B->slots);
+  free(B->saved);
+  free(B->foreign);
+  free(B);
+  ctx->breakpoints = NULL;
+}
+
+static int compare_words(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static bool write_snapshot(FILE *f, c0vm_ctx *ctx, struct bc0_file *bc0,
+                           c0v_stack_t S, frame *frames, size_t depth,
+                           struct function_info *F, size_t pc) {
+  size_t values = (size_t)(S->top - S->data);
+  bool ok = snapshot_put_header(f, bc0)
+    && vm_strings_save(ctx->strings, f)
+    && gc_save(ctx->heap, f)
+    && snapshot_put_word(f, (uint64_t)(F - bc0->function_pool))
+    && snapshot_put_word(f, pc)
+    && snapshot_put_word(f, depth)
+    && snapshot_put_word(f, S->capacity)
+    && snapshot_put_word(f, values)
+    && snapshot_put_word(f, (uint64_t)(S->locals - S->data))
+    && snapshot_put_word(f, (uint64_t)(S->base - S->data))
+    && snapshot_put_word(f, (uint64_t)(S->limit - S->data))
+    && snapshot_put(f, S->data, values * sizeof(c0_value));
+  for (size_t d = 0; ok && d < depth; d++)
+    ok = snapshot_put_word(f, (uint64_t)(frames[d].F - bc0->function_pool))
+      && snapshot_put_word(f, frames[d].pc)
+      && snapshot_put_word(f, frames[d].mark.locals)
+      && snapshot_put_word(f, frames[d].mark.base)
+      && snapshot_put_word(f, frames[d].mark.limit);
+  return ok;
+}
+
+// The run is at a breakpoint: collect, write the snapshot unless the
+// program can still reach memory a native made, and disarm, so that
+// the run carries on as if it had never stopped.
+static void take_snapshot(c0vm_ctx *ctx, struct bc0_file *bc0,
+                          c0v_stack_t S, frame *frames, size_t depth,
+                          struct function_info *F, size_t pc) {
+  struct breakpoints *B = ctx->breakpoints;
+  gc_collect(ctx->heap, S->data, S->top);
+
+  qsort(B->foreign, B->foreign_count, sizeof(uintptr_t), compare_words);
+  bool foreign = gc_refers_to(ctx->heap, B->foreign, B->foreign_count);
+  for (c0_value *v = S->data; v < S->top && !foreign; v++) {
+    uintptr_t p = val_is_ptr(*v) ? (uintptr_t)val2ptr_unchecked(*v) : 0;
+    foreign = p != 0 && bsearch(&p, B->foreign, B->foreign_count,
+                                sizeof(uintptr_t), compare_words) != NULL;
+  }
+
+  if (foreign) {
+    if (ctx->err != NULL)
+      fprintf(ctx->err, "c0vm: no snapshot taken, the program still has "
+              "memory a native made\n");
+  } else {
+    FILE *f = fopen(ctx->snapshot, "wb");
+    bool ok = f != NULL
+      && write_snapshot(f, ctx, bc0, S, frames, depth, F, pc);
+    if (f != NULL && fclose(f) != 0) ok = false;
+    if (!ok && ctx->err != NULL)
+      fprintf(ctx->err, "c0vm: couldn't write snapshot %s\n", ctx->snapshot);
+  }
+  disarm(ctx, bc0);
+}
+
+static bool read_stacks(FILE *f, struct bc0_file *bc0, size_t max_depth,
+                        c0v_stack_t S, frame *frames, size_t *depth,
+                        struct function_info **F, size_t *pc) {
+  uint64_t fn, at, d, capacity, top, locals, base, limit;
+  if (!snapshot_get_word(f, &fn) || !snapshot_get_word(f, &at)
+      || !snapshot_get_word(f, &d) || !snapshot_get_word(f, &capacity)
+      || !snapshot_get_word(f, &top) || !snapshot_get_word(f, &locals)
+      || !snapshot_get_word(f, &base) || !snapshot_get_word(f, &limit))
+    return false;
+  if (fn >= bc0->function_count || d > max_depth
+      || at >= bc0->function_pool[fn].code_length
+      || !(bc0->function_pool[fn].pcinfo[at] & PC_INSTR)
+      || !(locals <= base && base <= top && top <= limit
+           && limit <= capacity && capacity <= SIZE_MAX / sizeof(c0_value)))
+    return false;
+
+  c0_value *data = xcalloc((size_t)capacity, sizeof(c0_value));
+  bool ok = snapshot_get(f, data, (size_t)top * sizeof(c0_value));
+  for (size_t i = 0; ok && i < d; i++) {
+    uint64_t caller, caller_pc, m[3];
+    ok = snapshot_get_word(f, &caller) && snapshot_get_word(f, &caller_pc)
+      && snapshot_get_word(f, &m[0]) && snapshot_get_word(f, &m[1])
+      && snapshot_get_word(f, &m[2])
+      && caller < bc0->function_count
+      && caller_pc <= bc0->function_pool[caller].code_length
+      && m[0] <= m[1] && m[1] <= m[2] && m[2] <= capacity;
+    if (!ok) break;
+    frames[i].F = &bc0->function_pool[caller];
+    frames[i].P = frames[i].F->code;
+    frames[i].pc = (size_t)caller_pc;
+    frames[i].mark.locals = (size_t)m[0];
+    frames[i].mark.base = (size_t)m[1];
+    frames[i].mark.limit = (size_t)m[2];
+  }
+  if (!ok) {
+    free(data);
+    return false;
+  }
+
+  free(S->data);
+  S->data = data;
+  S->capacity = (size_t)capacity;
+  S->top = data + top;
+  S->locals = data + locals;
+  S->base = data + base;
+  S->limit = data + limit;
+  *depth = (size_t)d;
+  *F = &bc0->function_pool[fn];
+  *pc = (size_t)at;
+  return true;
+}
+
+// Carry on from the snapshot ctx->restore instead of the start of
+// main: the strings and the heap are put back first, then the stacks.
+// If that cannot be done, everything is left as it was.
+static bool resume(c0vm_ctx *ctx, struct bc0_file *bc0, c0v_stack_t S,
+                   frame *frames, size_t *depth,
+                   struct function_info **F, size_t *pc) {
+  FILE *f = fopen(ctx->restore, "rb");
+  struct string_arena *strings = vm_strings_new();
+  bool ok = f != NULL && snapshot_check_header(f, bc0)
+    && vm_strings_restore(strings, f);
+  bool heap = ok && gc_restore(ctx->heap, f);
+  ok = heap && read_stacks(f, bc0, ctx->max_depth, S, frames, depth, F, pc);
+  if (f != NULL) fclose(f);
+
+  if (!ok) {
+    if (heap) gc_free_all(ctx->heap);
+    vm_strings_free(strings);
+    if (ctx->err != NULL)
+      fprintf(ctx->err, "c0vm: couldn't restore snapshot %s, starting "
+              "over\n", ctx->restore);
+    return false;
+  }
+  vm_strings_free(ctx->strings);
+  ctx->strings = strings;
+  return true;
+}
+
+c0vm_ctx *c0vm_ctx_new(int argc, char **argv) {
+  c0vm_ctx *ctx = xcalloc(1, sizeof(c0vm_ctx));
+  ctx->argc = argc;
+  ctx->argv = argv;
+  ctx->err = stderr;
+  ctx->unwind = false;
+  ctx->max_depth = env_setting("C0VM_MAX_DEPTH", C0VM_MAX_DEPTH);
+  ctx->trace = env_setting("C0VM_TRACE", 0);
+  ctx->snapshot = NULL;
+  ctx->snapshot_native = -1;
+  ctx->restore = NULL;
+  ctx->status = C0VM_DONE;
+  ctx->heap = gc_heap_new();
+  ctx->strings = vm_strings_new();
+  return ctx;
+}
+
+void c0vm_ctx_free(c0vm_ctx *ctx) {
+  REQUIRES(ctx != NULL && ctx->stack == NULL);
+  gc_heap_free(ctx->heap);
+  vm_strings_free(ctx->strings);
+  free(ctx->message);
+  free(ctx);
+}
+
+static int run(c0vm_ctx *ctx, struct bc0_file *bc0);
+
+// Main execution function.  A runtime error that unwinds (see
+// c0vm_abort.c) lands here, with the stacks of the run to free.
+int execute(c0vm_ctx *ctx, struct bc0_file *bc0) {
+  REQUIRES(ctx != NULL && bc0 != NULL);
+  c0vm_ctx *outer = c0vm_set_current(ctx);
+  if (ctx->argv != NULL) {
+    c0_argc = ctx->argc;
+    c0_argv = ctx->argv;
+  }
+  ctx->status = C0VM_DONE;
+  free(ctx->message);
+  ctx->message = NULL;
+
+  if (setjmp(ctx->on_error) != 0) {
+    if (ctx->breakpoints != NULL) disarm(ctx, bc0);
+    if (ctx->tracer != NULL) {
+      if (ctx->err != NULL) trace_print(ctx->tracer, ctx->err);
+      trace_free(ctx->tracer);
+      ctx->tracer = NULL;
+    }
+    if (ctx->stack != NULL) c0v_stack_free(ctx->stack);
+    free(ctx->frames);
+    gc_free_all(ctx->heap);
+    ctx->stack = NULL;
+    ctx->frames = NULL;
+    flush_counts();
+    gc_stats_flush();
+    c0vm_set_current(outer);
+    return 0;
+  }
+  int result = run(ctx, bc0);
+  flush_counts();
+  gc_stats_flush();
+  c0vm_set_current(outer);
+  return result;
+}
+
+static int run(c0vm_ctx *ctx, struct bc0_file *bc0) {
+  struct gc_heap *heap = ctx->heap;
+
+  // Verify the code and work out how much operand stack each function
+  // needs and where operand kinds need no checking.
+  analyze_program(bc0);
+
+  // Every native is looked up in the function table once, not on
+  // every call.
+  if (bc0->natives == NULL && bc0->native_count > 0) {
+    bc0->natives = xcalloc(bc0->native_count, sizeof(native_fn*));
+    for (size_t i = 0; i < bc0->native_count; i++)
+      bc0->natives[i] =
+        native_function_table[bc0->native_pool[i].function_table_index];
+  }
+
+  // With the profiler on, every instruction is reported to it first.
+  bool profiling = profile_start(bc0);
+
+  // With the tracer on, likewise recorded (see trace.h).
+  struct trace *tracer = ctx->trace > 0 ? trace_new(ctx->trace) : NULL;
+  ctx->tracer = tracer;
+
+  // Local variables and operand stacks of all active calls, one window
+  // per call. Execution always starts with the main function (first in
+  // array), whose locals start out zeroed.
+  struct function_info *main_fn = &bc0->function_pool[0];
   c0v_stack_t S = c0v_stack_new();
+  ctx->stack = S;
+  c0v_enter(S, 0, main_fn->num_vars, main_fn->max_stack);
 
-  // Array of bytes that make up the current function.
-  // Execution always starts with the main function (first in array).
-  ubyte *P = bc0->function_pool[0].code;
+  // The local variables of the current function.
+  c0_value *V = S->locals;
+
+  // The current function and the array of bytes that make up its code.
+  struct function_info *F = main_fn;
+  ubyte *P = main_fn->code;
 
   // Current location within the current byte array P. 
   size_t pc = 0;
 
-  // Initialize local variables array.
-  uint16_t vars = bc0->function_pool[0].num_vars;
-  c0_value *V = xcalloc(vars, sizeof(c0_value));
-  ASSERT(V != NULL);
+  // The call stack, one frame per active caller, innermost last. All
+  // frames live in one block that is reused in LIFO order.
+  size_t max_depth = ctx->max_depth;
+  frame *frames = xcalloc(max_depth, sizeof(frame));
+  ctx->frames = frames;
+  size_t depth = 0;
+
+  // A run restored from a snapshot starts where that one stopped, with
+  // the strings and the heap it had.
+  if (ctx->restore != NULL && resume(ctx, bc0, S, frames, &depth, &F, &pc)) {
+    V = S->locals;
+    P = F->code;
+  }
+  struct string_arena *strings = ctx->strings;
+
+  // String constants are interned once per run, in its context.
+  intern_strings(bc0, strings);
+
+  // Where to take a snapshot, if the run is to take one
+  if (ctx->snapshot != NULL) arm(ctx, bc0);
+
+#ifdef C0VM_THREADED
+  static void *const handlers[256] = {
+    [POP] = &&do_POP, [DUP] = &&do_DUP, [SWAP] = &&do_SWAP,
+    [RETURN] = &&do_RETURN,
+    [IADD] = &&do_IADD, [ISUB] = &&do_ISUB, [IMUL] = &&do_IMUL,
+    [IDIV] = &&do_IDIV, [IREM] = &&do_IREM, [IAND] = &&do_IAND,
+    [IOR] = &&do_IOR, [IXOR] = &&do_IXOR, [ISHL] = &&do_ISHL,
+    [ISHR] = &&do_ISHR,
+    [BIPUSH] = &&do_BIPUSH, [ILDC] = &&do_ILDC, [ALDC] = &&do_ALDC,
+    [ACONST_NULL] = &&do_ACONST_NULL,
+    [VLOAD] = &&do_VLOAD, [VSTORE] = &&do_VSTORE,
+    [ATHROW] = &&do_ATHROW, [ASSERT] = &&do_ASSERT,
+    [NOP] = &&do_NOP,
+    [IF_CMPEQ] = &&do_IF_CMPEQ, [IF_CMPNE] = &&do_IF_CMPNE,
+    [IF_ICMPLT] = &&do_IF_ICMPLT, [IF_ICMPGE] = &&do_IF_ICMPGE,
+    [IF_ICMPGT] = &&do_IF_ICMPGT, [IF_ICMPLE] = &&do_IF_ICMPLE,
+    [GOTO] = &&do_GOTO,
+    [INVOKESTATIC] = &&do_INVOKESTATIC, [INVOKENATIVE] = &&do_INVOKENATIVE,
+    [NEW] = &&do_NEW, [NEWARRAY] = &&do_NEWARRAY,
+    [ARRAYLENGTH] = &&do_ARRAYLENGTH,
+    [AADDF] = &&do_AADDF, [AADDS] = &&do_AADDS,
+    [IMLOAD] = &&do_IMLOAD, [IMSTORE] = &&do_IMSTORE,
+    [AMLOAD] = &&do_AMLOAD, [AMSTORE] = &&do_AMSTORE,
+    [CMLOAD] = &&do_CMLOAD, [CMSTORE] = &&do_CMSTORE,
+  };
+  static void *const unchecked[256] = {
+    [IADD] = &&do_IADD_U, [ISUB] = &&do_ISUB_U, [IMUL] = &&do_IMUL_U,
+    [IDIV] = &&do_IDIV_U, [IREM] = &&do_IREM_U, [IAND] = &&do_IAND_U,
+    [IOR] = &&do_IOR_U, [IXOR] = &&do_IXOR_U, [ISHL] = &&do_ISHL_U,
+    [ISHR] = &&do_ISHR_U,
+    [IF_ICMPLT] = &&do_IF_ICMPLT_U, [IF_ICMPGE] = &&do_IF_ICMPGE_U,
+    [IF_ICMPGT] = &&do_IF_ICMPGT_U, [IF_ICMPLE] = &&do_IF_ICMPLE_U,
+    [ARRAYLENGTH] = &&do_ARRAYLENGTH_U,
+    [AADDF] = &&do_AADDF_U, [AADDS] = &&do_AADDS_U,
+    [IMLOAD] = &&do_IMLOAD_U, [IMSTORE] = &&do_IMSTORE_U,
+    [AMLOAD] = &&do_AMLOAD_U, [AMSTORE] = &&do_AMSTORE_U,
+    [CMLOAD] = &&do_CMLOAD_U, [CMSTORE] = &&do_CMSTORE_U,
+  };
+  static const struct fused_handlers fused = {
+    .vload_vload_icmp = {
+      [IF_ICMPLT] = &&do_VLOAD_VLOAD_ICMPLT,
+      [IF_ICMPGE] = &&do_VLOAD_VLOAD_ICMPGE,
+      [IF_ICMPGT] = &&do_VLOAD_VLOAD_ICMPGT,
+      [IF_ICMPLE] = &&do_VLOAD_VLOAD_ICMPLE,
+    },
+    .vload_bipush_icmp = {
+      [IF_ICMPLT] = &&do_VLOAD_BIPUSH_ICMPLT,
+      [IF_ICMPGE] = &&do_VLOAD_BIPUSH_ICMPGE,
+      [IF_ICMPGT] = &&do_VLOAD_BIPUSH_ICMPGT,
+      [IF_ICMPLE] = &&do_VLOAD_BIPUSH_ICMPLE,
+    },
+    .vload_bipush_iadd_vstore = &&do_VLOAD_BIPUSH_IADD_VSTORE,
+    .vload_bipush_isub_vstore = &&do_VLOAD_BIPUSH_ISUB_VSTORE,
+    .aldc_invokenative = &&do_ALDC_INVOKENATIVE,
+  };
+  static const struct loop_handlers loop_handlers = {
+    .guard = &&do_LOOP_GUARD, .leave = &&do_LOOP_LEAVE,
+    .aadds = &&do_AADDS_H,
+  };
+  static void *const natives[NATIVE_FUNCTION_COUNT] = {
+    [NATIVE_STRING_LENGTH] = &&do_STRING_LENGTH,
+    [NATIVE_STRING_CHARAT] = &&do_STRING_CHARAT,
+    [NATIVE_STRING_JOIN] = &&do_STRING_JOIN,
+    [NATIVE_STRING_EQUAL] = &&do_STRING_EQUAL,
+    [NATIVE_CHAR_ORD] = &&do_CHAR_ORD,
+    [NATIVE_CHAR_CHR] = &&do_CHAR_CHR,
+  };
+  static bool stats_registered = false;
+  if (getenv("C0VM_FUSION_STATS") != NULL
+      && !__atomic_exchange_n(&stats_registered, true, __ATOMIC_RELAXED))
+    atexit(print_fusion_stats);
+  predecode(bc0, handlers, unchecked, &fused, &loop_handlers, natives,
+            &&do_invalid,
+            profiling ? &&do_PROFILE : NULL, &&do_INVOKESTATIC_TAIL,
+            tracer != NULL ? &&do_TRACE : NULL);
+  if (ctx->breakpoints != NULL)
+    patch_breakpoints(ctx, bc0, &&do_SNAPSHOT, &fused, &&do_TRACE);
+
+#ifdef C0VM_JIT
+  // Compiled code would bypass the profiler, so nothing is compiled
+  // while profiling or tracing, nor before the snapshot is taken.
+  uint32_t jit_setting = profiling || tracer != NULL ? 0
+    : (uint32_t)env_setting("C0VM_JIT_THRESHOLD", C0VM_JIT_THRESHOLD);
+  uint32_t jit_threshold = ctx->breakpoints != NULL ? 0 : jit_setting;
+  main_fn->calls = 1;
+  if (jit_threshold == 1) jit_enable(bc0, 0, &&do_JIT);
+#endif
+
+  // Threaded code for the current function, indexed by pc like P, and
+  // for the callers of a restored run
+  void **T = F->dispatch;
+  for (size_t d = 0; d < depth; d++) frames[d].T = frames[d].F->dispatch;
+
+#define CASE(OP) do_##OP
+#define NEXT goto *T[pc]
 
-  // The call stack, a generic stack that should contain pointers to frames.
-  gstack_t callStack = stack_new();
+  NEXT;
+  {
+#else
+#define CASE(OP) case OP
+#define NEXT continue
 
   while (true) {
 /*
@@ -61,114 +997,128 @@ int execute(struct bc0_file *bc0) {
             P[pc], c0v_stack_size(S), pc);
 #endif
 */
+    if (profiling) profile_instr((size_t)(F - bc0->function_pool), P, pc);
+    if (tracer != NULL && block_start(F, pc))
+      trace_record(tracer, (size_t)(F - bc0->function_pool), pc, P[pc],
+                   S->base, S->top);
+    if (ctx->breakpoints != NULL
+        && ctx->breakpoints->at[F - bc0->function_pool] != NULL
+        && ctx->breakpoints->at[F - bc0->function_pool][pc])
+      take_snapshot(ctx, bc0, S, frames, depth, F, pc);
     switch (P[pc]) {
+#endif
 
     /* Additional stack operation: */
 
-    case POP: {
+    CASE(POP): {
       pc++;
       c0v_pop(S);
-      break;
+      NEXT;
     }
 
-    case DUP: {
+    CASE(DUP): {
       pc++;
       c0_value v = c0v_pop(S);
       c0v_push(S,v);
       c0v_push(S,v);
-      break;
+      NEXT;
     }
 
-    case SWAP: {
+    CASE(SWAP): {
       pc++;
       c0_value v2 = c0v_pop(S);
       c0_value v1 = c0v_pop(S);
       c0v_push(S, v2);
       c0v_push(S, v1);
-      break;
+      NEXT;
     }
 
     // Returning from a function.
-    case RETURN: {
+    CASE(RETURN): {
 /*      
 #ifdef DEBUG
       fprintf(stderr, "Returning %d from execute()\n", retval);
 #endif
 */
-      // Free local variable array.
-      free(V);
+      // Obtain return value from operand stack.
+      c0_value val = c0v_pop(S);
+      assert(c0v_stack_empty(S));
 
-      if (stack_empty(callStack)) {
+      if (depth == 0) {
 
-        // Obtain return value from operand stack.
-        c0_value val = c0v_pop(S);
-        assert(c0v_stack_empty(S));
         int retval = val2int(val);
 
         // Free operand and call stack.
+        if (ctx->breakpoints != NULL) disarm(ctx, bc0);
+        if (tracer != NULL) {
+          if (ctx->err != NULL) trace_print(tracer, ctx->err);
+          trace_free(tracer);
+          ctx->tracer = NULL;
+        }
         c0v_stack_free(S);
-        stack_free(callStack, NULL);
+        free(frames);
+        gc_free_all(heap);
+        ctx->stack = NULL;
+        ctx->frames = NULL;
 
         // Return excecuted function value.
         return retval;
-      
-      } else {
 
-        // Obtain return value from operand stack.
-        c0_value val = c0v_pop(S);
-        // Free current operand stack.
-        c0v_stack_free(S);
+      } else {
 
-        // Pop top frame off and restore variables
-        frame *current = (frame*)pop(callStack);
-        ASSERT(current != NULL);
-        S = current->S;
+        // Pop top frame off and restore variables; this discards the
+        // returning function's locals.
+        frame *current = &frames[--depth];
+        c0v_leave(S, current->mark);
+        V = S->locals;
+        F = current->F;
         P = current->P;
         pc = current->pc;
-        V = current->V;
+#ifdef C0VM_THREADED
+        T = current->T;
+#endif
 
-        // Free frame and push returned value onto operand stack.
-        free(current);
+        // Push returned value onto operand stack.
         c0v_push(S, val);
 
-        break;
+        NEXT;
       }
     }
 
     /* Arithmetic and Logical operations */
 
     // Addition arithmetic operation.
-    case IADD: {
+    CASE(IADD): {
       pc++;
       int val2 = pop_int(S);
       int val1 = pop_int(S);
       int sum = val1 + val2;
       push_int(S, sum);
-      break;
+      NEXT;
     }
 
     // Subtraction arithmetic operation.
-    case ISUB: {
+    CASE(ISUB): {
       pc++;
       int val4 = pop_int(S);
       int val3 = pop_int(S);
       int diff = val3 - val4;
       push_int(S, diff);
-      break;
+      NEXT;
     }
 
     // Multiplication arithmetic operation.
-    case IMUL: {
+    CASE(IMUL): {
       pc++;
       int val6 = pop_int(S);
       int val5 = pop_int(S);
       int product = val5 * val6;
       push_int(S, product);
-      break;
+      NEXT;
     }
 
     // Division arithmetic operation.
-    case IDIV: {
+    CASE(IDIV): {
       pc++;
       int val8 = pop_int(S);
       if (val8 == 0) c0_arith_error("division by 0.");
@@ -178,11 +1128,11 @@ int execute(struct bc0_file *bc0) {
       }
       int div = val7 / val8;
       push_int(S, div);
-      break;
+      NEXT;
     }
 
     // Modulo arithmetic operation.
-    case IREM: {
+    CASE(IREM): {
       pc++;
       int val10 = pop_int(S);
       if (val10 == 0) c0_arith_error("division by 0.");
@@ -192,41 +1142,41 @@ int execute(struct bc0_file *bc0) {
       }
       int rem = val9 % val10;
       push_int(S, rem);
-      break;
+      NEXT;
     }
 
     // Logical AND operation.
-    case IAND: {
+    CASE(IAND): {
       pc++;
       int y1 = pop_int(S);
       int x1 = pop_int(S);
       int and = x1 & y1;
       push_int(S, and);
-      break;
+      NEXT;
     }
 
     // Logical OR operation.
-    case IOR: {
+    CASE(IOR): {
       pc++;
       int y2 = pop_int(S);
       int x2 = pop_int(S);
       int or = x2 | y2;
       push_int(S, or);
-      break;
+      NEXT;
     }
 
     // Logical XOR (exclusive or) operation.
-    case IXOR: {
+    CASE(IXOR): {
       pc++;
       int y3 = pop_int(S);
       int x3 = pop_int(S);
       int xor = x3 ^ y3;
       push_int(S, xor);
-      break;
+      NEXT;
     }
 
     // Bit-shifting: left shift operation.
-    case ISHL: {
+    CASE(ISHL): {
       pc++;
       int y4 = pop_int(S);
       if (0 <= y4 && y4 < 32) {
@@ -236,11 +1186,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         c0_arith_error("division by 0.");
       }
-      break;
+      NEXT;
     }
 
     // Bit-shifting: right shift operation.
-    case ISHR: {
+    CASE(ISHR): {
       pc++;
       int y5 = pop_int(S);
       if (0 <= y5 && y5 < 32) {
@@ -250,97 +1200,97 @@ int execute(struct bc0_file *bc0) {
       } else {
         c0_arith_error("division by 0.");
       }
-      break;
+      NEXT;
     }
 
     /* Pushing constants */
 
     // Integer constant (from instruction operand) loading instruction.
-    case BIPUSH: {
+    CASE(BIPUSH): {
       pc += 2;
       int32_t num = (int32_t)(byte)P[pc - 1];
       push_int(S, num);
-      break;
+      NEXT;
     }
 
     // Integer constant loading instruction (from integer pool).
-    case ILDC: {
+    CASE(ILDC): {
       pc += 3;
       uint32_t indexI = (((uint32_t)P[pc - 2]) << 8) | ((uint32_t)P[pc - 1]);
       int32_t const1 = bc0->int_pool[indexI];
       push_int(S, const1);
-      break;
+      NEXT;
     }
 
     // String constant loading instruction (from string pool).
-    case ALDC: {
+    CASE(ALDC): {
       pc += 3;
       uint16_t indexS = (((uint16_t)P[pc - 2]) << 8) | ((uint16_t)P[pc - 1]);
-      char* const2 = &(bc0->string_pool[indexS]);
+      char* const2 = bc0->strings[indexS];
       c0v_push(S, ptr2val((void*)const2));
-      break;
+      NEXT;
     }
 
     // NULL constant loading instruction.
-    case ACONST_NULL: {
+    CASE(ACONST_NULL): {
       pc++;
       c0_value nul = ptr2val((void*)0);
       c0v_push(S, nul);
-      break;
+      NEXT;
     }
 
     /* Operations on local variables */
 
     // Load local variable from V onto operand stack.
-    case VLOAD: {
+    CASE(VLOAD): {
       pc += 2;
       c0_value load = V[P[pc - 1]];
       c0v_push(S, load);
-      break;
+      NEXT;
     }
 
     // Store local variable from operand stack in V.
-    case VSTORE: {
+    CASE(VSTORE): {
       pc += 2;
       c0_value store = c0v_pop(S);
       V[P[pc - 1]] = store;
-      break;
+      NEXT;
     }
 
     /* Assertions and errors */
 
     // Implements C0 built-in error() function.
-    case ATHROW: {
+    CASE(ATHROW): {
       pc++;
       c0_value errV = c0v_pop(S);
-      char* errmsg = (char*)val2ptr(errV);
+      char* errmsg = vm_string_flatten(strings, (char*)val2ptr(errV));
       c0_user_error(errmsg);
-      break;
+      NEXT;
     }
 
     // Implements C0 contracts and assertions.
-    case ASSERT: {
+    CASE(ASSERT): {
       pc++;
       c0_value err = c0v_pop(S);
       int x = pop_int(S);
       if (x == 0) {
-        char* msg = (char*)val2ptr(err);
+        char* msg = vm_string_flatten(strings, (char*)val2ptr(err));
         c0_assertion_failure(msg);
       }
-      break;
+      NEXT;
     }
 
     /* Control flow operations */
     /* Implements conditional instructions for PC jumps (loops). */
 
     // Instruction has no effect.
-    case NOP: {
+    CASE(NOP): {
       pc++;
-      break;
+      NEXT;
     }
 
     // PC increments by offset if values are equal.
-    case IF_CMPEQ: {
+    CASE(IF_CMPEQ): {
       c0_value v2 = c0v_pop(S);
       c0_value v1 = c0v_pop(S);
       if (val_equal(v1, v2)) {
@@ -351,11 +1301,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset if values are not equal.
-    case IF_CMPNE: {
+    CASE(IF_CMPNE): {
       c0_value v2 = c0v_pop(S);
       c0_value v1 = c0v_pop(S);
       if (!val_equal(v1, v2)) {
@@ -366,11 +1316,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset if x is less than y.
-    case IF_ICMPLT: {
+    CASE(IF_ICMPLT): {
       int y1 = pop_int(S);
       int x1 = pop_int(S);
       if (x1 < y1) {
@@ -381,11 +1331,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset if x is greater than/equal to y.
-    case IF_ICMPGE: {
+    CASE(IF_ICMPGE): {
       int y2 = pop_int(S);
       int x2 = pop_int(S);
       if (x2 >= y2) {
@@ -396,11 +1346,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset if x is greater than y.
-    case IF_ICMPGT: {
+    CASE(IF_ICMPGT): {
       int y3 = pop_int(S);
       int x3 = pop_int(S);
       if (x3 > y3) {
@@ -411,11 +1361,11 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset if x is less than/equal to y.
-    case IF_ICMPLE: {
+    CASE(IF_ICMPLE): {
       int y4 = pop_int(S);
       int x4 = pop_int(S);
       if (x4 <= y4) {
@@ -426,126 +1376,156 @@ int execute(struct bc0_file *bc0) {
       } else {
         pc += 3;
       }
-      break;
+      NEXT;
     }
 
     // PC increments by offset.
-    case GOTO: {
+    CASE(GOTO): {
       int16_t o1 = (int16_t)(uint16_t)P[pc + 1];
       int16_t o2 = (int16_t)(uint16_t)P[pc + 2];
       int16_t off = (int16_t)((o1 << 8) | o2);
       pc += off;
-      break;
+      NEXT;
     }
 
     /* Function call operations: */
 
     // Implements local function calls.
-    case INVOKESTATIC: {
+    CASE(INVOKESTATIC): {
+#ifndef C0VM_THREADED
+      if ((F->pcinfo[pc] & PC_TAIL) && !profiling)
+        goto do_INVOKESTATIC_TAIL;
+#endif
 
       // Update PC and obtain bytes for function pool index.
       pc += 3;
       uint16_t c1 = (uint16_t)P[pc - 2];
       uint16_t c2 = (uint16_t)P[pc - 1];
 
-      // Initialize frame and push onto callStack.
-      frame *f = xmalloc(sizeof(frame));
-      ASSERT(f != NULL);
-      f->S = S;
+      uint16_t index = (uint16_t)(c1 << 8) | c2;
+      struct function_info *callee = &bc0->function_pool[index];
+
+      // Initialize frame and push onto the call stack.
+      if (depth == max_depth) {
+        c0_memory_error("call stack overflow.");
+      }
+      frame *f = &frames[depth++];
+      f->F = F;
       f->P = P;
       f->pc = pc;
-      f->V = V;
-      push(callStack, (void*)f);
+#ifdef C0VM_THREADED
+      f->T = T;
+#endif
+
+      // The arguments on top of the old operand stack become the first
+      // local variables of the callee, in place.
+      f->mark = c0v_enter(S, callee->num_args, callee->num_vars,
+                          callee->max_stack);
+      V = S->locals;
+
+#ifdef C0VM_JIT
+      if (callee->calls < jit_threshold && ++callee->calls == jit_threshold)
+        jit_enable(bc0, index, &&do_JIT);
+#endif
 
       // Reset PC and function body pointer to new function.
       pc = 0;
+      F = callee;
+      P = callee->code;
+#ifdef C0VM_THREADED
+      T = callee->dispatch;
+#endif
+
+      NEXT;
+    }
+
+    // An invokestatic followed by a return: the callee's result would
+    // only be handed on to our caller, so the callee takes over this
+    // frame and its window of the operand stack, and returns straight
+    // to our caller.  Tail recursion then runs in constant space.
+    do_INVOKESTATIC_TAIL: {
+      uint16_t c1 = (uint16_t)P[pc + 1];
+      uint16_t c2 = (uint16_t)P[pc + 2];
+
       uint16_t index = (uint16_t)(c1 << 8) | c2;
-      P = bc0->function_pool[index].code;
-
-      // Initialize new variable array to arguments on old operand stack.
-      uint16_t num_new_vars = bc0->function_pool[index].num_vars;
-      V = xcalloc(num_new_vars, sizeof(c0_value));
-      ASSERT(V != NULL);
-
-      // Copy over arguments from old operand stack in opposite order.
-      uint16_t num_args = bc0->function_pool[index].num_args;
-      while (num_args != (uint16_t)0) {
-        V[num_args - 1] = c0v_pop(S);
-        num_args--;
-      }
+      struct function_info *callee = &bc0->function_pool[index];
 
-      // Initialize new operand stack.
-      S = c0v_stack_new();
+      c0v_reenter(S, callee->num_args, callee->num_vars, callee->max_stack);
+      V = S->locals;
 
-      break;
+#ifdef C0VM_JIT
+      if (callee->calls < jit_threshold && ++callee->calls == jit_threshold)
+        jit_enable(bc0, index, &&do_JIT);
+#endif
+
+      pc = 0;
+      F = callee;
+      P = callee->code;
+#ifdef C0VM_THREADED
+      T = callee->dispatch;
+#endif
+
+      NEXT;
     }
 
     // Implements C0/C library function calls.
-    case INVOKENATIVE: {
+    CASE(INVOKENATIVE): {
 
-      // Update PC and obtain bytes for function pool index.
+      // Update PC and obtain bytes for native pool index.
       pc += 3;
       uint16_t c1 = (uint16_t)P[pc - 2];
       uint16_t c2 = (uint16_t)P[pc - 1];
-
-      // Initialize new variable array to arguments on old operand stack.
       uint16_t pool_index = (uint16_t)(c1 << 8) | c2;
-      uint16_t new_args = bc0->native_pool[pool_index].num_args;
-      c0_value *temp = xcalloc(new_args, sizeof(c0_value));
-      ASSERT(temp != NULL);
-
-      // Copy over arguments from old operand stack in opposite order.
-      while (new_args != (uint16_t)0) {
-        temp[new_args - 1] = c0v_pop(S);
-        new_args--;
-      }
-
-      // Call library function with new variable array.
-      uint16_t index = bc0->native_pool[pool_index].function_table_index;
-      c0_value val = (native_function_table[index])(temp);
-
-      // Free temporary variable array.
-      free(temp);
 
-      // Push result back onto operand stack.
+      // The arguments are passed in place, first one lowest.
+      size_t new_args = bc0->native_pool[pool_index].num_args;
+      c0_value *args = c0v_popn(S, new_args);
+
+      // Natives only read flat strings
+      for (size_t i = 0; i < new_args; i++)
+        if (val_is_ptr(args[i]) && val2ptr_unchecked(args[i]) != NULL)
+          args[i] = ptr2val(vm_string_flatten(strings,
+                                              val2ptr_unchecked(args[i])));
+
+      // Call the library function bound to the native at load time,
+      // and push its result over the arguments.
+      c0_value val = call_native(bc0->natives[pool_index], args, new_args);
+      if (ctx->breakpoints != NULL)
+        val = adopt_result(ctx, bc0->native_pool[pool_index]
+                                .function_table_index, val);
       c0v_push(S, val);
 
-      break;
+      NEXT;
     }
 
 
     /* Memory allocation operations: */
 
     // Implements allocating pointers and structs.
-    case NEW: {
+    CASE(NEW): {
       pc += 2;
       uint8_t size = P[pc - 1];
-      void *new = xcalloc(1, size);
-      ASSERT(new != NULL);
+      void *new = gc_new(heap, size, S->data, S->top);
       c0v_push(S, ptr2val(new));
-      break;
+      NEXT;
     }
 
     // Implements allocating arrays.
-    case NEWARRAY: {
+    CASE(NEWARRAY): {
       pc += 2;
       uint8_t size = P[pc - 1];
       int num = pop_int(S);
       if (num < 0) {
         c0_memory_error("invalid array size.");
       }
-      c0_array *new = xcalloc(1, sizeof(c0_array));
-      ASSERT(new != NULL);
-      new->count = num;
+      c0_array *new = gc_new_array(heap, num, size, S->data, S->top);
       new->elt_size = (int32_t)(int8_t)size;
-      new->elems = xcalloc(num, size);
-      ASSERT(new->elems != NULL);
       c0v_push(S, ptr2val(new));
-      break;
+      NEXT;
     }
 
     // Obtains the length of array on operand stack.
-    case ARRAYLENGTH: {
+    CASE(ARRAYLENGTH): {
       pc++;
       c0_array *arr = (c0_array*)val2ptr(c0v_pop(S));
       if (arr == NULL) {
@@ -553,14 +1533,14 @@ int execute(struct bc0_file *bc0) {
       }
       int len = arr->count;
       push_int(S, len);
-      break;
+      NEXT;
     }
 
     /* Memory access operations: */
 
     // Address arithmetic offset computation for structs.
     // Implements field accesses.
-    case AADDF: {
+    CASE(AADDF): {
       pc += 2;
       uint8_t field = P[pc - 1];
       unsigned char *a = (unsigned char*)val2ptr(c0v_pop(S));
@@ -568,11 +1548,11 @@ int execute(struct bc0_file *bc0) {
         c0_memory_error("null pointer was accessed.");
       }
       c0v_push(S, ptr2val(a + field));
-      break;
+      NEXT;
     }
 
     // Implements array accesses.
-    case AADDS: {
+    CASE(AADDS): {
       pc++;
       int32_t index = pop_int(S);
       c0_array *array = (c0_array*)val2ptr(c0v_pop(S));
@@ -587,11 +1567,11 @@ int execute(struct bc0_file *bc0) {
       unsigned char *arr = (unsigned char*)array->elems;
       void *address = &arr[size*index];
       c0v_push(S, ptr2val(address));
-      break;
+      NEXT;
     }
 
     // Implements reading from memory (integers).
-    case IMLOAD: {
+    CASE(IMLOAD): {
       pc++;
       int32_t *ipoint = (int32_t*)val2ptr(c0v_pop(S));
       if (ipoint == NULL) {
@@ -599,11 +1579,11 @@ int execute(struct bc0_file *bc0) {
       }
       int32_t val = *ipoint;
       push_int(S, val);
-      break;
+      NEXT;
     }
 
     // Implements writing to memory (integers).
-    case IMSTORE: {
+    CASE(IMSTORE): {
       pc++;
       int32_t val = pop_int(S);
       int32_t *intpoint = (int32_t*)val2ptr(c0v_pop(S));
@@ -611,11 +1591,11 @@ int execute(struct bc0_file *bc0) {
         c0_memory_error("null pointer was accessed.");
       }
       *intpoint = val;
-      break;
+      NEXT;
     }
 
     // Implements reading from memory (pointers).
-    case AMLOAD: {
+    CASE(AMLOAD): {
       pc++;
       void **point = val2ptr(c0v_pop(S));
       if (point == NULL) {
@@ -623,11 +1603,11 @@ int execute(struct bc0_file *bc0) {
       }
       void *b = *point;
       c0v_push(S, ptr2val(b));
-      break;
+      NEXT;
     }
 
     // Implements writing to memory (pointers).
-    case AMSTORE: {
+    CASE(AMSTORE): {
       pc++;
       void *b = val2ptr(c0v_pop(S));
       void **a = val2ptr(c0v_pop(S));
@@ -635,11 +1615,11 @@ int execute(struct bc0_file *bc0) {
         c0_memory_error("null pointer was accessed.");
       }
       *a = b;
-      break;
+      NEXT;
     }
 
     // Implements reading from memory (characters).
-    case CMLOAD: {
+    CASE(CMLOAD): {
       pc++;
       unsigned char *cpoint = (unsigned char*)val2ptr(c0v_pop(S));
       if (cpoint == NULL) {
@@ -647,11 +1627,11 @@ int execute(struct bc0_file *bc0) {
       }
       int32_t val = (int32_t)(int8_t)(*cpoint);
       push_int(S, val);
-      break;
+      NEXT;
     }
 
     // Implements writing to memory (characters).
-    case CMSTORE: {
+    CASE(CMSTORE): {
       pc++;
       int32_t val = pop_int(S);
       unsigned char *charpoint = (unsigned char*)val2ptr(c0v_pop(S));
@@ -659,16 +1639,388 @@ int execute(struct bc0_file *bc0) {
         c0_memory_error("null pointer was accessed.");
       }
       *charpoint = (unsigned char)(val & 0x7f);
-      break;
+      NEXT;
+    }
+
+#ifdef C0VM_THREADED
+    /* Unchecked variants, used where analyze.c proved that every operand
+     * already has the kind the instruction expects. Only the kind checks
+     * are gone: arithmetic, null and bounds errors are still caught. */
+
+#define POP_INT() val2int_unchecked(c0v_pop(S))
+#define POP_PTR() val2ptr_unchecked(c0v_pop(S))
+#define BINOP_U(OP, EXPR)                                       \
+    do_##OP##_U: {                                              \
+      pc++;                                                     \
+      int32_t y = POP_INT();                                    \
+      int32_t x = POP_INT();                                    \
+      push_int(S, EXPR);                                        \
+      NEXT;                                                     \
+    }
+#define IF_ICMP_U(OP, CMP)                                      \
+    do_##OP##_U: {                                              \
+      int32_t y = POP_INT();                                    \
+      int32_t x = POP_INT();                                    \
+      if (x CMP y) pc += (int16_t)((P[pc + 1] << 8) | P[pc + 2]); \
+      else pc += 3;                                             \
+      NEXT;                                                     \
+    }
+
+    BINOP_U(IADD, x + y)
+    BINOP_U(ISUB, x - y)
+    BINOP_U(IMUL, x * y)
+    BINOP_U(IAND, x & y)
+    BINOP_U(IOR, x | y)
+    BINOP_U(IXOR, x ^ y)
+
+    do_IDIV_U: {
+      pc++;
+      int32_t y = POP_INT();
+      int32_t x = POP_INT();
+      if (y == 0 || (y == -1 && x == INT32_MIN))
+        c0_arith_error("division by 0.");
+      push_int(S, x / y);
+      NEXT;
+    }
+
+    do_IREM_U: {
+      pc++;
+      int32_t y = POP_INT();
+      int32_t x = POP_INT();
+      if (y == 0 || (y == -1 && x == INT32_MIN))
+        c0_arith_error("division by 0.");
+      push_int(S, x % y);
+      NEXT;
     }
 
+    do_ISHL_U: {
+      pc++;
+      int32_t y = POP_INT();
+      int32_t x = POP_INT();
+      if (!(0 <= y && y < 32)) c0_arith_error("division by 0.");
+      push_int(S, x << y);
+      NEXT;
+    }
+
+    do_ISHR_U: {
+      pc++;
+      int32_t y = POP_INT();
+      int32_t x = POP_INT();
+      if (!(0 <= y && y < 32)) c0_arith_error("division by 0.");
+      push_int(S, x >> y);
+      NEXT;
+    }
+
+    IF_ICMP_U(IF_ICMPLT, <)
+    IF_ICMP_U(IF_ICMPGE, >=)
+    IF_ICMP_U(IF_ICMPGT, >)
+    IF_ICMP_U(IF_ICMPLE, <=)
+
+    do_ARRAYLENGTH_U: {
+      pc++;
+      c0_array *arr = POP_PTR();
+      if (arr == NULL) c0_memory_error("null pointer was accessed.");
+      push_int(S, arr->count);
+      NEXT;
+    }
+
+    do_AADDF_U: {
+      pc += 2;
+      unsigned char *a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      c0v_push(S, ptr2val(a + P[pc - 1]));
+      NEXT;
+    }
+
+    do_AADDS_U: {
+      pc++;
+      int32_t index = POP_INT();
+      c0_array *array = POP_PTR();
+      if (array == NULL) c0_memory_error("null pointer was accessed.");
+      if (!(0 <= index && index < array->count))
+        c0_memory_error("invalid index access.");
+      unsigned char *elems = array->elems;
+      c0v_push(S, ptr2val(&elems[array->elt_size * index]));
+      NEXT;
+    }
+
+    // In a loop whose guard has checked every index it can reach
+    do_AADDS_H: {
+      pc++;
+      int32_t index = POP_INT();
+      c0_array *array = POP_PTR();
+      unsigned char *elems = array->elems;
+      c0v_push(S, ptr2val(&elems[array->elt_size * index]));
+      NEXT;
+    }
+
+    do_IMLOAD_U: {
+      pc++;
+      int32_t *a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      push_int(S, *a);
+      NEXT;
+    }
+
+    do_IMSTORE_U: {
+      pc++;
+      int32_t x = POP_INT();
+      int32_t *a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      *a = x;
+      NEXT;
+    }
+
+    do_AMLOAD_U: {
+      pc++;
+      void **a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      c0v_push(S, ptr2val(*a));
+      NEXT;
+    }
+
+    do_AMSTORE_U: {
+      pc++;
+      void *b = POP_PTR();
+      void **a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      *a = b;
+      NEXT;
+    }
+
+    do_CMLOAD_U: {
+      pc++;
+      unsigned char *a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      push_int(S, (int32_t)(int8_t)*a);
+      NEXT;
+    }
+
+    do_CMSTORE_U: {
+      pc++;
+      int32_t x = POP_INT();
+      unsigned char *a = POP_PTR();
+      if (a == NULL) c0_memory_error("null pointer was accessed.");
+      *a = (unsigned char)(x & 0x7f);
+      NEXT;
+    }
+
+#undef POP_INT
+#undef POP_PTR
+#undef BINOP_U
+#undef IF_ICMP_U
+
+    /* Superinstructions (see fuse above). The branch of a fused compare
+     * is the instruction at pc + 4. */
+
+#define FUSED_ICMP(NAME, F, SECOND, CMP)                        \
+    do_##NAME: {                                                \
+      counts.fusion_runs[F]++;                                  \
+      int32_t x = val2int_unchecked(V[P[pc + 1]]);              \
+      int32_t y = SECOND;                                       \
+      if (x CMP y) pc += 4 + (int16_t)((P[pc + 5] << 8) | P[pc + 6]); \
+      else pc += 7;                                             \
+      NEXT;                                                     \
+    }
+#define LOCAL_2 val2int_unchecked(V[P[pc + 3]])
+#define CONST_2 (int32_t)(byte)P[pc + 3]
+
+    FUSED_ICMP(VLOAD_VLOAD_ICMPLT, FUSE_VLOAD_VLOAD_ICMP, LOCAL_2, <)
+    FUSED_ICMP(VLOAD_VLOAD_ICMPGE, FUSE_VLOAD_VLOAD_ICMP, LOCAL_2, >=)
+    FUSED_ICMP(VLOAD_VLOAD_ICMPGT, FUSE_VLOAD_VLOAD_ICMP, LOCAL_2, >)
+    FUSED_ICMP(VLOAD_VLOAD_ICMPLE, FUSE_VLOAD_VLOAD_ICMP, LOCAL_2, <=)
+    FUSED_ICMP(VLOAD_BIPUSH_ICMPLT, FUSE_VLOAD_BIPUSH_ICMP, CONST_2, <)
+    FUSED_ICMP(VLOAD_BIPUSH_ICMPGE, FUSE_VLOAD_BIPUSH_ICMP, CONST_2, >=)
+    FUSED_ICMP(VLOAD_BIPUSH_ICMPGT, FUSE_VLOAD_BIPUSH_ICMP, CONST_2, >)
+    FUSED_ICMP(VLOAD_BIPUSH_ICMPLE, FUSE_VLOAD_BIPUSH_ICMP, CONST_2, <=)
+
+    do_VLOAD_BIPUSH_IADD_VSTORE: {
+      counts.fusion_runs[FUSE_VLOAD_BIPUSH_IADD_VSTORE]++;
+      int32_t x = val2int_unchecked(V[P[pc + 1]]);
+      V[P[pc + 6]] = int2val(x + CONST_2);
+      pc += 7;
+      NEXT;
+    }
+
+    do_VLOAD_BIPUSH_ISUB_VSTORE: {
+      counts.fusion_runs[FUSE_VLOAD_BIPUSH_ISUB_VSTORE]++;
+      int32_t x = val2int_unchecked(V[P[pc + 1]]);
+      V[P[pc + 6]] = int2val(x - CONST_2);
+      pc += 7;
+      NEXT;
+    }
+
+    do_ALDC_INVOKENATIVE: {
+      counts.fusion_runs[FUSE_ALDC_INVOKENATIVE]++;
+      uint16_t s = (uint16_t)((P[pc + 1] << 8) | P[pc + 2]);
+      uint16_t n = (uint16_t)((P[pc + 4] << 8) | P[pc + 5]);
+      c0_value arg = ptr2val(bc0->strings[s]);
+      c0_value val = call_native(bc0->natives[n], &arg, 1);
+      if (ctx->breakpoints != NULL)
+        val = adopt_result(ctx, bc0->native_pool[n].function_table_index, val);
+      c0v_push(S, val);
+      pc += 6;
+      NEXT;
+    }
+
+#undef FUSED_ICMP
+#undef LOCAL_2
+#undef CONST_2
+
+    /* Natives the VM runs itself (see predecode), when the arguments
+     * are ones the library accepts and the answer is plain ASCII;
+     * anything else still goes to the library, to be handled or
+     * reported exactly as before. */
+    do_STRING_LENGTH: {
+      c0_value s = S->top[-1];
+      if (!val_is_ptr(s) || val2ptr_unchecked(s) == NULL)
+        goto *handlers[INVOKENATIVE];
+      S->top[-1] = int2val(vm_string_length(strings, val2ptr_unchecked(s)));
+      pc += 3;
+      NEXT;
+    }
+
+    do_STRING_JOIN: {
+      c0_value a = S->top[-2];
+      c0_value b = S->top[-1];
+      if (!val_is_ptr(a) || val2ptr_unchecked(a) == NULL
+          || !val_is_ptr(b) || val2ptr_unchecked(b) == NULL)
+        goto *handlers[INVOKENATIVE];
+      S->top--;
+      S->top[-1] = ptr2val(vm_string_join(strings, val2ptr_unchecked(a),
+                                          val2ptr_unchecked(b)));
+      pc += 3;
+      NEXT;
+    }
+
+    do_STRING_EQUAL: {
+      c0_value a = S->top[-2];
+      c0_value b = S->top[-1];
+      if (!val_is_ptr(a) || val2ptr_unchecked(a) == NULL
+          || !val_is_ptr(b) || val2ptr_unchecked(b) == NULL)
+        goto *handlers[INVOKENATIVE];
+      S->top--;
+      S->top[-1] = int2val(vm_string_equal(strings, val2ptr_unchecked(a),
+                                           val2ptr_unchecked(b)));
+      pc += 3;
+      NEXT;
+    }
+
+    do_STRING_CHARAT: {
+      c0_value s = S->top[-2];
+      c0_value i = S->top[-1];
+      if (!val_is_ptr(s) || !val_is_int(i)) goto *handlers[INVOKENATIVE];
+      char *str = vm_string_flatten(strings, val2ptr_unchecked(s));
+      int32_t index = val2int_unchecked(i);
+      if (str == NULL || index < 0) goto *handlers[INVOKENATIVE];
+      // In bounds if below the length the VM's own strings carry, or in
+      // a string from a native, if there is no NUL up to str[index]
+      int32_t length = vm_string_known_length(strings, str);
+      if (length >= 0 ? index >= length
+          : memchr(str, '\0', (size_t)index + 1) != NULL)
+        goto *handlers[INVOKENATIVE];
+      if ((unsigned char)str[index] > 127) goto *handlers[INVOKENATIVE];
+      S->top--;
+      S->top[-1] = int2val(str[index]);
+      pc += 3;
+      NEXT;
+    }
+
+    // A char is its own code, and the other way around
+    do_CHAR_ORD:
+    do_CHAR_CHR: {
+      c0_value c = S->top[-1];
+      if (!val_is_int(c) || val2int_unchecked(c) < 0
+          || val2int_unchecked(c) > 127)
+        goto *handlers[INVOKENATIVE];
+      pc += 3;
+      NEXT;
+    }
+
+    /* Loops whose bounds checks are hoisted (see hoist_bounds_checks):
+     * the guard picks the loop's threaded code if every &A[i] in it is
+     * bound to be in bounds, and leaving the loop picks the function's
+     * own threaded code again. */
+    do_LOOP_GUARD: {
+      struct array_loop *L = F->loops;
+      while (L->head != pc) L++;
+      if (loop_guard(bc0, L, P, V)) {
+        counts.hoisted_entries++;
+        T = L->fast;
+      }
+      goto *L->head_handler;
+    }
+
+    do_LOOP_LEAVE: {
+      T = F->dispatch;
+      NEXT;
+    }
+#endif
+
+#ifdef C0VM_THREADED
+    /* Report the instruction to the profiler, then run it as its plain
+     * (checked or unchecked) handler, so that every instruction is
+     * counted on its own. */
+    do_PROFILE: {
+      ubyte op = P[pc];
+      profile_instr((size_t)(F - bc0->function_pool), P, pc);
+      goto *((F->pcinfo[pc] & PC_PROVEN) && unchecked[op] != NULL
+             ? unchecked[op] : handlers[op]);
+    }
+
+    /* Record the start of a basic block, then run it with the handler
+     * predecode would otherwise have given it.  The threaded code may
+     * have been made by a run with tracing on, and this one without. */
+    do_TRACE: {
+      if (tracer != NULL)
+        trace_record(tracer, (size_t)(F - bc0->function_pool), pc, P[pc],
+                     S->base, S->top);
+      goto *F->dispatch[F->code_length + pc];
+    }
+
+    /* The first breakpoint reached (see patch_breakpoints) */
+    do_SNAPSHOT: {
+      take_snapshot(ctx, bc0, S, frames, depth, F, pc);
+#ifdef C0VM_JIT
+      jit_threshold = jit_setting;
+#endif
+      NEXT;
+    }
+#endif
+
+#ifdef C0VM_JIT
+    /* Run the function's machine code until it reaches something it
+     * leaves to the interpreter, then run that one instruction with
+     * the handler it had before the function was compiled. */
+    do_JIT: {
+      struct jit_code *J = F->jit;
+      pc = J->run(V, S->base, pc, J->entry);
+      S->top = S->base + J->depths[pc];
+      T = F->dispatch;  /* the code may have left a hoisted loop */
+      goto *J->interp[pc];
+    }
+#endif
+
     // Invalid opcode.
+#ifdef C0VM_THREADED
+    do_invalid:
+#else
     default:
+#endif
       fprintf(stderr, "invalid opcode: 0x%02x\n", P[pc]);
       abort();
+#ifndef C0VM_THREADED
     }
+#endif
   }
 
+#undef CASE
+#undef NEXT
+
   /* cannot get here from infinite loop */
   assert(false);
 }
+
+#ifdef C0VM_THREADED
+#pragma GCC diagnostic pop
+#endif
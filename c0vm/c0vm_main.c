@@ -5,15 +5,21 @@
  * Performs some OS compatibility checks before
  * running the VM.
  */
+#define _POSIX_C_SOURCE 200809L  /* getline, sysconf */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <alloca.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lib/xalloc.h"
 #include "lib/c0vm.h"
-
-/* for the args library */
-int c0_argc;
-char **c0_argv;
+#include "lib/profile.h"
+#include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_abort.h"
 
 /* fail-fast file function wrappers */
 FILE *xfopen(const char *filename, const char *mode, char *error) {
@@ -40,12 +46,393 @@ void xfclose(FILE *stream, char *error) {
   }
 }
 
+/* a program of the right bytecode version, or NULL once it says why not */
+static struct bc0_file *try_load_program(char *filename) {
+  struct bc0_file *bc0 = try_read_program(filename);
+  if (bc0 == NULL) return NULL;
+  uint16_t vers = bc0->version >> 1;
+  if (BYTECODE_VERSION != vers) {
+    fprintf(stderr, "Error: implementation version %u != code version %u\n", 
+            BYTECODE_VERSION, vers);
+    free(bc0->string_pool);
+    free_program(bc0);
+    return NULL;
+  }
+  return bc0;
+}
+
+/* try_load_program, and a program that verifies, so that execute
+ * cannot find it malformed on a batch thread and end the batch */
+static struct bc0_file *try_load_verified(char *filename) {
+  struct bc0_file *bc0 = try_load_program(filename);
+  if (bc0 != NULL && !try_analyze_program(bc0)) {
+    free(bc0->string_pool);
+    free_program(bc0);
+    return NULL;
+  }
+  return bc0;
+}
+
+/* a program of the right bytecode version, or exit */
+struct bc0_file *load_program(char *filename) {
+  struct bc0_file *bc0 = try_load_program(filename);
+  if (bc0 == NULL) exit(EXIT_FAILURE);
+  return bc0;
+}
+
+/* Batch mode: every line of the manifest is a job
+ *   <result_file> <bc0_file> [args...]
+ * run as if by C0_RESULT_FILE=<result_file> c0vm <bc0_file> [args...],
+ * with stdin from /dev/null, and its runtime errors and result line in
+ * <result_file>.out.  Each program is read and verified once, before
+ * anything runs; one that cannot be fails only the jobs that name it.
+ *
+ * Jobs run on up to $C0VM_JOBS threads, each in a context of its own
+ * that unwinds on errors, so its heap and any error it raises stay its
+ * own.  As execute fills in the program it runs, every thread runs a
+ * copy of its own of each program.  What natives print goes to the
+ * batch's stdout, and a native that ends the process ends the batch.
+ * The args library reads process-wide arguments (see c0vm_abort.h), so
+ * jobs of programs that use it run one at a time. */
+struct batch_job {
+  char *result;
+  size_t program;               /* index into the batch's programs */
+  int argc;                     /* argv[0] is the bc0 file */
+  char **argv;
+  bool written;                 /* ran, and its result files are written */
+  enum c0vm_status status;      /* how it ended, if written */
+  int value;                    /* what main returned, if it did */
+};
+
+struct batch {
+  struct batch_job *jobs;
+  size_t job_count;
+  struct bc0_file **programs;   /* as read and never run, or NULL */
+  size_t program_count;
+  size_t next;                  /* the next job to start */
+  pthread_mutex_t next_lock;
+  pthread_mutex_t args_lock;    /* held by a job that uses args */
+};
+
+/* Does the program call into the args library? */
+static bool uses_args(struct bc0_file *bc0) {
+  for (size_t i = 0; i < bc0->native_count; i++) {
+    uint16_t f = bc0->native_pool[i].function_table_index;
+    if (f == NATIVE_ARGS_FLAG || f == NATIVE_ARGS_INT
+        || f == NATIVE_ARGS_PARSE || f == NATIVE_ARGS_STRING)
+      return true;
+  }
+  return false;
+}
+
+static void run_job(struct batch *B, struct batch_job *job,
+                    struct bc0_file *bc0) {
+  char *out_name = xcalloc(strlen(job->result) + 5, sizeof(char));
+  strcpy(out_name, job->result);
+  strcat(out_name, ".out");
+  FILE *out = fopen(out_name, "w");
+  if (out == NULL) {
+    perror(out_name);
+    free(out_name);
+    return;
+  }
+  FILE *f = fopen(job->result, "w");
+  if (f == NULL || fwrite("\0", 1, 1, f) < 1 || fflush(f) != 0) {
+    perror(job->result);
+    if (f != NULL) fclose(f);
+    fclose(out);
+    free(out_name);
+    return;
+  }
+
+  // Only jobs that use args set the arguments, and only one at a time
+  bool args = uses_args(bc0);
+  c0vm_ctx *ctx = c0vm_ctx_new(job->argc, args ? job->argv : NULL);
+  ctx->err = out;
+  ctx->unwind = true;
+  if (args) pthread_mutex_lock(&B->args_lock);
+  job->value = execute(ctx, bc0);
+  if (args) pthread_mutex_unlock(&B->args_lock);
+  job->status = ctx->status;
+  c0vm_ctx_free(ctx);
+
+  bool ok = true;
+  if (job->status == C0VM_DONE) {
+    fprintf(out, "Result = %d\n", job->value);
+    ok = fwrite(&job->value, sizeof(int), 1, f) == 1;
+  }
+  ok = fclose(f) == 0 && ok;
+  if (!ok) perror(job->result);
+  if (fclose(out) != 0) {
+    perror(out_name);
+    ok = false;
+  }
+  job->written = ok;
+  free(out_name);
+}
+
+static void *batch_worker(void *arg) {
+  struct batch *B = arg;
+  struct bc0_file **mine = xcalloc(B->program_count,
+                                   sizeof(struct bc0_file*));
+  while (true) {
+    pthread_mutex_lock(&B->next_lock);
+    size_t i = B->next;
+    if (i < B->job_count) B->next++;
+    pthread_mutex_unlock(&B->next_lock);
+    if (i == B->job_count) break;
+
+    size_t p = B->jobs[i].program;
+    if (B->programs[p] == NULL) continue;
+    if (mine[p] == NULL) mine[p] = copy_program(B->programs[p]);
+    run_job(B, &B->jobs[i], mine[p]);
+  }
+  for (size_t p = 0; p < B->program_count; p++) {
+    if (mine[p] == NULL) continue;
+    free(mine[p]->string_pool);
+    free_program(mine[p]);
+  }
+  free(mine);
+  return NULL;
+}
+
+static size_t batch_workers(void) {
+  char *s = getenv("C0VM_JOBS");
+  if (s == NULL) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+  }
+  char *end;
+  unsigned long n = strtoul(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || n == 0) {
+    fprintf(stderr, "Error: C0VM_JOBS must be a positive integer\n");
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)n;
+}
+
+/* How the job ended, said the way it was when every job was a c0vm of
+ * its own: the exit status or signal that c0vm would have ended with */
+static void report_job(struct batch *B, struct batch_job *job) {
+  if (B->programs[job->program] == NULL) {
+    printf("%s: could not load %s\n", job->result, job->argv[0]);
+    return;
+  }
+  if (!job->written) {
+    printf("%s: could not write %s\n", job->result, job->result);
+    return;
+  }
+  switch (job->status) {
+  case C0VM_DONE:
+    printf("%s: Result = %d\n", job->result, job->value);
+    break;
+  case C0VM_USER_ERROR:
+    printf("%s: exit %d\n", job->result, EXIT_FAILURE);
+    break;
+  case C0VM_ASSERTION_FAILURE:
+    printf("%s: signal %d\n", job->result, SIGABRT);
+    break;
+  case C0VM_MEMORY_ERROR:
+    printf("%s: signal %d\n", job->result, SIGSEGV);
+    break;
+  case C0VM_ARITH_ERROR:
+    printf("%s: signal %d\n", job->result, SIGFPE);
+    break;
+  }
+}
+
+int run_batch(char *manifest) {
+  FILE *m = xfopen(manifest, "r", "Couldn't open manifest");
+  struct batch B;
+  B.jobs = NULL;
+  B.job_count = 0;
+  B.programs = NULL;
+  B.program_count = 0;
+  size_t job_cap = 0;
+  char **names = NULL;          /* the file of each program */
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  while (getline(&line, &line_cap, m) >= 0) {
+    char **words = xcalloc(strlen(line) / 2 + 2, sizeof(char*));
+    int n = 0;
+    for (char *w = strtok(line, " \t\r\n"); w != NULL && w[0] != '#';
+         w = strtok(NULL, " \t\r\n"))
+      words[n++] = strdup(w);
+    if (n == 0) {
+      free(words);
+      continue;
+    }
+    if (n < 2) {
+      fprintf(stderr, "Error: %s: expected <result_file> <bc0_file> [args...]"
+              " on line %zu\n", manifest, B.job_count + 1);
+      exit(EXIT_FAILURE);
+    }
+
+    size_t p = 0;
+    while (p < B.program_count && strcmp(names[p], words[1]) != 0) p++;
+    if (p == B.program_count) {
+      names = xrealloc(names, (p + 1) * sizeof(char*));
+      B.programs = xrealloc(B.programs, (p + 1) * sizeof(struct bc0_file*));
+      names[p] = words[1];
+      B.programs[p] = try_load_verified(words[1]);
+      B.program_count++;
+    }
+
+    if (B.job_count == job_cap) {
+      job_cap = job_cap == 0 ? 16 : 2 * job_cap;
+      B.jobs = xrealloc(B.jobs, job_cap * sizeof(struct batch_job));
+    }
+    struct batch_job *job = &B.jobs[B.job_count++];
+    job->result = words[0];
+    job->program = p;
+    job->argc = n - 1;
+    job->argv = words + 1;
+    job->written = false;
+    job->status = C0VM_DONE;
+    job->value = 0;
+  }
+  free(line);
+  xfclose(m, "Couldn't close manifest");
+
+  if (freopen("/dev/null", "r", stdin) == NULL) {
+    perror("/dev/null");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t workers = batch_workers();
+  if (workers > B.job_count) workers = B.job_count;
+  pthread_t *threads = xcalloc(workers, sizeof(pthread_t));
+  B.next = 0;
+  pthread_mutex_init(&B.next_lock, NULL);
+  pthread_mutex_init(&B.args_lock, NULL);
+  for (size_t w = 0; w < workers; w++) {
+    if (pthread_create(&threads[w], NULL, batch_worker, &B) != 0) {
+      fprintf(stderr, "Error: couldn't start a batch thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t w = 0; w < workers; w++) pthread_join(threads[w], NULL);
+  pthread_mutex_destroy(&B.next_lock);
+  pthread_mutex_destroy(&B.args_lock);
+  free(threads);
+
+  // Report in the order of the manifest
+  for (size_t i = 0; i < B.job_count; i++) report_job(&B, &B.jobs[i]);
+
+  for (size_t p = 0; p < B.program_count; p++) {
+    if (B.programs[p] == NULL) continue;
+    free(B.programs[p]->string_pool);
+    free_program(B.programs[p]);
+  }
+  for (size_t i = 0; i < B.job_count; i++) {
+    free(B.jobs[i].result);
+    for (int k = 0; k < B.jobs[i].argc; k++) free(B.jobs[i].argv[k]);
+    free(B.jobs[i].argv - 1);
+  }
+  free(B.jobs);
+  free(names);
+  free(B.programs);
+  return 0;
+}
+
+/* <fn>:<pc> or native:<index>, in decimal */
+static bool parse_breakpoint(char *s, size_t *fn, size_t *pc, int *native) {
+  char *colon = strchr(s, ':');
+  if (colon == NULL || colon[1] == '\0') return false;
+  char *end;
+  unsigned long n = strtoul(colon + 1, &end, 10);
+  if (*end != '\0') return false;
+  if (strncmp(s, "native:", 7) == 0) {
+    if (n >= NATIVE_FUNCTION_COUNT) return false;
+    *native = (int)n;
+    return true;
+  }
+  *pc = n;
+  *fn = strtoul(s, &end, 10);
+  return end == colon && end != s;
+}
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     fprintf(stderr, "usage: %s <bc0_file> [args...]\n", argv[0]);
+    fprintf(stderr, "       %s --image <bc0b_file> <bc0_file>\n", argv[0]);
+    fprintf(stderr, "       %s --aot <c_file> <bc0_file>\n", argv[0]);
+    fprintf(stderr, "       %s --profile <prefix> <bc0_file> [args...]\n",
+            argv[0]);
+    fprintf(stderr, "       %s --batch <manifest>\n", argv[0]);
+    fprintf(stderr, "       %s --snapshot <file> <fn>:<pc>|native:<index> "
+            "<bc0_file> [args...]\n", argv[0]);
+    fprintf(stderr, "       %s --restore <file> <bc0_file> [args...]\n",
+            argv[0]);
     exit(1);
   }
 
+  /* precompile a .bc0 into a .bc0b image that loads without parsing,
+   * or translate it to C */
+  if (strcmp(argv[1], "--image") == 0 || strcmp(argv[1], "--aot") == 0) {
+    if (argc != 4) {
+      fprintf(stderr, "usage: %s %s <output_file> <bc0_file>\n",
+              argv[0], argv[1]);
+      exit(1);
+    }
+    struct bc0_file *bc0 = read_program(argv[3]);
+    if (strcmp(argv[1], "--image") == 0) write_image(bc0, argv[2]);
+    else write_c(bc0, argv[2]);
+    free(bc0->string_pool);
+    free_program(bc0);
+    return 0;
+  }
+
+  /* run every job of a manifest, see run_batch */
+  if (strcmp(argv[1], "--batch") == 0) {
+    if (argc != 3) {
+      fprintf(stderr, "usage: %s --batch <manifest>\n", argv[0]);
+      exit(1);
+    }
+    return run_batch(argv[2]);
+  }
+
+  /* write a snapshot of the run when it gets to <fn>:<pc> (function
+   * number and offset in its code) or to the first call of a native,
+   * or carry on from one, see lib/snapshot.h */
+  char *snapshot = NULL, *restore = NULL;
+  size_t snapshot_fn = 0, snapshot_pc = 0;
+  int snapshot_native = -1;
+  while (argc >= 4 && (strcmp(argv[1], "--snapshot") == 0
+                       || strcmp(argv[1], "--restore") == 0)) {
+    if (strcmp(argv[1], "--restore") == 0) {
+      restore = argv[2];
+      argc -= 2;
+      argv += 2;
+      continue;
+    }
+    snapshot = argv[2];
+    if (argc < 5 || !parse_breakpoint(argv[3], &snapshot_fn, &snapshot_pc,
+                                      &snapshot_native)) {
+      fprintf(stderr, "usage: %s --snapshot <file> <fn>:<pc>|native:<index> "
+              "<bc0_file> [args...]\n", argv[0]);
+      exit(1);
+    }
+    argc -= 3;
+    argv += 3;
+  }
+
+  /* profile the run into <prefix>.report and <prefix>.folded, also
+   * turned on by setting $C0VM_PROFILE to the prefix */
+  char *profile = getenv("C0VM_PROFILE");
+  if (strcmp(argv[1], "--profile") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "usage: %s --profile <prefix> <bc0_file> [args...]\n",
+              argv[0]);
+      exit(1);
+    }
+    profile = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
+  if (profile != NULL) profile_enable(profile, argv[1]);
+
   /* test for two's complement */
   if (~(-1) != 0) {
     fprintf(stderr, "Error: not a two's complement machine\n");
@@ -75,13 +462,7 @@ int main(int argc, char **argv) {
 
   char *filename = getenv("C0_RESULT_FILE");
 
-  struct bc0_file *bc0 = read_program(argv[1]);
-  uint16_t vers = bc0->version >> 1;
-  if (BYTECODE_VERSION != vers) {
-    fprintf(stderr, "Error: implementation version %u != code version %u\n", 
-            BYTECODE_VERSION, vers);
-    exit(EXIT_FAILURE);
-  }
+  struct bc0_file *bc0 = load_program(argv[1]);
 
   // Move string pool to stack
   char *stack_allocate_string_pool = alloca(bc0->string_count);
@@ -91,18 +472,25 @@ int main(int argc, char **argv) {
   free(bc0->string_pool);
     bc0->string_pool = stack_allocate_string_pool;
 
+  c0vm_ctx *ctx = c0vm_ctx_new(c0_argc, c0_argv);
+  ctx->snapshot = snapshot;
+  ctx->snapshot_fn = snapshot_fn;
+  ctx->snapshot_pc = snapshot_pc;
+  ctx->snapshot_native = snapshot_native;
+  ctx->restore = restore;
   if (filename == NULL) {
-    int result = execute(bc0);
+    int result = execute(ctx, bc0);
     printf("%d\n", result);
   } else {
     FILE *f = xfopen(filename, "w", "Couldn't open $C0_RESULT_FILE");
     xfwrite("\0", 1, 1, f, "Couldn't write to $C0_RESULT_FILE");
-    int result = execute(bc0);
+    int result = execute(ctx, bc0);
     printf("Result = %d\n", result);
     xfwrite(&result, sizeof(int), 1, f, "Couldn't write to $C0_RESULT_FILE");
     xfclose(f, "Couldn't close $C0_RESULT_FILE");
   }
 
+  c0vm_ctx_free(ctx);
   free_program(bc0);
   return 0;
 }
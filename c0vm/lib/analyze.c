@@ -0,0 +1,593 @@
+/* C0VM load-time analysis
+ * 15-122 Principles of Imperative Computation
+ *
+ * Two passes.  The first follows every path through each function and
+ * computes how many operands are on the stack before each instruction,
+ * checking indices and jump targets on the way.  The second computes
+ * which kinds of values (integers, pointers, or either) can be in each
+ * local variable and operand slot.  Kinds flow between functions
+ * through arguments and return values, so the second pass is repeated
+ * over the whole program until nothing changes.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_instr.h"
+#include "analyze.h"
+
+static void malformed(size_t fn, size_t pc, char *msg) {
+  fprintf(stderr, "Error: malformed bytecode in function %zu at pc %zu: %s\n",
+          fn, pc, msg);
+  bad_program();
+}
+
+static uint16_t operand_u16(ubyte *P, size_t pc) {
+  return (uint16_t)((P[pc + 1] << 8) | P[pc + 2]);
+}
+
+static bool is_branch(ubyte opcode) {
+  switch (opcode) {
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* How many operands the instruction at pc pops and pushes, after
+ * checking that any pool or variable index it uses is in range */
+static void stack_effect(struct bc0_file *bc0, size_t fn, size_t pc,
+                         int *pops, int *pushes) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  ubyte *P = fi->code;
+  uint16_t index;
+
+  switch (P[pc]) {
+  case IADD: case ISUB: case IMUL: case IDIV: case IREM:
+  case IAND: case IOR: case IXOR: case ISHL: case ISHR:
+  case AADDS:
+    *pops = 2; *pushes = 1; return;
+
+  case DUP: *pops = 1; *pushes = 2; return;
+  case SWAP: *pops = 2; *pushes = 2; return;
+
+  case VSTORE:
+    if (P[pc + 1] >= fi->num_vars)
+      malformed(fn, pc, "local variable index out of range");
+    *pops = 1; *pushes = 0; return;
+
+  case POP: case ATHROW: case RETURN:
+    *pops = 1; *pushes = 0; return;
+
+  case NEWARRAY: case ARRAYLENGTH: case AADDF:
+  case IMLOAD: case AMLOAD: case CMLOAD:
+    *pops = 1; *pushes = 1; return;
+
+  case IMSTORE: case AMSTORE: case CMSTORE: case ASSERT:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT:
+  case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE:
+    *pops = 2; *pushes = 0; return;
+
+  case VLOAD:
+    if (P[pc + 1] >= fi->num_vars)
+      malformed(fn, pc, "local variable index out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case ILDC:
+    if (operand_u16(P, pc) >= bc0->int_count)
+      malformed(fn, pc, "integer pool index out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case ALDC:
+    if (operand_u16(P, pc) >= bc0->string_count)
+      malformed(fn, pc, "string pool index out of range");
+    *pops = 0; *pushes = 1; return;
+
+  case NEW: case ACONST_NULL: case BIPUSH:
+    *pops = 0; *pushes = 1; return;
+
+  case NOP: case GOTO:
+    *pops = 0; *pushes = 0; return;
+
+  case INVOKESTATIC:
+    index = operand_u16(P, pc);
+    if (index >= bc0->function_count)
+      malformed(fn, pc, "function pool index out of range");
+    *pops = bc0->function_pool[index].num_args; *pushes = 1; return;
+
+  case INVOKENATIVE:
+    index = operand_u16(P, pc);
+    if (index >= bc0->native_count)
+      malformed(fn, pc, "native pool index out of range");
+    *pops = bc0->native_pool[index].num_args; *pushes = 1; return;
+
+  default:
+    malformed(fn, pc, "invalid opcode");
+  }
+}
+
+/* Record that control reaches target with depth operands on the stack */
+static void flow(struct function_info *fi, size_t fn, size_t pc, int *depths,
+                 size_t *work, size_t *nwork, long target, int depth) {
+  if (target < 0 || (size_t)target >= fi->code_length)
+    malformed(fn, pc, "control flows outside of the function");
+  if (!(fi->pcinfo[target] & PC_INSTR))
+    malformed(fn, pc, "control flows into the middle of an instruction");
+  if (depths[target] < 0) {
+    depths[target] = depth;
+    work[(*nwork)++] = (size_t)target;
+  } else if (depths[target] != depth) {
+    malformed(fn, (size_t)target, "inconsistent operand stack depth");
+  }
+}
+
+/* First pass: marks instruction starts and branch targets, and returns
+ * the operand stack depth before each pc (-1 where unreachable) */
+static int *analyze_depths(struct bc0_file *bc0, size_t fn) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  ubyte *P = fi->code;
+  size_t len = fi->code_length;
+  if (len == 0) malformed(fn, 0, "function has no code");
+  if (fi->num_args > fi->num_vars)
+    malformed(fn, 0, "more arguments than local variables");
+
+  if (fi->pcinfo == NULL) fi->pcinfo = xcalloc(len, sizeof(ubyte));
+  for (size_t pc = 0; pc < len; pc += instr_length(P[pc])) {
+    if (instr_length(P[pc]) == 0) malformed(fn, pc, "invalid opcode");
+    if (pc + instr_length(P[pc]) > len)
+      malformed(fn, pc, "instruction is cut off");
+    fi->pcinfo[pc] |= PC_INSTR;
+    if (P[pc] == INVOKESTATIC && pc + 3 < len && P[pc + 3] == RETURN)
+      fi->pcinfo[pc] |= PC_TAIL;
+  }
+
+  int *depths = xcalloc(len, sizeof(int));
+  for (size_t pc = 0; pc < len; pc++) depths[pc] = -1;
+  size_t *work = xcalloc(len, sizeof(size_t));
+  size_t nwork = 0;
+  int max = 0;
+
+  depths[0] = 0;
+  work[nwork++] = 0;
+  while (nwork > 0) {
+    size_t pc = work[--nwork];
+    size_t ilen = instr_length(P[pc]);
+
+    int pops, pushes;
+    stack_effect(bc0, fn, pc, &pops, &pushes);
+    if (depths[pc] < pops) malformed(fn, pc, "operand stack underflow");
+    int depth = depths[pc] - pops + pushes;
+    if (depth > max) max = depth;
+
+    if (is_branch(P[pc])) {
+      long target = (long)pc + (int16_t)operand_u16(P, pc);
+      flow(fi, fn, pc, depths, work, &nwork, target, depth);
+      if (target >= 0 && (size_t)target < len)
+        fi->pcinfo[target] |= PC_TARGET;
+      if (P[pc] != GOTO)
+        flow(fi, fn, pc, depths, work, &nwork, (long)(pc + ilen), depth);
+    } else if (P[pc] == RETURN) {
+      if (depth != 0) malformed(fn, pc, "operands left on stack at return");
+    } else if (P[pc] != ATHROW) {
+      flow(fi, fn, pc, depths, work, &nwork, (long)(pc + ilen), depth);
+    }
+  }
+
+  ASSERT(max <= UINT16_MAX);
+  fi->max_stack = (uint16_t)max;
+  free(work);
+  return depths;
+}
+
+/* Kinds of values, as sets: K_NONE is no value yet, K_ANY either kind */
+#define K_NONE 0
+#define K_INT  1
+#define K_PTR  2
+#define K_ANY  (K_INT | K_PTR)
+
+/* What the kinds pass knows about each function of the program */
+struct summary {
+  int **depths;     /* from the first pass */
+  ubyte **args;     /* args[fn][i] is every kind passed as argument i */
+  ubyte *rets;      /* rets[fn] is every kind fn returns */
+  bool changed;     /* some args or rets grew during this round */
+  bool final;       /* the last round: report errors, set PC_PROVEN */
+};
+
+/* Check an operand whose instruction needs the given kind */
+static void need(size_t fn, size_t pc, bool final, ubyte kind, ubyte want,
+                 bool *proven) {
+  if (final && kind != K_NONE && (kind & want) == 0)
+    malformed(fn, pc, want == K_INT ? "expected an integer operand"
+                                    : "expected a pointer operand");
+  if (kind != want) *proven = false;
+}
+
+/* Merges a state into the one known at target; returns true if the
+ * target's state grew and so has to be looked at (again) */
+static bool merge(ubyte *into, ubyte *from, size_t n, bool *seen) {
+  bool grew = !*seen;
+  *seen = true;
+  for (size_t i = 0; i < n; i++) {
+    if ((into[i] | from[i]) != into[i]) {
+      into[i] |= from[i];
+      grew = true;
+    }
+  }
+  return grew;
+}
+
+/* Applies the instruction at pc to the state cur, whose operand stack
+ * is d deep.  Returns true if every operand the instruction checks is
+ * known to be of the right kind. */
+static bool transfer(struct bc0_file *bc0, size_t fn, size_t pc, ubyte *cur,
+                     size_t d, struct summary *sum, ubyte *ret) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  ubyte *P = fi->code;
+  ubyte *L = cur;
+  ubyte *S = cur + fi->num_vars;
+  bool proven = true;
+  bool final = sum->final;
+
+  switch (P[pc]) {
+  case IADD: case ISUB: case IMUL: case IDIV: case IREM:
+  case IAND: case IOR: case IXOR: case ISHL: case ISHR:
+    need(fn, pc, final, S[d-1], K_INT, &proven);
+    need(fn, pc, final, S[d-2], K_INT, &proven);
+    S[d-2] = K_INT;
+    break;
+
+  case IF_ICMPLT: case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE:
+    need(fn, pc, final, S[d-1], K_INT, &proven);
+    need(fn, pc, final, S[d-2], K_INT, &proven);
+    break;
+
+  case DUP: S[d] = S[d-1]; break;
+  case SWAP: { ubyte k = S[d-1]; S[d-1] = S[d-2]; S[d-2] = k; break; }
+
+  case VLOAD: S[d] = L[P[pc+1]]; break;
+  case VSTORE: L[P[pc+1]] = S[d-1]; break;
+
+  case ACONST_NULL: case ALDC: case NEW: S[d] = K_PTR; break;
+  case BIPUSH: case ILDC: S[d] = K_INT; break;
+
+  case NEWARRAY:
+    need(fn, pc, final, S[d-1], K_INT, &proven);
+    S[d-1] = K_PTR;
+    break;
+
+  case ARRAYLENGTH: case IMLOAD: case CMLOAD:
+    need(fn, pc, final, S[d-1], K_PTR, &proven);
+    S[d-1] = K_INT;
+    break;
+
+  case AADDF: case AMLOAD:
+    need(fn, pc, final, S[d-1], K_PTR, &proven);
+    S[d-1] = K_PTR;
+    break;
+
+  case AADDS:
+    need(fn, pc, final, S[d-1], K_INT, &proven);
+    need(fn, pc, final, S[d-2], K_PTR, &proven);
+    S[d-2] = K_PTR;
+    break;
+
+  case IMSTORE: case CMSTORE:
+    need(fn, pc, final, S[d-1], K_INT, &proven);
+    need(fn, pc, final, S[d-2], K_PTR, &proven);
+    break;
+
+  case AMSTORE:
+    need(fn, pc, final, S[d-1], K_PTR, &proven);
+    need(fn, pc, final, S[d-2], K_PTR, &proven);
+    break;
+
+  case ASSERT:
+    need(fn, pc, final, S[d-1], K_PTR, &proven);
+    need(fn, pc, final, S[d-2], K_INT, &proven);
+    break;
+
+  case ATHROW:
+    need(fn, pc, final, S[d-1], K_PTR, &proven);
+    break;
+
+  case RETURN:
+    *ret |= S[d-1];
+    break;
+
+  case INVOKESTATIC: {
+    uint16_t g = operand_u16(P, pc);
+    size_t n = bc0->function_pool[g].num_args;
+    for (size_t i = 0; i < n; i++) {
+      ubyte k = S[d - n + i];
+      if ((sum->args[g][i] | k) != sum->args[g][i]) {
+        sum->args[g][i] |= k;
+        sum->changed = true;
+      }
+    }
+    S[d - n] = sum->rets[g];
+    break;
+  }
+
+  case INVOKENATIVE: {
+    /* The native libraries may return either kind */
+    size_t n = bc0->native_pool[operand_u16(P, pc)].num_args;
+    S[d - n] = K_ANY;
+    break;
+  }
+
+  default:
+    /* POP, NOP, IF_CMPEQ, IF_CMPNE, GOTO take operands of any kind */
+    break;
+  }
+  return proven;
+}
+
+/* Second pass over one function.  A state is the kinds of the local
+ * variables followed by the kinds of the operands on the stack.  In
+ * the final round, once every state is complete, each reachable pc is
+ * checked and marked PC_PROVEN if it can skip its kind checks. */
+static void analyze_kinds(struct bc0_file *bc0, size_t fn,
+                          struct summary *sum) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  ubyte *P = fi->code;
+  size_t len = fi->code_length;
+  size_t nv = fi->num_vars;
+  size_t stride = nv + fi->max_stack;
+  int *depths = sum->depths[fn];
+
+  ubyte *states = xcalloc(len * stride + 1, sizeof(ubyte));
+  ubyte *cur = xcalloc(stride + 1, sizeof(ubyte));
+  bool *seen = xcalloc(len, sizeof(bool));
+  bool *pending = xcalloc(len, sizeof(bool));
+  size_t *work = xcalloc(len, sizeof(size_t));
+  size_t nwork = 0;
+  ubyte ret = sum->rets[fn];
+  bool final = sum->final;
+
+  for (size_t i = 0; i < nv; i++)
+    states[i] = i < fi->num_args ? sum->args[fn][i] : K_INT;
+  seen[0] = pending[0] = true;
+  work[nwork++] = 0;
+
+  sum->final = false;
+  while (nwork > 0) {
+    size_t pc = work[--nwork];
+    pending[pc] = false;
+    memcpy(cur, &states[pc * stride], stride);
+    transfer(bc0, fn, pc, cur, (size_t)depths[pc], sum, &ret);
+
+    size_t succ[2];
+    size_t nsucc = 0;
+    size_t next = pc + instr_length(P[pc]);
+    if (is_branch(P[pc])) {
+      succ[nsucc++] = (size_t)((long)pc + (int16_t)operand_u16(P, pc));
+      if (P[pc] != GOTO) succ[nsucc++] = next;
+    } else if (P[pc] != RETURN && P[pc] != ATHROW) {
+      succ[nsucc++] = next;
+    }
+    for (size_t i = 0; i < nsucc; i++) {
+      size_t t = succ[i];
+      if (merge(&states[t * stride], cur, nv + (size_t)depths[t], &seen[t])
+          && !pending[t]) {
+        pending[t] = true;
+        work[nwork++] = t;
+      }
+    }
+  }
+  sum->final = final;
+
+  if (final) {
+    for (size_t pc = 0; pc < len; pc++) {
+      if (!seen[pc]) continue;
+      memcpy(cur, &states[pc * stride], stride);
+      if (transfer(bc0, fn, pc, cur, (size_t)depths[pc], sum, &ret))
+        fi->pcinfo[pc] |= PC_PROVEN;
+    }
+  }
+
+  if (ret != sum->rets[fn]) {
+    sum->rets[fn] = ret;
+    sum->changed = true;
+  }
+  free(states);
+  free(cur);
+  free(seen);
+  free(pending);
+  free(work);
+}
+
+void analyze_program(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  if (bc0->function_count == 0) malformed(0, 0, "no functions");
+  if (bc0->function_pool[0].num_args != 0)
+    malformed(0, 0, "main function takes arguments");
+  if (bc0->string_count > 0 && bc0->string_pool[bc0->string_count-1] != '\0')
+    malformed(0, 0, "string pool is not NUL-terminated");
+  for (size_t i = 0; i < bc0->native_count; i++) {
+    if (bc0->native_pool[i].function_table_index >= NATIVE_FUNCTION_COUNT) {
+      fprintf(stderr, "Error: malformed bytecode: native %zu is unknown\n", i);
+      bad_program();
+    }
+  }
+
+  size_t n = bc0->function_count;
+  struct summary sum;
+  sum.depths = xcalloc(n, sizeof(int*));
+  sum.args = xcalloc(n, sizeof(ubyte*));
+  sum.rets = xcalloc(n, sizeof(ubyte));
+  for (size_t fn = 0; fn < n; fn++) {
+    sum.depths[fn] = analyze_depths(bc0, fn);
+    sum.args[fn] = xcalloc(bc0->function_pool[fn].num_args + 1, sizeof(ubyte));
+  }
+
+  /* Kinds only ever grow, so this stops; one more round then computes
+   * the final answer for every pc from the final summaries */
+  sum.final = false;
+  do {
+    sum.changed = false;
+    for (size_t fn = 0; fn < n; fn++) analyze_kinds(bc0, fn, &sum);
+  } while (sum.changed);
+  sum.final = true;
+  for (size_t fn = 0; fn < n; fn++) analyze_kinds(bc0, fn, &sum);
+  ASSERT(!sum.changed);
+
+  for (size_t fn = 0; fn < n; fn++) {
+    free(sum.depths[fn]);
+    free(sum.args[fn]);
+  }
+  free(sum.depths);
+  free(sum.args);
+  free(sum.rets);
+}
+
+int *operand_depths(struct bc0_file *bc0, size_t fn) {
+  REQUIRES(bc0 != NULL && fn < bc0->function_count);
+  REQUIRES(bc0->function_pool[fn].pcinfo != NULL);
+  return analyze_depths(bc0, fn);
+}
+
+/*** Loops over arrays ***/
+
+// Is there an instruction op at pc?
+static bool instr_at(struct function_info *fi, size_t pc, ubyte op) {
+  return pc < fi->code_length && (fi->pcinfo[pc] & PC_INSTR)
+      && fi->code[pc] == op;
+}
+
+/* Does [start, end) push exactly one value, computed only from
+ * constants and locals the loop leaves alone (and not i)? */
+static bool is_bound(struct function_info *fi, size_t start, size_t end,
+                     ubyte i, const bool *stored) {
+  ubyte *P = fi->code;
+  int depth = 0;
+  for (size_t pc = start; pc < end; pc += instr_length(P[pc])) {
+    switch (P[pc]) {
+    case VLOAD:
+      if (P[pc + 1] == i || stored[P[pc + 1]]) return false;
+      depth++;
+      break;
+    case BIPUSH: case ILDC:
+      depth++;
+      break;
+    case IADD: case ISUB: case IMUL:
+      if (!(fi->pcinfo[pc] & PC_PROVEN)) return false;
+      depth--;
+      break;
+    case ARRAYLENGTH:
+      if (!(fi->pcinfo[pc] & PC_PROVEN)) return false;
+      break;
+    default:
+      return false;
+    }
+    if (depth > LOOP_BOUND_DEPTH) return false;
+  }
+  return depth == 1;
+}
+
+/* Fill in L if head..end (a goto back to head) is a loop over arrays */
+static bool find_loop(struct function_info *fi, size_t head, size_t end,
+                      struct array_loop *L, bool stored[256]) {
+  ubyte *P = fi->code;
+
+  // It ends in i += 1, which follows cc0's test of i at head
+  if (end < head + 7 || !instr_at(fi, end - 7, VLOAD)
+      || !instr_at(fi, end - 5, BIPUSH) || P[end - 4] != 1
+      || !instr_at(fi, end - 3, IADD) || !instr_at(fi, end - 2, VSTORE)
+      || P[end - 1] != P[end - 6] || !instr_at(fi, head, VLOAD)
+      || P[head + 1] != P[end - 1])
+    return false;
+  ubyte i = P[head + 1];
+
+  // if (i < bound) goto body; goto exit; body: ...
+  size_t cmp = head + 2;
+  while (cmp < end && !is_branch(P[cmp])) cmp += instr_length(P[cmp]);
+  if (!instr_at(fi, cmp, IF_ICMPLT) || !(fi->pcinfo[cmp] & PC_PROVEN)
+      || (int16_t)operand_u16(P, cmp) != 6 || !instr_at(fi, cmp + 3, GOTO))
+    return false;
+  long exit = (long)(cmp + 3) + (int16_t)operand_u16(P, cmp + 3);
+  if (exit >= (long)head && exit <= (long)end) return false;
+  for (size_t pc = head + 1; pc <= cmp + 3; pc++)
+    if (fi->pcinfo[pc] & PC_TARGET) return false;
+
+  // Nothing outside jumps into the loop except to its head
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+    if ((pc >= head && pc <= end) || !is_branch(P[pc])) continue;
+    long target = (long)pc + (int16_t)operand_u16(P, pc);
+    if (target > (long)head && target <= (long)end) return false;
+  }
+
+  memset(stored, 0, 256 * sizeof(bool));
+  for (size_t pc = head; pc < end; pc += instr_length(P[pc]))
+    if (P[pc] == VSTORE && pc != end - 2) stored[P[pc + 1]] = true;
+  if (stored[i] || !is_bound(fi, head + 2, cmp, i, stored)) return false;
+
+  L->head = head;
+  L->end = end;
+  L->bound_start = head + 2;
+  L->bound_end = cmp;
+  L->index = i;
+  L->array_count = 0;
+  L->accesses = NULL;
+  L->access_count = 0;
+  L->fast = NULL;
+  L->head_handler = NULL;
+
+  // Every vload A; vload i; aadds in the body, for A the loop leaves alone
+  for (size_t pc = cmp + 6; pc < end; pc += instr_length(P[pc])) {
+    if (P[pc] != AADDS || !(fi->pcinfo[pc] & PC_PROVEN) || pc < 4
+        || !instr_at(fi, pc - 2, VLOAD) || P[pc - 1] != i
+        || !instr_at(fi, pc - 4, VLOAD) || P[pc - 3] == i
+        || stored[P[pc - 3]]
+        || (fi->pcinfo[pc - 2] & PC_TARGET) || (fi->pcinfo[pc] & PC_TARGET))
+      continue;
+    size_t a = 0;
+    while (a < L->array_count && L->arrays[a] != P[pc - 3]) a++;
+    if (a == LOOP_MAX_ARRAYS) continue;
+    if (a == L->array_count) L->arrays[L->array_count++] = P[pc - 3];
+    L->accesses = xrealloc(L->accesses, (L->access_count + 1) * sizeof(size_t));
+    L->accesses[L->access_count++] = pc;
+  }
+  return L->access_count > 0;
+}
+
+struct array_loop *array_loops(struct bc0_file *bc0, size_t fn,
+                               size_t *count) {
+  REQUIRES(bc0 != NULL && fn < bc0->function_count && count != NULL);
+  struct function_info *fi = &bc0->function_pool[fn];
+  REQUIRES(fi->pcinfo != NULL);
+  ubyte *P = fi->code;
+  struct array_loop *loops = NULL;
+  size_t n = 0;
+  bool stored[256];
+
+  for (size_t pc = 0; pc < fi->code_length; pc += instr_length(P[pc])) {
+    if (P[pc] != GOTO) continue;
+    long head = (long)pc + (int16_t)operand_u16(P, pc);
+    struct array_loop L;
+    if (head < 0 || head >= (long)pc
+        || !find_loop(fi, (size_t)head, pc, &L, stored))
+      continue;
+
+    // A continue in a while loop goes back to the head too; keep the
+    // whole loop, which ends last
+    size_t k = 0;
+    while (k < n && loops[k].head != L.head) k++;
+    if (k == n) {
+      loops = xrealloc(loops, (n + 1) * sizeof(struct array_loop));
+      n++;
+    } else {
+      free(loops[k].accesses);
+    }
+    loops[k] = L;
+  }
+  *count = n;
+  return loops;
+}
@@ -0,0 +1,61 @@
+/* C0VM load-time analysis
+ * 15-122 Principles of Imperative Computation
+ *
+ * Verifies the code of every function once before it runs and fills
+ * in the function_info fields the interpreter depends on.  Exits with
+ * an error message if the code is malformed: invalid opcodes, jumps
+ * outside the function or into the middle of an instruction, pool or
+ * variable indices out of range, stack underflow or depth mismatches,
+ * or operands that are certain to be of the wrong kind.
+ */
+
+#include "c0vm.h"
+
+#ifndef _ANALYZE_H_
+#define _ANALYZE_H_
+
+/* Bits of function_info.pcinfo[pc] */
+#define PC_INSTR  0x01  /* An instruction starts at pc */
+#define PC_TARGET 0x02  /* Some branch jumps to pc */
+#define PC_PROVEN 0x04  /* The operands at pc always have the right kinds,
+                           so the instruction may skip checking them */
+#define PC_TAIL   0x08  /* An invokestatic whose result is returned at
+                           once, so the callee may take over the frame */
+
+void analyze_program(struct bc0_file *bc0);
+
+/* After analyze_program: how many operands are on the stack before each
+ * pc of the function, -1 where unreachable.  The caller frees it. */
+int *operand_depths(struct bc0_file *bc0, size_t fn);
+
+/* A loop as cc0 compiles for (...; i < bound; i++) { ... A[i] ... },
+ * where the body stores to neither the arrays A, nor i (except by the
+ * final i++), nor any variable bound reads.  If i >= 0 and A != NULL
+ * and bound <= \length(A) when the loop is entered, then no access
+ * &A[i] in it can be out of bounds. */
+#define LOOP_MAX_ARRAYS 4
+#define LOOP_BOUND_DEPTH 4
+struct array_loop {
+  size_t head;                /* vload i, then bound, then if_icmplt */
+  size_t end;                 /* the goto back to head */
+  size_t bound_start, bound_end;  /* the code that pushes bound: only
+                                     vload, bipush, ildc, iadd, isub,
+                                     imul and arraylength */
+  ubyte index;                /* i */
+  ubyte arrays[LOOP_MAX_ARRAYS];
+  size_t array_count;
+  size_t *accesses;           /* pcs of the aadds of each &A[i] */
+  size_t access_count;
+
+  /* Filled in by the VM */
+  void **fast;                /* threaded code with those unchecked */
+  void *head_handler;         /* what runs at head otherwise */
+};
+
+/* After analyze_program: the loops of the function whose array bounds
+ * checks can be made once, when the loop is entered, at most one per
+ * head.  The caller frees it (and the accesses of each). */
+struct array_loop *array_loops(struct bc0_file *bc0, size_t fn,
+                               size_t *count);
+
+#endif /* _ANALYZE_H_ */
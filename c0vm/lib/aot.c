@@ -0,0 +1,349 @@
+/* C0VM ahead-of-time translation to C
+ * 15-122 Principles of Imperative Computation
+ *
+ * Every function of the program becomes a C function.  The analysis
+ * knows how deep the operand stack is before each instruction, so the
+ * stack slots become C variables s0, s1, ... and the local variables
+ * v0, v1, ...; branches become gotos.  The generated code raises the
+ * same errors as the interpreter, in the same order, using the same
+ * c0_value helpers, so it behaves the same under either value
+ * representation.  The interpreter stays the reference.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_instr.h"
+#include "analyze.h"
+
+#define NULL_ERROR "c0_memory_error(\"null pointer was accessed.\")"
+
+static const char *header =
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include \"xalloc.h\"\n"
+  "#include \"c0vm.h\"\n"
+  "#include \"c0vm_c0ffi.h\"\n"
+  "#include \"c0vm_abort.h\"\n"
+  "\n"
+  "/* nested calls, limited like in the interpreter; deep recursion may\n"
+  " * also need a bigger C stack (ulimit -s) */\n"
+  "size_t c0_depth = 0;\n"
+  "size_t c0_max_depth = 1000000;\n"
+  "\n";
+
+static const char *footer =
+  "int main(int argc, char **argv) {\n"
+  "  c0_argc = argc;\n"
+  "  c0_argv = argv;\n"
+  "\n"
+  "  char *s = getenv(\"C0VM_MAX_DEPTH\");\n"
+  "  if (s != NULL) {\n"
+  "    char *end;\n"
+  "    c0_max_depth = strtoul(s, &end, 10);\n"
+  "    if (*s == '\\0' || *end != '\\0' || c0_max_depth == 0) {\n"
+  "      fprintf(stderr, \"Error: C0VM_MAX_DEPTH must be a positive "
+  "integer\\n\");\n"
+  "      exit(EXIT_FAILURE);\n"
+  "    }\n"
+  "  }\n"
+  "\n"
+  "  char *filename = getenv(\"C0_RESULT_FILE\");\n"
+  "  FILE *f = NULL;\n"
+  "  if (filename != NULL) {\n"
+  "    f = fopen(filename, \"w\");\n"
+  "    if (f == NULL || fwrite(\"\\0\", 1, 1, f) < 1) {\n"
+  "      perror(\"Couldn't write to $C0_RESULT_FILE\");\n"
+  "      exit(EXIT_FAILURE);\n"
+  "    }\n"
+  "  }\n"
+  "\n"
+  "  int result = val2int(c0_fn_0());\n"
+  "\n"
+  "  if (f == NULL) {\n"
+  "    printf(\"%d\\n\", result);\n"
+  "  } else {\n"
+  "    printf(\"Result = %d\\n\", result);\n"
+  "    if (fwrite(&result, sizeof(int), 1, f) < 1 || fclose(f) != 0) {\n"
+  "      perror(\"Couldn't write to $C0_RESULT_FILE\");\n"
+  "      exit(EXIT_FAILURE);\n"
+  "    }\n"
+  "  }\n"
+  "  return 0;\n"
+  "}\n";
+
+static uint16_t operand_u16(ubyte *P, size_t pc) {
+  return (uint16_t)((P[pc + 1] << 8) | P[pc + 2]);
+}
+
+static size_t branch_target(ubyte *P, size_t pc) {
+  return (size_t)((long)pc + (int16_t)operand_u16(P, pc));
+}
+
+static void write_signature(FILE *out, struct bc0_file *bc0, size_t fn) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  fprintf(out, "c0_value c0_fn_%zu(", fn);
+  if (fi->num_args == 0) fprintf(out, "void");
+  for (size_t i = 0; i < fi->num_args; i++)
+    fprintf(out, "%sc0_value v%zu", i == 0 ? "" : ", ", i);
+  fprintf(out, ")");
+}
+
+/* The C for the instruction at pc, with d operands on the stack */
+static void write_instr(FILE *out, struct bc0_file *bc0, size_t fn,
+                        size_t pc, size_t d) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  ubyte *P = fi->code;
+  bool proven = (fi->pcinfo[pc] & PC_PROVEN) != 0;
+  const char *I = proven ? "val2int_unchecked" : "val2int";
+  const char *A = proven ? "val2ptr_unchecked" : "val2ptr";
+  size_t x = d - 2;  /* the usual slots of two operands */
+  size_t y = d - 1;
+
+  switch (P[pc]) {
+  case NOP: case POP:
+    break;
+
+  case DUP:
+    fprintf(out, "  s%zu = s%zu;\n", d, y);
+    break;
+
+  case SWAP:
+    fprintf(out, "  { c0_value t = s%zu; s%zu = s%zu; s%zu = t; }\n",
+            y, y, x, x);
+    break;
+
+  case RETURN:
+    fprintf(out, "  return s%zu;\n", y);
+    break;
+
+  case IADD: case ISUB: case IMUL: case IAND: case IOR: case IXOR: {
+    const char *op = P[pc] == IADD ? "+" : P[pc] == ISUB ? "-"
+      : P[pc] == IMUL ? "*" : P[pc] == IAND ? "&" : P[pc] == IOR ? "|" : "^";
+    fprintf(out, "  { int32_t y = %s(s%zu); int32_t x = %s(s%zu);"
+            " s%zu = int2val(x %s y); }\n", I, y, I, x, x, op);
+    break;
+  }
+
+  case IDIV: case IREM:
+    fprintf(out, "  { int32_t y = %s(s%zu);"
+            " if (y == 0) c0_arith_error(\"division by 0.\");\n"
+            "    int32_t x = %s(s%zu);"
+            " if (y == -1 && x == INT32_MIN)"
+            " c0_arith_error(\"division by 0.\");\n"
+            "    s%zu = int2val(x %s y); }\n",
+            I, y, I, x, x, P[pc] == IDIV ? "/" : "%");
+    break;
+
+  case ISHL: case ISHR:
+    fprintf(out, "  { int32_t y = %s(s%zu);"
+            " if (!(0 <= y && y < 32)) c0_arith_error(\"division by 0.\");\n"
+            "    int32_t x = %s(s%zu); s%zu = int2val(x %s y); }\n",
+            I, y, I, x, x, P[pc] == ISHL ? "<<" : ">>");
+    break;
+
+  case BIPUSH:
+    fprintf(out, "  s%zu = int2val(%d);\n", d, (int)(byte)P[pc + 1]);
+    break;
+
+  case ILDC: {
+    int32_t c = bc0->int_pool[operand_u16(P, pc)];
+    if (c == INT32_MIN) fprintf(out, "  s%zu = int2val(INT32_MIN);\n", d);
+    else fprintf(out, "  s%zu = int2val(%" PRId32 ");\n", d, c);
+    break;
+  }
+
+  case ALDC:
+    fprintf(out, "  s%zu = ptr2val(&c0_strings[%u]);\n", d, operand_u16(P, pc));
+    break;
+
+  case ACONST_NULL:
+    fprintf(out, "  s%zu = ptr2val(NULL);\n", d);
+    break;
+
+  case VLOAD:
+    fprintf(out, "  s%zu = v%u;\n", d, P[pc + 1]);
+    break;
+
+  case VSTORE:
+    fprintf(out, "  v%u = s%zu;\n", P[pc + 1], y);
+    break;
+
+  case ATHROW:
+    fprintf(out, "  c0_user_error((char*)%s(s%zu));\n", A, y);
+    break;
+
+  case ASSERT:
+    fprintf(out, "  if (%s(s%zu) == 0) c0_assertion_failure((char*)%s(s%zu));\n",
+            I, x, A, y);
+    break;
+
+  case IF_CMPEQ: case IF_CMPNE:
+    fprintf(out, "  if (%sval_equal(s%zu, s%zu)) goto L%zu;\n",
+            P[pc] == IF_CMPEQ ? "" : "!", x, y, branch_target(P, pc));
+    break;
+
+  case IF_ICMPLT: case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: {
+    const char *op = P[pc] == IF_ICMPLT ? "<" : P[pc] == IF_ICMPGE ? ">="
+      : P[pc] == IF_ICMPGT ? ">" : "<=";
+    fprintf(out, "  { int32_t y = %s(s%zu); int32_t x = %s(s%zu);"
+            " if (x %s y) goto L%zu; }\n", I, y, I, x, op,
+            branch_target(P, pc));
+    break;
+  }
+
+  case GOTO:
+    fprintf(out, "  goto L%zu;\n", branch_target(P, pc));
+    break;
+
+  case INVOKESTATIC: {
+    uint16_t g = operand_u16(P, pc);
+    size_t n = bc0->function_pool[g].num_args;
+    fprintf(out, "  if (c0_depth == c0_max_depth)"
+            " c0_memory_error(\"call stack overflow.\");\n"
+            "  c0_depth++;\n  s%zu = c0_fn_%u(", d - n, g);
+    for (size_t i = 0; i < n; i++)
+      fprintf(out, "%ss%zu", i == 0 ? "" : ", ", d - n + i);
+    fprintf(out, ");\n  c0_depth--;\n");
+    break;
+  }
+
+  case INVOKENATIVE: {
+    struct native_info *ni = &bc0->native_pool[operand_u16(P, pc)];
+    size_t n = ni->num_args;
+    fprintf(out, "  { c0_ffi_value a[%zu];", n == 0 ? 1 : n);
+    for (size_t i = n; i > 0; i--)
+      fprintf(out, " a[%zu] = val2ffi(s%zu);", i - 1, d - n + i - 1);
+    fprintf(out, "\n    s%zu = ffi2val(native_function_table[%u](a)); }\n",
+            d - n, ni->function_table_index);
+    break;
+  }
+
+  case NEW:
+    fprintf(out, "  s%zu = ptr2val(xcalloc(1, %u));\n", d, P[pc + 1]);
+    break;
+
+  case NEWARRAY:
+    fprintf(out, "  { int32_t n = %s(s%zu);"
+            " if (n < 0) c0_memory_error(\"invalid array size.\");\n"
+            "    c0_array *a = xcalloc(1, sizeof(c0_array) + (size_t)n * %u);"
+            " a->count = n; a->elt_size = %d;\n"
+            "    a->elems = a + 1; s%zu = ptr2val(a); }\n",
+            I, y, P[pc + 1], (int)(int8_t)P[pc + 1], y);
+    break;
+
+  case ARRAYLENGTH:
+    fprintf(out, "  { c0_array *a = %s(s%zu); if (a == NULL) %s;"
+            " s%zu = int2val(a->count); }\n", A, y, NULL_ERROR, y);
+    break;
+
+  case AADDF:
+    fprintf(out, "  { unsigned char *a = %s(s%zu); if (a == NULL) %s;"
+            " s%zu = ptr2val(a + %u); }\n", A, y, NULL_ERROR, y, P[pc + 1]);
+    break;
+
+  case AADDS:
+    fprintf(out, "  { int32_t i = %s(s%zu); c0_array *a = %s(s%zu);"
+            " if (a == NULL) %s;\n"
+            "    if (!(0 <= i && i < a->count))"
+            " c0_memory_error(\"invalid index access.\");\n"
+            "    s%zu = ptr2val((unsigned char*)a->elems + a->elt_size * i); }\n",
+            I, y, A, x, NULL_ERROR, x);
+    break;
+
+  case IMLOAD:
+    fprintf(out, "  { int32_t *a = %s(s%zu); if (a == NULL) %s;"
+            " s%zu = int2val(*a); }\n", A, y, NULL_ERROR, y);
+    break;
+
+  case AMLOAD:
+    fprintf(out, "  { void **a = %s(s%zu); if (a == NULL) %s;"
+            " s%zu = ptr2val(*a); }\n", A, y, NULL_ERROR, y);
+    break;
+
+  case CMLOAD:
+    fprintf(out, "  { unsigned char *a = %s(s%zu); if (a == NULL) %s;"
+            " s%zu = int2val((int32_t)(int8_t)*a); }\n", A, y, NULL_ERROR, y);
+    break;
+
+  case IMSTORE:
+    fprintf(out, "  { int32_t v = %s(s%zu); int32_t *a = %s(s%zu);"
+            " if (a == NULL) %s; *a = v; }\n", I, y, A, x, NULL_ERROR);
+    break;
+
+  case AMSTORE:
+    fprintf(out, "  { void *v = %s(s%zu); void **a = %s(s%zu);"
+            " if (a == NULL) %s; *a = v; }\n", A, y, A, x, NULL_ERROR);
+    break;
+
+  case CMSTORE:
+    fprintf(out, "  { int32_t v = %s(s%zu); unsigned char *a = %s(s%zu);"
+            " if (a == NULL) %s; *a = (unsigned char)(v & 0x7f); }\n",
+            I, y, A, x, NULL_ERROR);
+    break;
+
+  default:
+    ASSERT(false);  /* the verifier rejected it */
+  }
+}
+
+static void write_function(FILE *out, struct bc0_file *bc0, size_t fn) {
+  struct function_info *fi = &bc0->function_pool[fn];
+  int *depths = operand_depths(bc0, fn);
+
+  write_signature(out, bc0, fn);
+  fprintf(out, " {\n");
+  for (size_t i = fi->num_args; i < fi->num_vars; i++)
+    fprintf(out, "  c0_value v%zu = int2val(0);\n", i);
+  for (size_t i = 0; i < fi->max_stack; i++)
+    fprintf(out, "  c0_value s%zu = int2val(0);\n", i);
+  for (size_t i = 0; i < fi->num_vars; i++) fprintf(out, "  (void)v%zu;\n", i);
+  for (size_t i = 0; i < fi->max_stack; i++) fprintf(out, "  (void)s%zu;\n", i);
+
+  for (size_t pc = 0; pc < fi->code_length; pc++) {
+    if (depths[pc] < 0) continue;
+    if (fi->pcinfo[pc] & PC_TARGET) fprintf(out, " L%zu:\n", pc);
+    fprintf(out, "  /* %zu: %s */\n", pc, instr_name(fi->code[pc]));
+    write_instr(out, bc0, fn, pc, (size_t)depths[pc]);
+  }
+
+  /* Every path ends in a return, an error, or a jump */
+  fprintf(out, "  abort();\n}\n\n");
+  free(depths);
+}
+
+void write_c(struct bc0_file *bc0, char *filename) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+  analyze_program(bc0);
+
+  FILE *out = fopen(filename, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Error: could not open '%s' for writing\n", filename);
+    exit(1);
+  }
+
+  fprintf(out, "/* Generated by c0vm --aot; do not edit */\n");
+  fprintf(out, "%s", header);
+
+  fprintf(out, "char c0_strings[%u] = {", bc0->string_count + 1);
+  for (size_t i = 0; i < bc0->string_count; i++)
+    fprintf(out, "%s%d,", i % 16 == 0 ? "\n  " : " ", bc0->string_pool[i]);
+  fprintf(out, "\n  0\n};\n\n");
+
+  for (size_t fn = 0; fn < bc0->function_count; fn++) {
+    write_signature(out, bc0, fn);
+    fprintf(out, ";\n");
+  }
+  fprintf(out, "\n");
+  for (size_t fn = 0; fn < bc0->function_count; fn++)
+    write_function(out, bc0, fn);
+
+  fprintf(out, "%s", footer);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error: could not write '%s'\n", filename);
+    exit(1);
+  }
+}
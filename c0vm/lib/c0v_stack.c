@@ -1,108 +1,118 @@
-/* 
+/*
  * Interface for stacks of type c0_value, specifically
  *
- * 15-122 Principles of Imperative Computation 
+ * 15-122 Principles of Imperative Computation
  */
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "xalloc.h"
 #include "contracts.h"
 #include "c0v_stack.h"
 #include "c0vm.h"
 
-/* Aux structure of linked lists */
-typedef struct list_node list;
-struct list_node {
-  c0_value data;
-  struct list_node *next;
-};
-
-/* will diverge if list is circular! */
-static inline bool is_stack_segment(list *start, list *end)
-{
-  list *p = start;
-  while (p != end) {
-    if (p == NULL) return false;
-    p = p->next;
-  }
-  return true;
-}
+#define C0V_STACK_INITIAL 1024
 
-/* Stacks */ 
+/* Stacks */
 
 typedef struct c0v_stack_header stack;
-struct c0v_stack_header {
-  list *top;
-  list *bottom;
-};
 
 bool is_c0v_stack (stack *S) {
   if (S == NULL) return false;
-  if (S->top == NULL || S->bottom == NULL) return false;
-  if (!is_stack_segment(S->top, S->bottom)) return false;
+  if (S->data == NULL || S->capacity == 0) return false;
+  if (!(S->data <= S->locals && S->locals <= S->base)) return false;
+  if (!(S->base <= S->top)) return false;
+  if (!(S->top <= S->limit && S->limit <= S->data + S->capacity))
+    return false;
   return true;
 }
 
 bool c0v_stack_empty(stack *S) {
   REQUIRES(is_c0v_stack(S));
-  return S->top == S->bottom;
+  return S->top == S->base;
 }
 
 stack *c0v_stack_new() {
   stack *S = xmalloc(sizeof(stack));
-  list *p = xmalloc(sizeof(list));
-  /* Dummy node: does not need to be initialized! */
-  S->top = p;
-  S->bottom = p;
+  S->capacity = C0V_STACK_INITIAL;
+  S->data = xcalloc(S->capacity, sizeof(c0_value));
+  S->top = S->data;
+  S->locals = S->data;
+  S->base = S->data;
+  S->limit = S->data;
 
   ENSURES(is_c0v_stack(S));
   ENSURES(c0v_stack_empty(S));
   return S;
 }
 
-void c0v_push(stack *S, c0_value x) {
+size_t c0v_stack_size(stack *S) {
   REQUIRES(is_c0v_stack(S));
-
-  list *p = xmalloc(sizeof(list));
-  p->data = x;
-  p->next = S->top;
-  S->top = p;
-
-  ENSURES(is_c0v_stack(S) && !c0v_stack_empty(S));
+  return (size_t)(S->top - S->base);
 }
 
-c0_value c0v_pop(stack *S) {
+c0v_mark c0v_enter(stack *S, size_t num_args, size_t num_vars,
+                   size_t max_stack) {
   REQUIRES(is_c0v_stack(S));
-  REQUIRES(!c0v_stack_empty(S));
+  REQUIRES(num_args <= c0v_stack_size(S) && num_args <= num_vars);
+
+  size_t locals = (size_t)(S->top - S->data) - num_args;
+  size_t size = num_vars + max_stack;
+  c0v_mark m;
+  m.locals = (size_t)(S->locals - S->data);
+  m.base = (size_t)(S->base - S->data);
+  m.limit = (size_t)(S->limit - S->data);
+
+  if (S->capacity - locals < size) {
+    size_t capacity = S->capacity;
+    while (capacity - locals < size) capacity *= 2;
+    c0_value *data = xcalloc(capacity, sizeof(c0_value));
+    for (size_t i = 0; i < locals + num_args; i++) data[i] = S->data[i];
+    free(S->data);
+    S->data = data;
+    S->capacity = capacity;
+  }
 
-  c0_value x = S->top->data;    /* save old stack element to return */
-  list *q = S->top;             /* save old list node to free */
-  S->top = S->top->next;
-  free(q);                      /* free old list node */
+  S->locals = S->data + locals;
+  for (size_t i = num_args; i < num_vars; i++) S->locals[i] = int2val(0);
+  S->base = S->locals + num_vars;
+  S->top = S->base;
+  S->limit = S->base + max_stack;
 
   ENSURES(is_c0v_stack(S));
-  return x;                     /* return old stack element */
+  ENSURES(c0v_stack_empty(S));
+  return m;
 }
 
-size_t c0v_stack_size(stack *S) {
+void c0v_reenter(stack *S, size_t num_args, size_t num_vars,
+                 size_t max_stack) {
   REQUIRES(is_c0v_stack(S));
+  REQUIRES(num_args <= c0v_stack_size(S) && num_args <= num_vars);
 
-  size_t i = 0;
-  for (list *p = S->top; p != S->bottom; p = p->next) i++;
-  return i;
+  memmove(S->locals, S->top - num_args, num_args * sizeof(c0_value));
+  S->top = S->locals + num_args;
+  S->base = S->locals;
+  (void)c0v_enter(S, num_args, num_vars, max_stack);
 }
 
-void c0v_stack_free(stack *S) {
+void c0v_leave(stack *S, c0v_mark m) {
   REQUIRES(is_c0v_stack(S));
+  REQUIRES(c0v_stack_empty(S));
+  REQUIRES(m.locals <= m.base && m.base <= (size_t)(S->locals - S->data));
+  REQUIRES((size_t)(S->locals - S->data) <= m.limit);
+  REQUIRES(m.limit <= S->capacity);
 
-  while (S->top != S->bottom) {
-    ASSERT(is_stack_segment(S->top, S->bottom));
-    list *p = S->top;
-    S->top = S->top->next;
-    free(p);
-  }
+  S->top = S->locals;
+  S->locals = S->data + m.locals;
+  S->base = S->data + m.base;
+  S->limit = S->data + m.limit;
+
+  ENSURES(is_c0v_stack(S));
+}
 
-  free(S->top); /* == S->bottom */
+void c0v_stack_free(stack *S) {
+  REQUIRES(is_c0v_stack(S));
+  free(S->data);
   free(S);
 }
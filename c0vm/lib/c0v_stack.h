@@ -1,33 +1,87 @@
 /*
  * Interface for stacks of type c0_value, specifically
  *
+ * One stack is shared by the whole VM.  Every function call gets a
+ * window at the top of it holding its local variables followed by
+ * room for as many operands as the function ever needs, so pushing
+ * and popping never allocate.
+ *
  * 15-122 Principles of Imperative Computation */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "c0vm.h"
+#include "contracts.h"
 
 #ifndef _VALSTACK_H_
 #define _VALSTACK_H_
 
-// typedef ______* c0v_stack_t;
 typedef struct c0v_stack_header *c0v_stack_t;
+struct c0v_stack_header {
+  c0_value *top;      /* one past the topmost value */
+  c0_value *locals;   /* local variables of the current call */
+  c0_value *base;     /* bottom of the current operand window */
+  c0_value *limit;    /* end of the current operand window */
+  c0_value *data;     /* \length(data) == capacity */
+  size_t capacity;
+};
+
+/* Saved bounds of the caller's window, as offsets into data */
+typedef struct c0v_mark {
+  size_t locals;
+  size_t base;
+  size_t limit;
+} c0v_mark;
 
-bool c0v_stack_empty(c0v_stack_t S)
+bool c0v_stack_empty(c0v_stack_t S)   /* Current window is empty */
   /*@requires S != NULL; @*/ ;
 
 c0v_stack_t c0v_stack_new()
   /*@ensures \result != NULL; @*/ ;
 
-void c0v_push(c0v_stack_t S, c0_value x)
-  /*@requires S != NULL; @*/ ;
-
-c0_value c0v_pop(c0v_stack_t S)
-  /*@requires S != NULL; @*/ ;
-
-size_t c0v_stack_size(c0v_stack_t S)
+size_t c0v_stack_size(c0v_stack_t S)  /* Values in the current window */
   /*@requires S != NULL; */ ;
 
 void c0v_stack_free(c0v_stack_t S) /* Does not free elements */
   /*@requires S != NULL; @*/ ;
 
+/* Open a window for a call, growing the stack if needed.  The top
+ * num_args operands become the first of num_vars local variables, the
+ * rest are zeroed, and max_stack operands fit above them.  Returns
+ * what c0v_leave needs to restore the caller's window. */
+c0v_mark c0v_enter(c0v_stack_t S, size_t num_args, size_t num_vars,
+                   size_t max_stack)
+  /*@requires S != NULL && num_args <= c0v_stack_size(S); @*/
+  /*@requires num_args <= num_vars; @*/ ;
+
+/* Open the window for a tail call in place of the current one: the
+ * top num_args operands become the first of the new locals, over the
+ * old ones, and the caller's mark stays as it was */
+void c0v_reenter(c0v_stack_t S, size_t num_args, size_t num_vars,
+                 size_t max_stack)
+  /*@requires S != NULL && num_args <= c0v_stack_size(S); @*/
+  /*@requires num_args <= num_vars; @*/ ;
+
+/* Close the current (empty) window; the locals are discarded */
+void c0v_leave(c0v_stack_t S, c0v_mark m)
+  /*@requires S != NULL && c0v_stack_empty(S); @*/ ;
+
+static inline void c0v_push(c0v_stack_t S, c0_value x) {
+  REQUIRES(S != NULL && S->top < S->limit);
+  *S->top++ = x;
+}
+
+static inline c0_value c0v_pop(c0v_stack_t S) {
+  REQUIRES(S != NULL && S->top > S->base);
+  return *--S->top;
+}
+
+/* Pop the top n values at once; they stay in order where they are,
+ * until the next push */
+static inline c0_value *c0v_popn(c0v_stack_t S, size_t n) {
+  REQUIRES(S != NULL && n <= (size_t)(S->top - S->base));
+  S->top -= n;
+  return S->top;
+}
+
 #endif
@@ -8,7 +8,9 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <inttypes.h>
+#include <setjmp.h>
 #include "c0vm_abort.h"
 
 #define BYTECODE_VERSION 9
@@ -38,6 +40,18 @@ struct bc0_file {
   /* native function tables */
   uint16_t native_count;
   struct native_info *native_pool; // \length(native_pool) == native_count
+
+  /* Not part of the file format: the buffer the pools point into when
+   * the program was loaded from a .bc0b image, NULL otherwise */
+  void *image;
+
+  /* Filled in by the VM: native_function_table[function_table_index]
+   * for each native of native_pool */
+  struct c0_value (**natives)(struct c0_value *args);
+
+  /* Filled in by each execute: the interned copy of the string at each
+   * offset of string_pool that an aldc loads, NULL elsewhere */
+  char **strings;
 };
 
 struct function_info {
@@ -45,6 +59,15 @@ struct function_info {
   uint16_t num_vars;
   uint16_t code_length;
   ubyte *code;            // \length(code) == code_length
+
+  /* Filled in by the VM before running, not part of the file format */
+  uint16_t max_stack;     // most operands ever on the stack at once
+  ubyte *pcinfo;          // PC_* bits from analyze.h, \length == code_length
+  void **dispatch;        // threaded code, \length(dispatch) == code_length
+  uint32_t calls;         // invocations so far, counted for the JIT
+  struct jit_code *jit;   // machine code from lib/jit.c, or NULL
+  struct array_loop *loops;  // from analyze.h, with hoisted bounds checks
+  size_t loop_count;
 };
 
 struct native_info {
@@ -57,13 +80,20 @@ struct native_info {
 
 enum c0_val_kind { C0_INTEGER, C0_POINTER };
 
-typedef struct c0_value {
+/* The layout the C0 native libraries are compiled against; natives are
+ * always called with, and return, values in this form */
+struct c0_value {
   enum c0_val_kind kind;
   union {
     int32_t i;
     void *p;
   } payload;
-} c0_value;
+};
+typedef struct c0_value c0_ffi_value;
+
+#ifndef C0VM_TAGGED
+
+typedef struct c0_value c0_value;
 
 static inline c0_value int2val(int32_t i) {
   c0_value v;
@@ -97,6 +127,88 @@ static inline bool val_equal(c0_value v1, c0_value v2) {
                                 : val2ptr(v1) == val2ptr(v2));
 }
 
+static inline c0_ffi_value val2ffi(c0_value v) { return v; }
+static inline c0_value ffi2val(c0_ffi_value v) { return v; }
+
+/* Only for values whose kind the verifier has already proven */
+static inline int32_t val2int_unchecked(c0_value v) { return v.payload.i; }
+static inline void *val2ptr_unchecked(c0_value v) { return v.payload.p; }
+
+static inline bool val_is_int(c0_value v) { return v.kind == C0_INTEGER; }
+static inline bool val_is_ptr(c0_value v) { return v.kind == C0_POINTER; }
+
+#else /* C0VM_TAGGED */
+
+/* Compiling with -DC0VM_TAGGED packs a value into 8 bytes instead of
+ * 16.  User-space pointers on the 64-bit machines we run on never have
+ * any of their top 16 bits set, so a pointer is stored as is and an
+ * integer is stored in the low 32 bits with C0_INT_TAG above them.
+ * (Tagging the low bits would not work: string and char array
+ * pointers need not be aligned.)  Zero is the NULL pointer. */
+
+typedef uint64_t c0_value;
+
+#define C0_INT_TAG ((uint64_t)1 << 48)
+
+static inline c0_value int2val(int32_t i) {
+  return C0_INT_TAG | (uint32_t)i;
+}
+
+static inline int32_t val2int(c0_value v) {
+  if ((v >> 32) != (C0_INT_TAG >> 32))
+    c0_memory_error("Invalid cast from c0_value (a pointer) to an integer");
+  return (int32_t)(uint32_t)v;
+}
+
+static inline c0_value ptr2val(void *p) {
+  return (uint64_t)(uintptr_t)p;
+}
+
+static inline void *val2ptr(c0_value v) {
+  if ((v >> 48) != 0)
+    c0_memory_error("Invalid cast from c0_value (an integer) to a pointer");
+  return (void*)(uintptr_t)v;
+}
+
+static inline bool val_equal(c0_value v1, c0_value v2) {
+  return v1 == v2;
+}
+
+static inline c0_ffi_value val2ffi(c0_value v) {
+  c0_ffi_value f;
+  if ((v >> 48) == 0) {
+    f.kind = C0_POINTER;
+    f.payload.p = val2ptr(v);
+  } else {
+    f.kind = C0_INTEGER;
+    f.payload.i = val2int(v);
+  }
+  return f;
+}
+
+static inline c0_value ffi2val(c0_ffi_value f) {
+  return f.kind == C0_INTEGER ? int2val(f.payload.i) : ptr2val(f.payload.p);
+}
+
+/* Only for values whose kind the verifier has already proven */
+static inline int32_t val2int_unchecked(c0_value v) {
+  return (int32_t)(uint32_t)v;
+}
+
+static inline void *val2ptr_unchecked(c0_value v) {
+  return (void*)(uintptr_t)v;
+}
+
+static inline bool val_is_int(c0_value v) {
+  return (v >> 32) == (C0_INT_TAG >> 32);
+}
+
+static inline bool val_is_ptr(c0_value v) {
+  return (v >> 48) == 0;
+}
+
+#endif /* C0VM_TAGGED */
+
 
 /*** instruction opcodes ***/
 
@@ -172,10 +284,79 @@ typedef struct c0_array_header c0_array;
 
 /*** interface functions (used in c0vm-main.c) ***/
 
-struct bc0_file *read_program(char *filename);
+struct bc0_file *read_program(char *filename);  /* .bc0 or .bc0b */
+struct bc0_file *try_read_program(char *filename); /* NULL if unreadable */
+bool try_analyze_program(struct bc0_file *program); /* false if malformed */
+void bad_program(void);   /* unwind to one of the two above, or exit */
+struct bc0_file *copy_program(struct bc0_file *program); /* not yet run */
 void free_program(struct bc0_file *program);
+void write_image(struct bc0_file *program, char *filename);  /* .bc0b */
+void write_c(struct bc0_file *program, char *filename);      /* --aot */
+
+/*** VM contexts ***/
+
+/* How the last execute in a context ended */
+enum c0vm_status {
+  C0VM_DONE,                /* main returned */
+  C0VM_USER_ERROR,          /* error() */
+  C0VM_ASSERTION_FAILURE,   /* assert() or a contract */
+  C0VM_MEMORY_ERROR,        /* NULL, an index, or the call stack */
+  C0VM_ARITH_ERROR,         /* division or shift */
+};
+
+/* Everything one execution of a program owns, so that one process can
+ * run many at once, each on a thread of its own.  A context runs one
+ * program at a time, and a program (which execute fills in as it runs)
+ * is run by one context at a time. */
+struct c0vm_ctx {
+  /* Set by c0vm_ctx_new, and may be changed before execute */
+  int argc;                 /* for the args library, if argv != NULL */
+  char **argv;              /* argv[0] is the program.  The args library
+                               reads process-wide c0_argc and c0_argv,
+                               which execute sets from these, so contexts
+                               with arguments must not run at once */
+  FILE *err;                /* where runtime errors are reported, or NULL */
+  bool unwind;              /* on a runtime error, return from execute
+                               instead of ending the process */
+  size_t max_depth;         /* calls that may be active at once */
+  size_t trace;             /* instructions the tracer keeps (see
+                               trace.h), 0 for no tracing */
+
+  /* Snapshots (see snapshot.h): the run stops once to write one to
+   * snapshot, before the instruction at snapshot_pc of function
+   * snapshot_fn, or if snapshot_native >= 0, before the first call to
+   * that native (by function table index).  With restore set, the run
+   * carries on from that snapshot instead of starting over, or starts
+   * over if it cannot.  While a snapshot is to be taken, the threaded
+   * code of the program is this context's alone. */
+  const char *snapshot;     /* or NULL */
+  size_t snapshot_fn, snapshot_pc;
+  int snapshot_native;
+  const char *restore;      /* or NULL */
+
+  /* How the last execute ended, and with unwind, the error message */
+  enum c0vm_status status;
+  char *message;
+
+  /* Owned by the VM */
+  struct gc_heap *heap;
+  struct string_arena *strings;
+  struct c0v_stack_header *stack;    /* of the execute under way */
+  void *frames;
+  struct breakpoints *breakpoints;   /* until the snapshot is taken */
+  struct trace *tracer;              /* if trace > 0 */
+  jmp_buf on_error;
+};
+typedef struct c0vm_ctx c0vm_ctx;
+
+/* A context reporting to stderr and ending the process on an error,
+ * like the c0vm command */
+c0vm_ctx *c0vm_ctx_new(int argc, char **argv);
+void c0vm_ctx_free(c0vm_ctx *ctx);
 
-int execute(struct bc0_file *bc0);
+/* Run the program's main function and return its result, or 0 if
+ * ctx->unwind is set and a runtime error ended it (see ctx->status) */
+int execute(c0vm_ctx *ctx, struct bc0_file *bc0);
 
 
 #endif /* _C0VM_H_ */
@@ -3,31 +3,66 @@
  * Rob Simmons 
  */
 
-#include "c0vm_abort.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
 #include <signal.h>
+#include "c0vm.h"
+#include "c0vm_abort.h"
+
+/* For the args library: the arguments of the program running now, set
+ * by execute from ctx->argv, or by main in a program built with --aot */
+int c0_argc;
+char **c0_argv;
+
+static __thread struct c0vm_ctx *current = NULL;
+
+struct c0vm_ctx *c0vm_current(void) {
+  return current;
+}
+
+struct c0vm_ctx *c0vm_set_current(struct c0vm_ctx *ctx) {
+  struct c0vm_ctx *old = current;
+  current = ctx;
+  return old;
+}
+
+// Report the error, and unwind to execute if the context wants that
+static void fail(enum c0vm_status status, char *what, char *err) {
+  FILE *out = current != NULL ? current->err : stderr;
+  if (out != NULL) {
+    fprintf(out, "%s", what);
+    if (err != NULL) fprintf(out, ": %s\n", err);
+  }
+  if (current == NULL || !current->unwind) return;
+
+  free(current->message);
+  current->message = NULL;
+  if (err != NULL) {
+    current->message = malloc(strlen(err) + 1);
+    if (current->message != NULL) strcpy(current->message, err);
+  }
+  current->status = status;
+  longjmp(current->on_error, 1);
+}
 
 void c0_user_error(char *err) {
-  fprintf(stderr, "User error signaled in C0VM");
-  if (err != NULL) fprintf(stderr, ": %s\n", err);
+  fail(C0VM_USER_ERROR, "User error signaled in C0VM", err);
   exit(EXIT_FAILURE);
 }
 
 void c0_assertion_failure(char *err) {
-  fprintf(stderr, "Assertion failure detected in C0VM");
-  if (err != NULL) fprintf(stderr, ": %s\n", err);
+  fail(C0VM_ASSERTION_FAILURE, "Assertion failure detected in C0VM", err);
   raise(SIGABRT);
 }
 
 void c0_memory_error(char *err) {
-  fprintf(stderr, "Memory error detected in C0VM:");
-  if (err != NULL) fprintf(stderr, ": %s\n", err);
+  fail(C0VM_MEMORY_ERROR, "Memory error detected in C0VM:", err);
   raise(SIGSEGV);
 }
 
 void c0_arith_error(char *err) {
-  fprintf(stderr, "Division error detected in C0VM");
-  if (err != NULL) fprintf(stderr, ": %s\n", err);
+  fail(C0VM_ARITH_ERROR, "Division error detected in C0VM", err);
   raise(SIGFPE);
 }
@@ -3,7 +3,22 @@
  * Rob Simmons 
  */
 
+/* Each reports the error to the current context.  If that context
+ * unwinds on errors, execute returns; otherwise the process ends the
+ * way it always has. */
 void c0_user_error(char *err);        // for calls to error() in C0
 void c0_assertion_failure(char *err); // for failled assertions in C0
 void c0_memory_error(char *err);      // for memory-related errors
 void c0_arith_error(char *err);       // for arithmetic-related errors
+
+/* The arguments the args library sees; one copy for the whole process */
+extern int c0_argc;
+extern char **c0_argv;
+
+struct c0vm_ctx;
+
+/* The context executing on this thread, if any */
+struct c0vm_ctx *c0vm_current(void);
+
+/* Make ctx the current context, returning the one it replaces */
+struct c0vm_ctx *c0vm_set_current(struct c0vm_ctx *ctx);
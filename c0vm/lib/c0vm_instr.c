@@ -0,0 +1,74 @@
+/* C0VM instruction information
+ * 15-122 Principles of Imperative Computation
+ */
+
+#include <stddef.h>
+#include "c0vm.h"
+#include "c0vm_instr.h"
+
+struct instr_info {
+  const char *name;
+  size_t length;
+};
+
+/* Indexed by opcode; unlisted entries are invalid instructions */
+static const struct instr_info instr_table[256] = {
+  [IADD] = {"iadd", 1},
+  [IAND] = {"iand", 1},
+  [IDIV] = {"idiv", 1},
+  [IMUL] = {"imul", 1},
+  [IOR] = {"ior", 1},
+  [IREM] = {"irem", 1},
+  [ISHL] = {"ishl", 1},
+  [ISHR] = {"ishr", 1},
+  [ISUB] = {"isub", 1},
+  [IXOR] = {"ixor", 1},
+
+  [DUP] = {"dup", 1},
+  [POP] = {"pop", 1},
+  [SWAP] = {"swap", 1},
+
+  [NEWARRAY] = {"newarray", 2},
+  [ARRAYLENGTH] = {"arraylength", 1},
+  [NEW] = {"new", 2},
+
+  [AADDF] = {"aaddf", 2},
+  [AADDS] = {"aadds", 1},
+  [IMLOAD] = {"imload", 1},
+  [AMLOAD] = {"amload", 1},
+  [IMSTORE] = {"imstore", 1},
+  [AMSTORE] = {"amstore", 1},
+  [CMLOAD] = {"cmload", 1},
+  [CMSTORE] = {"cmstore", 1},
+
+  [VLOAD] = {"vload", 2},
+  [VSTORE] = {"vstore", 2},
+
+  [ACONST_NULL] = {"aconst_null", 1},
+  [BIPUSH] = {"bipush", 2},
+  [ILDC] = {"ildc", 3},
+  [ALDC] = {"aldc", 3},
+
+  [NOP] = {"nop", 1},
+  [IF_CMPEQ] = {"if_cmpeq", 3},
+  [IF_CMPNE] = {"if_cmpne", 3},
+  [IF_ICMPLT] = {"if_icmplt", 3},
+  [IF_ICMPGE] = {"if_icmpge", 3},
+  [IF_ICMPGT] = {"if_icmpgt", 3},
+  [IF_ICMPLE] = {"if_icmple", 3},
+  [GOTO] = {"goto", 3},
+  [ATHROW] = {"athrow", 1},
+  [ASSERT] = {"assert", 1},
+
+  [INVOKESTATIC] = {"invokestatic", 3},
+  [INVOKENATIVE] = {"invokenative", 3},
+  [RETURN] = {"return", 1},
+};
+
+size_t instr_length(ubyte opcode) {
+  return instr_table[opcode].length;
+}
+
+const char *instr_name(ubyte opcode) {
+  return instr_table[opcode].name;
+}
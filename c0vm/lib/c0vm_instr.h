@@ -0,0 +1,21 @@
+/* C0VM instruction information
+ * 15-122 Principles of Imperative Computation
+ *
+ * Static facts about each opcode, shared by everything in the VM
+ * that walks bytecode instead of executing it.
+ */
+
+#include <stddef.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_INSTR_H_
+#define _C0VM_INSTR_H_
+
+/* Total length of the instruction in bytes, including the opcode,
+ * or 0 if opcode is not a valid C0VM instruction */
+size_t instr_length(ubyte opcode);
+
+/* Lowercase mnemonic, as printed by cc0 -b, or NULL if invalid */
+const char *instr_name(ubyte opcode);
+
+#endif /* _C0VM_INSTR_H_ */
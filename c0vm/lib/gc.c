@@ -0,0 +1,757 @@
+/* C0VM garbage collected heap
+ * 15-122 Principles of Imperative Computation
+ *
+ * The heap is a set of chunks mapped straight from the kernel, so
+ * they start out zeroed.  Every object is preceded by an 8-byte
+ * header, and there are three kinds of chunk:
+ *
+ *  - Slabs hold cells of one size class, for small objects (most
+ *    structs, short arrays).  Dead cells go on the class's free list.
+ *  - Ordinary chunks are completely covered by larger objects and free
+ *    runs, one after the other.  A bitmap marks the granule of every
+ *    header, so that a pointer into the middle of an object (from AADDF
+ *    or AADDS) can be traced back to it.
+ *  - Objects too big for an ordinary chunk get a chunk of their own.
+ */
+
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS, clock_gettime */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "gc.h"
+#include "snapshot.h"
+
+#define GRANULE 8                  /* allocation unit and alignment */
+#define CHUNK_SIZE (1 << 20)       /* bytes in an ordinary chunk */
+#define LARGE_OBJECT (CHUNK_SIZE / 4)
+#define SLAB_SIZE (1 << 16)        /* bytes in a slab */
+#define SIZE_CLASSES 6
+#define SMALL_OBJECT 64            /* largest payload served from slabs */
+#define GC_MIN_TRIGGER (4 << 20)   /* bytes allocated between collections,
+                                      at least */
+
+struct gc_header {
+  uint32_t granules;   /* payload size */
+  uint8_t mark;
+  uint8_t free;        /* a free run, not an object */
+  uint8_t noscan;      /* holds no pointers (ints or chars) */
+  uint8_t unused;
+};
+
+struct chunk {
+  unsigned char *start;
+  unsigned char *end;  /* of the objects; the mapping may be longer */
+  size_t mapped;
+  size_t cell;         /* bytes per cell of a slab, 0 if not a slab */
+  uint64_t *starts;    /* bit per granule: a header starts there */
+  bool large;          /* holds one large object */
+};
+
+/* Payload granules of each size class */
+static const size_t class_granules[SIZE_CLASSES] = { 1, 2, 3, 4, 6, 8 };
+
+struct size_class {
+  struct chunk *slab;                /* being bumped through */
+  unsigned char *bump, *limit;
+  struct gc_header *free_list;       /* linked through the first word */
+};
+
+struct gc_heap {
+  struct chunk **chunks;             /* sorted by address */
+  uintptr_t lowest, highest;         /* bounds of every chunk there was */
+  size_t chunk_count, chunk_cap;
+
+  /* Free memory to bump through, and free runs to take it from next */
+  unsigned char *bump, *limit;
+  struct chunk *region;              /* chunk [bump, limit) is in */
+  struct gc_header **runs;
+  size_t run_count, run_next, run_cap;
+  struct size_class classes[SIZE_CLASSES];
+
+  struct gc_header **mark_stack;
+  size_t mark_count, mark_cap;
+
+  size_t heap_bytes;                 /* in all chunks */
+  size_t live_bytes;                 /* after the last collection */
+  size_t heap_after_gc;              /* heap_bytes after it */
+  size_t since_gc;                   /* bytes allocated since then */
+  size_t trigger;                    /* collect when since_gc reaches it */
+};
+
+/* Statistics, for $C0VM_GC_STATS: of the heaps on this thread since
+ * gc_stats_flush last added them into the totals of the process */
+struct gc_stats {
+  size_t collections;
+  size_t heap_after_gc, peak_heap_bytes, live_bytes;
+  uint64_t allocated_bytes, freed_bytes;
+  double total_pause, max_pause;     /* seconds */
+};
+static __thread struct gc_stats stats;
+static struct gc_stats stats_total;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_registered;
+
+static struct gc_header *header_at(unsigned char *p) {
+  return (struct gc_header*)p;
+}
+
+static unsigned char *payload(struct gc_header *h) {
+  return (unsigned char*)(h + 1);
+}
+
+static size_t object_bytes(struct gc_header *h) {
+  return sizeof(struct gc_header) + (size_t)h->granules * GRANULE;
+}
+
+/*** Chunks ***/
+
+static void set_start(struct chunk *c, unsigned char *p, bool on) {
+  size_t g = (size_t)(p - c->start) / GRANULE;
+  if (on) c->starts[g / 64] |= (uint64_t)1 << (g % 64);
+  else c->starts[g / 64] &= ~((uint64_t)1 << (g % 64));
+}
+
+// Write a header for granules of payload at p, which starts in c.
+static struct gc_header *put_header(struct chunk *c, unsigned char *p,
+                                    size_t granules, bool is_free) {
+  struct gc_header *h = header_at(p);
+  h->granules = (uint32_t)granules;
+  h->mark = 0;
+  h->free = is_free;
+  h->noscan = 0;
+  h->unused = 0;
+  set_start(c, p, true);
+  return h;
+}
+
+// Zeroed memory for a chunk, whole pages of it
+static unsigned char *map_chunk(size_t *bytes) {
+#ifdef MAP_ANONYMOUS
+  *bytes = (*bytes + 4095) & ~(size_t)4095;
+  void *p = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  return p;
+#else
+  return xcalloc(*bytes, 1);
+#endif
+}
+
+static void unmap_chunk(struct chunk *c) {
+#ifdef MAP_ANONYMOUS
+  munmap(c->start, c->mapped);
+#else
+  free(c->start);
+#endif
+}
+
+// Words in the bitmap of an ordinary chunk c
+static size_t bitmap_words(struct chunk *c) {
+  return ((size_t)(c->end - c->start) / GRANULE + 63) / 64;
+}
+
+static void add_chunk(struct gc_heap *gc, struct chunk *c) {
+  if (gc->chunk_count == gc->chunk_cap) {
+    gc->chunk_cap = gc->chunk_cap == 0 ? 16 : 2 * gc->chunk_cap;
+    gc->chunks = xrealloc(gc->chunks, gc->chunk_cap * sizeof(struct chunk*));
+  }
+
+  // Keep the chunks in address order for find_chunk
+  size_t i = gc->chunk_count;
+  while (i > 0 && gc->chunks[i - 1]->start > c->start) {
+    gc->chunks[i] = gc->chunks[i - 1];
+    i--;
+  }
+  gc->chunks[i] = c;
+  gc->chunk_count++;
+  if (gc->lowest == 0 || (uintptr_t)c->start < gc->lowest)
+    gc->lowest = (uintptr_t)c->start;
+  if ((uintptr_t)c->end > gc->highest) gc->highest = (uintptr_t)c->end;
+
+  gc->heap_bytes += c->mapped;
+  if (gc->heap_bytes > stats.peak_heap_bytes)
+    stats.peak_heap_bytes = gc->heap_bytes;
+}
+
+// A chunk with room for bytes of objects; slabs (cell > 0) need no
+// bitmap, since their headers are a fixed distance apart.
+static struct chunk *new_chunk(struct gc_heap *gc, size_t bytes, size_t cell,
+                               bool large) {
+  struct chunk *c = xmalloc(sizeof(struct chunk));
+  c->mapped = bytes;
+  c->start = map_chunk(&c->mapped);
+  c->cell = cell;
+  c->end = c->start + (cell > 0 ? bytes - bytes % cell : bytes);
+  c->starts = cell > 0 ? NULL : xcalloc(bitmap_words(c), sizeof(uint64_t));
+  c->large = large;
+  add_chunk(gc, c);
+  return c;
+}
+
+static struct chunk *find_chunk(struct gc_heap *gc, uintptr_t p) {
+  if (p < gc->lowest || p >= gc->highest) return NULL;  /* NULL, ints */
+  size_t lo = 0, hi = gc->chunk_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p < (uintptr_t)gc->chunks[mid]->start) hi = mid;
+    else if (p >= (uintptr_t)gc->chunks[mid]->end) lo = mid + 1;
+    else return gc->chunks[mid];
+  }
+  return NULL;
+}
+
+// The object p points into, NULL if it does not point into one.
+static struct gc_header *find_object(struct gc_heap *gc, uintptr_t p) {
+  struct chunk *c = find_chunk(gc, p);
+  if (c == NULL || p >= (uintptr_t)c->end) return NULL;
+
+  if (c->cell > 0) {
+    size_t i = (p - (uintptr_t)c->start) / c->cell;
+    struct gc_header *h = header_at(c->start + i * c->cell);
+    if (h->free || h->granules == 0) return NULL;  /* or never used */
+    return h;
+  }
+
+  // The nearest header at or before p
+  size_t g = (p - (uintptr_t)c->start) / GRANULE;
+  size_t w = g / 64;
+  uint64_t bits = c->starts[w] & (~(uint64_t)0 >> (63 - g % 64));
+  while (bits == 0) {
+    if (w == 0) return NULL;
+    bits = c->starts[--w];
+  }
+  size_t s = w * 64 + (63 - (size_t)__builtin_clzll(bits));
+
+  struct gc_header *h = header_at(c->start + s * GRANULE);
+  if (h->free || p >= (uintptr_t)h + object_bytes(h)) return NULL;
+  return h;
+}
+
+/*** Allocation ***/
+
+// Leave the rest of the current region as a free run, so the chunk can
+// be walked object by object again.
+static void retire_region(struct gc_heap *gc) {
+  if (gc->bump < gc->limit) {
+    size_t rest = (size_t)(gc->limit - gc->bump);
+    put_header(gc->region, gc->bump,
+               (rest - sizeof(struct gc_header)) / GRANULE, true);
+  }
+  gc->bump = gc->limit = NULL;
+  gc->region = NULL;
+}
+
+// Make [bump, limit) a region with room for bytes more.
+static void new_region(struct gc_heap *gc, size_t bytes) {
+  retire_region(gc);
+  while (gc->run_next < gc->run_count) {
+    struct gc_header *h = gc->runs[gc->run_next++];
+    if (object_bytes(h) >= bytes) {
+      gc->bump = (unsigned char*)h;
+      gc->limit = gc->bump + object_bytes(h);
+      gc->region = find_chunk(gc, (uintptr_t)h);
+      memset(gc->bump, 0, (size_t)(gc->limit - gc->bump));
+      return;
+    }
+  }
+  gc->region = new_chunk(gc, CHUNK_SIZE, 0, false);
+  gc->bump = gc->region->start;
+  gc->limit = gc->region->end;
+}
+
+// A cell of size class k, from its free list or else its slab
+static struct gc_header *allocate_small(struct gc_heap *gc, size_t k) {
+  struct size_class *sc = &gc->classes[k];
+  size_t granules = class_granules[k];
+  struct gc_header *h = sc->free_list;
+  if (h != NULL) {
+    sc->free_list = *(struct gc_header**)payload(h);
+    memset(payload(h), 0, granules * GRANULE);
+  } else {
+    size_t cell = sizeof(struct gc_header) + granules * GRANULE;
+    if (sc->bump == sc->limit) {
+      sc->slab = new_chunk(gc, SLAB_SIZE, cell, false);
+      sc->bump = sc->slab->start;
+      sc->limit = sc->slab->end;
+    }
+    h = header_at(sc->bump);
+    sc->bump += cell;
+  }
+  h->granules = (uint32_t)granules;
+  h->mark = 0;
+  h->free = 0;
+  h->unused = 0;
+  return h;
+}
+
+static struct gc_header *allocate(struct gc_heap *gc, size_t size,
+                                  bool noscan) {
+  size_t granules = (size + GRANULE - 1) / GRANULE;
+  if (granules == 0) granules = 1;
+  if (granules > UINT32_MAX) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  size_t bytes = sizeof(struct gc_header) + granules * GRANULE;
+
+  struct gc_header *h;
+  if (granules * GRANULE <= SMALL_OBJECT) {
+    size_t k = 0;
+    while (class_granules[k] < granules) k++;
+    h = allocate_small(gc, k);
+    bytes = sizeof(struct gc_header) + class_granules[k] * GRANULE;
+  } else if (bytes > LARGE_OBJECT) {
+    struct chunk *c = new_chunk(gc, bytes, 0, true);
+    h = put_header(c, c->start, granules, false);
+  } else {
+    // A region must not end less than a header from the object, or the
+    // rest could not be retired as a free run
+    if ((size_t)(gc->limit - gc->bump) < bytes) new_region(gc, bytes);
+    h = put_header(gc->region, gc->bump, granules, false);
+    gc->bump += bytes;
+  }
+  h->noscan = noscan;
+
+  gc->since_gc += bytes;
+  stats.allocated_bytes += bytes;
+  return h;
+}
+
+/*** Collection ***/
+
+static void push_mark(struct gc_heap *gc, struct gc_header *h) {
+  if (h->mark) return;
+  h->mark = 1;
+  if (h->noscan) return;
+  if (gc->mark_count == gc->mark_cap) {
+    gc->mark_cap = gc->mark_cap == 0 ? 256 : 2 * gc->mark_cap;
+    gc->mark_stack = xrealloc(gc->mark_stack,
+                             gc->mark_cap * sizeof(struct gc_header*));
+  }
+  gc->mark_stack[gc->mark_count++] = h;
+}
+
+static void mark_word(struct gc_heap *gc, uintptr_t p) {
+  struct gc_header *h = find_object(gc, p);
+  if (h != NULL) push_mark(gc, h);
+}
+
+static void mark(struct gc_heap *gc, c0_value *roots, c0_value *roots_end) {
+  for (c0_value *v = roots; v < roots_end; v++) {
+#ifdef C0VM_TAGGED
+    if ((*v >> 48) == 0) mark_word(gc, (uintptr_t)*v);
+#else
+    if (v->kind == C0_POINTER) mark_word(gc, (uintptr_t)v->payload.p);
+#endif
+  }
+
+  while (gc->mark_count > 0) {
+    struct gc_header *h = gc->mark_stack[--gc->mark_count];
+    uintptr_t *words = (uintptr_t*)payload(h);
+    for (size_t i = 0; i < h->granules * GRANULE / sizeof(uintptr_t); i++)
+      mark_word(gc, words[i]);
+  }
+}
+
+static void release_chunk(struct gc_heap *gc, size_t i) {
+  struct chunk *c = gc->chunks[i];
+  gc->heap_bytes -= c->mapped;
+  unmap_chunk(c);
+  free(c->starts);
+  free(c);
+  gc->chunk_count--;
+  for (size_t j = i; j < gc->chunk_count; j++)
+    gc->chunks[j] = gc->chunks[j + 1];
+}
+
+static void add_run(struct gc_heap *gc, struct gc_header *h) {
+  if (gc->run_count == gc->run_cap) {
+    gc->run_cap = gc->run_cap == 0 ? 256 : 2 * gc->run_cap;
+    gc->runs = xrealloc(gc->runs, gc->run_cap * sizeof(struct gc_header*));
+  }
+  gc->runs[gc->run_count++] = h;
+}
+
+// Put the unmarked cells of slab c on its class's free list, in
+// address order.  False if there were no marked ones.
+static bool sweep_slab(struct gc_heap *gc, struct chunk *c) {
+  size_t k = 0;
+  while (sizeof(struct gc_header) + class_granules[k] * GRANULE != c->cell)
+    k++;
+  struct gc_header *first = NULL, **last = &first;
+  bool empty = true;
+
+  for (unsigned char *p = c->start; p < c->end; p += c->cell) {
+    struct gc_header *h = header_at(p);
+    if (!h->free && h->mark) {
+      h->mark = 0;
+      gc->live_bytes += c->cell;
+      empty = false;
+    } else {
+      if (!h->free && h->granules > 0) stats.freed_bytes += c->cell;
+      h->granules = (uint32_t)class_granules[k];
+      h->free = 1;
+      h->noscan = 0;
+      *last = h;
+      last = (struct gc_header**)payload(h);
+    }
+  }
+
+  if (empty) return false;
+  *last = gc->classes[k].free_list;
+  gc->classes[k].free_list = first;
+  return true;
+}
+
+// Free every unmarked object, merging neighbours into free runs, and
+// give back the chunks left with nothing in them.
+static void sweep(struct gc_heap *gc) {
+  gc->run_count = 0;
+  gc->run_next = 0;
+  gc->live_bytes = 0;
+  for (size_t k = 0; k < SIZE_CLASSES; k++) {
+    gc->classes[k].slab = NULL;
+    gc->classes[k].bump = gc->classes[k].limit = NULL;
+    gc->classes[k].free_list = NULL;
+  }
+
+  size_t i = 0;
+  while (i < gc->chunk_count) {
+    struct chunk *c = gc->chunks[i];
+    if (c->cell > 0) {
+      if (sweep_slab(gc, c)) i++;
+      else release_chunk(gc, i);
+      continue;
+    }
+
+    struct gc_header *run = NULL;
+    bool empty = true;
+    size_t first_run = gc->run_count;
+
+    for (unsigned char *p = c->start; p < c->end; ) {
+      struct gc_header *h = header_at(p);
+      size_t bytes = object_bytes(h);
+      if (!h->free && h->mark) {
+        h->mark = 0;
+        gc->live_bytes += bytes;
+        empty = false;
+        run = NULL;
+      } else {
+        if (!h->free) stats.freed_bytes += bytes;
+        if (run == NULL) {
+          run = h;
+          h->free = 1;
+          h->noscan = 0;
+          add_run(gc, h);
+        } else {
+          run->granules += (uint32_t)(bytes / GRANULE);
+          set_start(c, p, false);
+        }
+      }
+      p += bytes;
+    }
+
+    if (empty) {
+      gc->run_count = first_run;
+      release_chunk(gc, i);
+    } else {
+      if (c->large) gc->run_count = first_run;  /* never allocated into */
+      i++;
+    }
+  }
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void collect(struct gc_heap *gc, c0_value *roots, c0_value *roots_end) {
+  double start = now();
+
+  retire_region(gc);
+  mark(gc, roots, roots_end);
+  sweep(gc);
+
+  gc->since_gc = 0;
+  gc->heap_after_gc = gc->heap_bytes;
+  gc->trigger = gc->live_bytes > GC_MIN_TRIGGER ? gc->live_bytes
+                                                : GC_MIN_TRIGGER;
+  stats.collections++;
+  stats.heap_after_gc = gc->heap_after_gc;
+  stats.live_bytes = gc->live_bytes;
+  double pause = now() - start;
+  stats.total_pause += pause;
+  if (pause > stats.max_pause) stats.max_pause = pause;
+}
+
+/*** Interface ***/
+
+static void add_stats(struct gc_stats *to, const struct gc_stats *s) {
+  if (s->collections > 0) {
+    to->heap_after_gc = s->heap_after_gc;
+    to->live_bytes = s->live_bytes;
+  }
+  to->collections += s->collections;
+  if (s->peak_heap_bytes > to->peak_heap_bytes)
+    to->peak_heap_bytes = s->peak_heap_bytes;
+  to->allocated_bytes += s->allocated_bytes;
+  to->freed_bytes += s->freed_bytes;
+  to->total_pause += s->total_pause;
+  if (s->max_pause > to->max_pause) to->max_pause = s->max_pause;
+}
+
+void gc_stats_flush(void) {
+  pthread_mutex_lock(&stats_lock);
+  add_stats(&stats_total, &stats);
+  pthread_mutex_unlock(&stats_lock);
+  memset(&stats, 0, sizeof(stats));
+}
+
+// Registered with atexit; the thread that ends the process may still
+// be in the middle of a run
+static void print_gc_stats(void) {
+  struct gc_stats all;
+  pthread_mutex_lock(&stats_lock);
+  all = stats_total;
+  pthread_mutex_unlock(&stats_lock);
+  add_stats(&all, &stats);
+  fprintf(stderr, "collections:     %zu\n", all.collections);
+  fprintf(stderr, "heap size:       %zu bytes after the last collection, "
+          "%zu at most\n", all.heap_after_gc, all.peak_heap_bytes);
+  fprintf(stderr, "live after gc:   %zu bytes\n", all.live_bytes);
+  fprintf(stderr, "allocated:       %" PRIu64 " bytes\n",
+          all.allocated_bytes);
+  fprintf(stderr, "freed:           %" PRIu64 " bytes\n", all.freed_bytes);
+  fprintf(stderr, "pause total/max: %.3f / %.3f ms\n",
+          all.total_pause * 1e3, all.max_pause * 1e3);
+}
+
+static void maybe_collect(struct gc_heap *gc, size_t size,
+                          c0_value *roots, c0_value *roots_end) {
+  if (gc->since_gc + size >= gc->trigger) collect(gc, roots, roots_end);
+}
+
+struct gc_heap *gc_heap_new(void) {
+  if (getenv("C0VM_GC_STATS") != NULL
+      && !__atomic_exchange_n(&stats_registered, true, __ATOMIC_RELAXED))
+    atexit(print_gc_stats);
+  struct gc_heap *gc = xcalloc(1, sizeof(struct gc_heap));
+  gc->trigger = GC_MIN_TRIGGER;
+  return gc;
+}
+
+void *gc_new(struct gc_heap *gc, size_t size,
+             c0_value *roots, c0_value *roots_end) {
+  maybe_collect(gc, size, roots, roots_end);
+  return payload(allocate(gc, size, false));
+}
+
+c0_array *gc_new_array(struct gc_heap *gc, int count, int elt_size,
+                       c0_value *roots, c0_value *roots_end) {
+  REQUIRES(count >= 0 && elt_size >= 0);
+  size_t size = (size_t)count * (size_t)elt_size;
+  maybe_collect(gc, sizeof(c0_array) + size, roots, roots_end);
+
+  // The elements follow the header, in the same object; its only
+  // pointer is to itself, so arrays of ints or chars need no scanning
+  c0_array *a = (c0_array*)payload(allocate(gc, sizeof(c0_array) + size,
+                                            elt_size < (int)sizeof(void*)));
+  a->count = count;
+  a->elt_size = elt_size;
+  a->elems = a + 1;
+  return a;
+}
+
+void gc_free_all(struct gc_heap *gc) {
+  while (gc->chunk_count > 0) release_chunk(gc, gc->chunk_count - 1);
+  gc->bump = gc->limit = NULL;
+  gc->region = NULL;
+  gc->run_count = gc->run_next = 0;
+  memset(gc->classes, 0, sizeof(gc->classes));
+  gc->since_gc = 0;
+}
+
+void gc_heap_free(struct gc_heap *gc) {
+  gc_free_all(gc);
+  free(gc->chunks);
+  free(gc->runs);
+  free(gc->mark_stack);
+  free(gc);
+}
+
+void gc_collect(struct gc_heap *gc, c0_value *roots, c0_value *roots_end) {
+  collect(gc, roots, roots_end);
+}
+
+static bool in_sorted(const uintptr_t *ptrs, size_t n, uintptr_t p) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p < ptrs[mid]) hi = mid;
+    else if (p > ptrs[mid]) lo = mid + 1;
+    else return true;
+  }
+  return false;
+}
+
+static bool object_refers_to(struct gc_header *h,
+                             const uintptr_t *ptrs, size_t n) {
+  if (h->noscan) return false;
+  uintptr_t *words = (uintptr_t*)payload(h);
+  for (size_t i = 0; i < h->granules * GRANULE / sizeof(uintptr_t); i++)
+    if (in_sorted(ptrs, n, words[i])) return true;
+  return false;
+}
+
+bool gc_refers_to(struct gc_heap *gc, const uintptr_t *ptrs, size_t n) {
+  if (n == 0) return false;
+  for (size_t i = 0; i < gc->chunk_count; i++) {
+    struct chunk *c = gc->chunks[i];
+    size_t step = c->cell;
+    for (unsigned char *p = c->start; p < c->end; p += step) {
+      struct gc_header *h = header_at(p);
+      if (c->cell == 0) step = object_bytes(h);
+      else if (h->granules == 0) break;  /* never used, nor the rest */
+      if (!h->free && object_refers_to(h, ptrs, n)) return true;
+    }
+  }
+  return false;
+}
+
+/*** Snapshots ***/
+
+static uint64_t chunk_index(struct gc_heap *gc, struct chunk *c) {
+  for (size_t i = 0; i < gc->chunk_count; i++)
+    if (gc->chunks[i] == c) return i;
+  return UINT64_MAX;
+}
+
+// Zero what is free, past the links of the free lists, so that it
+// takes no room in a snapshot
+static void clear_free(struct gc_heap *gc) {
+  for (size_t i = 0; i < gc->chunk_count; i++) {
+    struct chunk *c = gc->chunks[i];
+    size_t step = c->cell;
+    for (unsigned char *p = c->start; p < c->end; p += step) {
+      struct gc_header *h = header_at(p);
+      if (c->cell == 0) step = object_bytes(h);
+      else if (h->granules == 0) break;
+      if (h->free) {
+        size_t keep = c->cell > 0 ? sizeof(void*) : 0;
+        memset(payload(h) + keep, 0, h->granules * GRANULE - keep);
+      }
+    }
+  }
+}
+
+bool gc_save(struct gc_heap *gc, FILE *f) {
+  retire_region(gc);
+  clear_free(gc);
+
+  bool ok = snapshot_put_word(f, gc->chunk_count);
+  for (size_t i = 0; ok && i < gc->chunk_count; i++) {
+    struct chunk *c = gc->chunks[i];
+    ok = snapshot_put_word(f, (uintptr_t)c->start)
+      && snapshot_put_word(f, c->mapped)
+      && snapshot_put_word(f, (uint64_t)(c->end - c->start))
+      && snapshot_put_word(f, c->cell)
+      && snapshot_put_word(f, c->large)
+      && (c->cell > 0
+          || snapshot_put(f, c->starts, bitmap_words(c) * sizeof(uint64_t)))
+      && snapshot_put_pages(f, c->start, c->mapped);
+  }
+
+  ok = ok && snapshot_put_word(f, gc->run_count)
+    && snapshot_put_word(f, gc->run_next)
+    && snapshot_put(f, gc->runs, gc->run_count * sizeof(struct gc_header*));
+  for (size_t k = 0; ok && k < SIZE_CLASSES; k++) {
+    struct size_class *sc = &gc->classes[k];
+    ok = snapshot_put_word(f, sc->slab == NULL ? UINT64_MAX
+                                               : chunk_index(gc, sc->slab))
+      && snapshot_put_word(f, (uintptr_t)sc->bump)
+      && snapshot_put_word(f, (uintptr_t)sc->limit)
+      && snapshot_put_word(f, (uintptr_t)sc->free_list);
+  }
+  return ok && snapshot_put_word(f, gc->live_bytes)
+    && snapshot_put_word(f, gc->heap_after_gc)
+    && snapshot_put_word(f, gc->since_gc)
+    && snapshot_put_word(f, gc->trigger);
+}
+
+// Read a chunk of a snapshot into memory mapped where it was
+static bool restore_chunk(struct gc_heap *gc, FILE *f) {
+  uint64_t start, mapped, length, cell, large;
+  if (!snapshot_get_word(f, &start) || !snapshot_get_word(f, &mapped)
+      || !snapshot_get_word(f, &length) || !snapshot_get_word(f, &cell)
+      || !snapshot_get_word(f, &large) || length > mapped)
+    return false;
+  unsigned char *p = snapshot_map((uintptr_t)start, (size_t)mapped);
+  if (p == NULL) return false;
+
+  struct chunk *c = xmalloc(sizeof(struct chunk));
+  c->start = p;
+  c->end = p + length;
+  c->mapped = (size_t)mapped;
+  c->cell = (size_t)cell;
+  c->large = large != 0;
+  c->starts = cell > 0 ? NULL : xcalloc(bitmap_words(c), sizeof(uint64_t));
+  add_chunk(gc, c);
+  return (cell > 0
+          || snapshot_get(f, c->starts, bitmap_words(c) * sizeof(uint64_t)))
+    && snapshot_get_pages(f, c->start, c->mapped);
+}
+
+bool gc_restore(struct gc_heap *gc, FILE *f) {
+  REQUIRES(gc->chunk_count == 0);
+  uint64_t chunks, runs, run_next;
+  bool ok = snapshot_get_word(f, &chunks);
+  for (uint64_t i = 0; ok && i < chunks; i++)
+    ok = restore_chunk(gc, f);
+
+  ok = ok && snapshot_get_word(f, &runs) && snapshot_get_word(f, &run_next)
+    && run_next <= runs && runs <= SIZE_MAX / sizeof(struct gc_header*);
+  if (ok) {
+    gc->run_count = gc->run_cap = (size_t)runs;
+    gc->run_next = (size_t)run_next;
+    gc->runs = xrealloc(gc->runs, (runs + 1) * sizeof(struct gc_header*));
+    ok = snapshot_get(f, gc->runs, gc->run_count * sizeof(struct gc_header*));
+  }
+  for (size_t k = 0; ok && k < SIZE_CLASSES; k++) {
+    struct size_class *sc = &gc->classes[k];
+    uint64_t slab, bump, limit, free_list;
+    ok = snapshot_get_word(f, &slab) && snapshot_get_word(f, &bump)
+      && snapshot_get_word(f, &limit) && snapshot_get_word(f, &free_list)
+      && (slab == UINT64_MAX || slab < gc->chunk_count);
+    if (!ok) break;
+    sc->slab = slab == UINT64_MAX ? NULL : gc->chunks[slab];
+    sc->bump = (unsigned char*)(uintptr_t)bump;
+    sc->limit = (unsigned char*)(uintptr_t)limit;
+    sc->free_list = (struct gc_header*)(uintptr_t)free_list;
+  }
+  uint64_t live, after_gc, since_gc, trigger;
+  ok = ok && snapshot_get_word(f, &live) && snapshot_get_word(f, &after_gc)
+    && snapshot_get_word(f, &since_gc) && snapshot_get_word(f, &trigger);
+  if (!ok) {
+    gc_free_all(gc);
+    return false;
+  }
+  gc->live_bytes = (size_t)live;
+  gc->heap_after_gc = (size_t)after_gc;
+  gc->since_gc = (size_t)since_gc;
+  gc->trigger = (size_t)trigger;
+  return true;
+}
@@ -0,0 +1,71 @@
+/* C0VM garbage collected heap
+ * 15-122 Principles of Imperative Computation
+ *
+ * Memory for NEW and NEWARRAY.  Small objects are taken from a free
+ * list or a slab for their size class; others by bumping a pointer
+ * through a region of free memory.  When enough has been allocated
+ * since the last collection, the heap is marked from the values on the
+ * VM's stack and swept: dead cells go back on their free lists, and
+ * the free runs between larger live objects become the regions of
+ * later allocations.
+ *
+ * The stack is scanned precisely (every c0_value knows whether it is a
+ * pointer), but the bytecode does not say which fields of a struct
+ * hold pointers, so objects are scanned conservatively: any aligned
+ * word that points into a live object keeps it alive.  Objects are
+ * never moved.
+ *
+ * Every VM context has a heap of its own; a heap is only ever used by
+ * one thread at a time.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "c0vm.h"
+
+#ifndef _GC_H_
+#define _GC_H_
+
+struct gc_heap;
+
+/* A new, empty heap */
+struct gc_heap *gc_heap_new(void);
+
+/* Zeroed memory for a struct of size bytes (NEW).  May collect first,
+ * in which case the values in [roots, roots_end) are all that keeps
+ * objects alive. */
+void *gc_new(struct gc_heap *heap, size_t size,
+             c0_value *roots, c0_value *roots_end);
+
+/* A zeroed array of count elements of elt_size bytes (NEWARRAY), in
+ * one block: the elements follow the header */
+c0_array *gc_new_array(struct gc_heap *heap, int count, int elt_size,
+                       c0_value *roots, c0_value *roots_end);
+
+/* Collect now, with the values in [roots, roots_end) as the roots */
+void gc_collect(struct gc_heap *heap, c0_value *roots, c0_value *roots_end);
+
+/* Whether an object still in the heap holds one of the n pointers, in
+ * ascending order, in ptrs; meant for right after gc_collect, since
+ * dead objects count as well */
+bool gc_refers_to(struct gc_heap *heap, const uintptr_t *ptrs, size_t n);
+
+/* Write the heap to a snapshot (see snapshot.h), best right after
+ * gc_collect, or read it back into a heap with nothing in it.  On a
+ * failed restore the heap is left empty. */
+bool gc_save(struct gc_heap *heap, FILE *f);
+bool gc_restore(struct gc_heap *heap, FILE *f);
+
+/* Free every object in the heap, which stays usable */
+void gc_free_all(struct gc_heap *heap);
+
+/* Free the heap and everything in it */
+void gc_heap_free(struct gc_heap *heap);
+
+/* Add the statistics of this thread's heaps into those of the process
+ * that $C0VM_GC_STATS prints at exit; execute does this as it returns */
+void gc_stats_flush(void);
+
+#endif /* _GC_H_ */
@@ -0,0 +1,572 @@
+/* C0VM baseline JIT for x86-64 Linux
+ * 15-122 Principles of Imperative Computation
+ *
+ * Register use in the generated code (all caller-saved, so the code
+ * needs no prologue and never touches the C stack):
+ *   rdi   local variables of the call (V)
+ *   rsi   bottom of its operand window (base); the operand that is
+ *         number d from the bottom lives at base[d]
+ *   rdx   pc to start at, rcx table of entry points (only on entry)
+ *   rax, rcx, rdx   scratch
+ * The code returns the pc the interpreter should continue at in rax.
+ */
+
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "analyze.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+enum reg { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+
+/* Condition codes, as in the low nibble of 0x0F 0x8? */
+enum cc { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+          CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+/* Where the kind and payload of a c0_value are */
+#ifdef C0VM_TAGGED
+#define PAYLOAD 0
+#else
+#define KIND 0
+#define PAYLOAD offsetof(struct c0_value, payload)
+#endif
+
+/* A rel32 to fill in once every pc has its code */
+struct fixup {
+  size_t at;          /* offset of the rel32 */
+  size_t pc;          /* jump to the code for pc ... */
+  bool exit;          /* ... or to the stub that leaves at pc */
+};
+
+struct emitter {
+  ubyte *buf;
+  size_t len;
+  size_t cap;
+  struct fixup *fixups;
+  size_t nfixups;
+  size_t fixcap;
+};
+
+static void emit(struct emitter *E, ubyte b) {
+  if (E->len == E->cap) {
+    E->cap = E->cap == 0 ? 1024 : 2 * E->cap;
+    E->buf = xrealloc(E->buf, E->cap);
+  }
+  E->buf[E->len++] = b;
+}
+
+static void emit2(struct emitter *E, ubyte b1, ubyte b2) {
+  emit(E, b1);
+  emit(E, b2);
+}
+
+static void emit32(struct emitter *E, uint32_t x) {
+  for (int i = 0; i < 4; i++) emit(E, (ubyte)(x >> (8 * i)));
+}
+
+static void emit64(struct emitter *E, uint64_t x) {
+  emit32(E, (uint32_t)x);
+  emit32(E, (uint32_t)(x >> 32));
+}
+
+static void patch32(struct emitter *E, size_t at, uint32_t x) {
+  for (int i = 0; i < 4; i++) E->buf[at + i] = (ubyte)(x >> (8 * i));
+}
+
+/* ModRM for reg and [base + disp32] (base is never rsp, so no SIB) */
+static void mem(struct emitter *E, int reg, enum reg base, size_t disp) {
+  ASSERT(disp <= INT32_MAX);
+  emit(E, (ubyte)(0x80 | (reg << 3) | base));
+  emit32(E, (uint32_t)disp);
+}
+
+/* Leaves a rel32 for jit_compile to fill in */
+static void fixup(struct emitter *E, size_t pc, bool exit) {
+  if (E->nfixups == E->fixcap) {
+    E->fixcap = E->fixcap == 0 ? 64 : 2 * E->fixcap;
+    E->fixups = xrealloc(E->fixups, E->fixcap * sizeof(struct fixup));
+  }
+  E->fixups[E->nfixups].at = E->len;
+  E->fixups[E->nfixups].pc = pc;
+  E->fixups[E->nfixups].exit = exit;
+  E->nfixups++;
+  emit32(E, 0);
+}
+
+static void jmp_pc(struct emitter *E, size_t target) {
+  emit(E, 0xE9);
+  fixup(E, target, false);
+}
+
+static void jcc_pc(struct emitter *E, enum cc cc, size_t target) {
+  emit2(E, 0x0F, (ubyte)(0x80 | cc));
+  fixup(E, target, false);
+}
+
+/* Leave for the interpreter at pc if the condition holds */
+static void jcc_exit(struct emitter *E, enum cc cc, size_t pc) {
+  emit2(E, 0x0F, (ubyte)(0x80 | cc));
+  fixup(E, pc, true);
+}
+
+/* mov eax, pc; ret */
+static void leave_at(struct emitter *E, size_t pc) {
+  emit(E, 0xB8);
+  emit32(E, (uint32_t)pc);
+  emit(E, 0xC3);
+}
+
+/* Short forward jumps inside one template */
+static size_t jcc8(struct emitter *E, ubyte op) {
+  emit2(E, op, 0);
+  return E->len - 1;
+}
+
+static void here8(struct emitter *E, size_t at) {
+  ASSERT(E->len - (at + 1) < 128);
+  E->buf[at] = (ubyte)(E->len - (at + 1));
+}
+
+/*** Moving values between slots and registers ***/
+
+/* Every slot is written with whole 8-byte stores: a load that spans
+ * two smaller stores which are still in flight cannot be forwarded
+ * from them and stalls, which would cost more than dispatching. */
+
+static void load_int(struct emitter *E, enum reg r, enum reg base,
+                     size_t off) {
+  emit(E, 0x8B);                         /* mov r32, [base+off] */
+  mem(E, r, base, off + PAYLOAD);
+}
+
+static void load64(struct emitter *E, enum reg r, enum reg base,
+                   size_t off) {
+  emit2(E, 0x48, 0x8B);                  /* mov r64, [base+off] */
+  mem(E, r, base, off);
+}
+
+static void store64(struct emitter *E, enum reg base, size_t off,
+                    enum reg r) {
+  emit2(E, 0x48, 0x89);                  /* mov [base+off], r64 */
+  mem(E, r, base, off);
+}
+
+static void load_ptr(struct emitter *E, enum reg r, enum reg base,
+                     size_t off) {
+  load64(E, r, base, off + PAYLOAD);
+}
+
+#ifndef C0VM_TAGGED
+static void store_kind(struct emitter *E, enum reg base, size_t off,
+                       enum c0_val_kind kind) {
+  emit2(E, 0x48, 0xC7);                  /* mov qword [base+off], kind */
+  mem(E, 0, base, off + KIND);
+  emit32(E, kind);
+}
+#endif
+
+/* r holds an int, zero-extended, as every 32-bit operation leaves it */
+static void store_int(struct emitter *E, enum reg base, size_t off,
+                      enum reg r) {
+#ifdef C0VM_TAGGED
+  emit2(E, 0x48, 0x0F);                  /* bts r64, 48 */
+  emit2(E, 0xBA, (ubyte)(0xE8 | r));
+  emit(E, 48);
+#else
+  store_kind(E, base, off, C0_INTEGER);
+#endif
+  store64(E, base, off + PAYLOAD, r);
+}
+
+static void store_ptr(struct emitter *E, enum reg base, size_t off,
+                      enum reg r) {
+#ifndef C0VM_TAGGED
+  store_kind(E, base, off, C0_POINTER);
+#endif
+  store64(E, base, off + PAYLOAD, r);
+}
+
+static void store_const(struct emitter *E, enum reg base, size_t off,
+                        int32_t x) {
+  emit(E, (ubyte)(0xB8 | RAX));          /* mov eax, x */
+  emit32(E, (uint32_t)x);
+  store_int(E, base, off, RAX);
+}
+
+/* Whole values, one 8-byte word at a time */
+static void copy_val(struct emitter *E, enum reg dbase, size_t doff,
+                     enum reg sbase, size_t soff) {
+  for (size_t w = 0; w < sizeof(c0_value); w += 8) {
+    load64(E, RAX, sbase, soff + w);
+    store64(E, dbase, doff + w, RAX);
+  }
+}
+
+static void swap_vals(struct emitter *E, enum reg base, size_t x,
+                      size_t y) {
+  for (size_t w = 0; w < sizeof(c0_value); w += 8) {
+    load64(E, RAX, base, x + w);
+    load64(E, RCX, base, y + w);
+    store64(E, base, x + w, RCX);
+    store64(E, base, y + w, RAX);
+  }
+}
+
+/* Leave at pc if rax, a pointer, is NULL */
+static void null_check(struct emitter *E, size_t pc) {
+  emit(E, 0x48); emit2(E, 0x85, 0xC0);   /* test rax, rax */
+  jcc_exit(E, CC_E, pc);
+}
+
+/*** Templates ***/
+
+static size_t branch_target(ubyte *P, size_t pc) {
+  return pc + (int16_t)((P[pc + 1] << 8) | P[pc + 2]);
+}
+
+/* Sets the flags so that E/NE say whether operands x and y are equal,
+ * like val_equal */
+static void compare_vals(struct emitter *E, size_t x, size_t y) {
+#ifdef C0VM_TAGGED
+  load_ptr(E, RAX, RSI, x);
+  emit2(E, 0x48, 0x3B);                  /* cmp rax, [rsi+y] */
+  mem(E, RAX, RSI, y);
+#else
+  emit(E, 0x8B); mem(E, RAX, RSI, x + KIND);
+  emit(E, 0x3B); mem(E, RAX, RSI, y + KIND);       /* cmp eax, kind */
+  size_t differ = jcc8(E, 0x75);                   /* jne */
+  emit2(E, 0x85, 0xC0);                            /* test eax, eax */
+  size_t ptrs = jcc8(E, 0x75);                     /* jnz */
+  emit(E, 0x8B); mem(E, RCX, RSI, x + PAYLOAD);
+  emit(E, 0x3B); mem(E, RCX, RSI, y + PAYLOAD);    /* cmp ecx, int */
+  size_t done = jcc8(E, 0xEB);                     /* jmp */
+  here8(E, ptrs);
+  emit2(E, 0x48, 0x8B); mem(E, RCX, RSI, x + PAYLOAD);
+  emit2(E, 0x48, 0x3B); mem(E, RCX, RSI, y + PAYLOAD);  /* cmp rcx, ptr */
+  here8(E, done);
+  here8(E, differ);                      /* kinds differ: flags say NE */
+#endif
+}
+
+/* Emits the code for the instruction at pc, with d operands on the
+ * stack before it.  Returns false, having emitted nothing, if the
+ * instruction has to be left to the interpreter. */
+static bool translate(struct emitter *E, struct bc0_file *bc0,
+                      struct function_info *fi, size_t pc, size_t d) {
+  ubyte *P = fi->code;
+  ubyte op = P[pc];
+  bool proven = (fi->pcinfo[pc] & PC_PROVEN) != 0;
+  size_t sz = sizeof(c0_value);
+  size_t top = (d - 1) * sz;             /* offsets of the top operand */
+  size_t below = (d - 2) * sz;           /* and of the one below it */
+  size_t push = d * sz;                  /* and of the one pushed next */
+
+  switch (op) {
+  case NOP:
+  case POP:
+    return true;
+
+  case DUP:
+    copy_val(E, RSI, push, RSI, top);
+    return true;
+
+  case SWAP:
+    swap_vals(E, RSI, below, top);
+    return true;
+
+  case VLOAD:
+    copy_val(E, RSI, push, RDI, P[pc + 1] * sz);
+    return true;
+
+  case VSTORE:
+    copy_val(E, RDI, P[pc + 1] * sz, RSI, top);
+    return true;
+
+  case BIPUSH:
+    store_const(E, RSI, push, (byte)P[pc + 1]);
+    return true;
+
+  case ILDC:
+    store_const(E, RSI, push, bc0->int_pool[(P[pc + 1] << 8) | P[pc + 2]]);
+    return true;
+
+  case ALDC:
+    emit2(E, 0x48, 0xB8);                /* mov rax, imm64 */
+    emit64(E, (uintptr_t)&bc0->strings[(P[pc + 1] << 8) | P[pc + 2]]);
+    emit2(E, 0x48, 0x8B); mem(E, RAX, RAX, 0);  /* of this run's arena */
+    store_ptr(E, RSI, push, RAX);
+    return true;
+
+  case ACONST_NULL:
+    emit2(E, 0x31, 0xC0);                /* xor eax, eax */
+    store_ptr(E, RSI, push, RAX);
+    return true;
+
+  case GOTO:
+    jmp_pc(E, branch_target(P, pc));
+    return true;
+
+  case IF_CMPEQ:
+  case IF_CMPNE:
+    compare_vals(E, below, top);
+    jcc_pc(E, op == IF_CMPEQ ? CC_E : CC_NE, branch_target(P, pc));
+    return true;
+
+  default:
+    break;
+  }
+
+  /* Everything else checks the kinds of its operands in the
+   * interpreter, so only compile it where they are proven */
+  if (!proven) return false;
+
+  switch (op) {
+  case IADD: case ISUB: case IMUL: case IAND: case IOR: case IXOR:
+    load_int(E, RAX, RSI, below);
+    load_int(E, RCX, RSI, top);
+    switch (op) {
+    case IADD: emit2(E, 0x01, 0xC8); break;         /* add eax, ecx */
+    case ISUB: emit2(E, 0x29, 0xC8); break;         /* sub eax, ecx */
+    case IMUL: emit(E, 0x0F); emit2(E, 0xAF, 0xC1); break;  /* imul */
+    case IAND: emit2(E, 0x21, 0xC8); break;         /* and eax, ecx */
+    case IOR:  emit2(E, 0x09, 0xC8); break;         /* or eax, ecx */
+    default:   emit2(E, 0x31, 0xC8); break;         /* xor eax, ecx */
+    }
+    store_int(E, RSI, below, RAX);
+    return true;
+
+  case IDIV:
+  case IREM: {
+    load_int(E, RAX, RSI, below);
+    load_int(E, RCX, RSI, top);
+    emit2(E, 0x85, 0xC9);                /* test ecx, ecx */
+    jcc_exit(E, CC_E, pc);
+    emit(E, 0x83); emit2(E, 0xF9, 0xFF); /* cmp ecx, -1 */
+    size_t ok = jcc8(E, 0x75);           /* jne */
+    emit(E, 0x3D); emit32(E, 0x80000000u);  /* cmp eax, INT32_MIN */
+    jcc_exit(E, CC_E, pc);
+    here8(E, ok);
+    emit(E, 0x99);                       /* cdq */
+    emit2(E, 0xF7, 0xF9);                /* idiv ecx */
+    store_int(E, RSI, below, op == IDIV ? RAX : RDX);
+    return true;
+  }
+
+  case ISHL:
+  case ISHR:
+    load_int(E, RCX, RSI, top);
+    emit(E, 0x83); emit2(E, 0xF9, 31);   /* cmp ecx, 31 */
+    jcc_exit(E, CC_A, pc);               /* unsigned, so y < 0 too */
+    load_int(E, RAX, RSI, below);
+    emit2(E, 0xD3, op == ISHL ? 0xE0 : 0xF8);  /* shl/sar eax, cl */
+    store_int(E, RSI, below, RAX);
+    return true;
+
+  case IF_ICMPLT: case IF_ICMPGE: case IF_ICMPGT: case IF_ICMPLE: {
+    load_int(E, RAX, RSI, below);
+    load_int(E, RCX, RSI, top);
+    emit2(E, 0x39, 0xC8);                /* cmp eax, ecx */
+    enum cc cc = op == IF_ICMPLT ? CC_L : op == IF_ICMPGE ? CC_GE
+               : op == IF_ICMPGT ? CC_G : CC_LE;
+    jcc_pc(E, cc, branch_target(P, pc));
+    return true;
+  }
+
+  case ASSERT:
+    load_int(E, RAX, RSI, below);
+    emit2(E, 0x85, 0xC0);                /* test eax, eax */
+    jcc_exit(E, CC_E, pc);
+    return true;
+
+  case ARRAYLENGTH:
+    load_ptr(E, RAX, RSI, top);
+    null_check(E, pc);
+    emit(E, 0x8B); mem(E, RAX, RAX, offsetof(c0_array, count));
+    store_int(E, RSI, top, RAX);
+    return true;
+
+  case AADDF:
+    load_ptr(E, RAX, RSI, top);
+    null_check(E, pc);
+    emit2(E, 0x48, 0x05); emit32(E, P[pc + 1]);     /* add rax, f */
+    store_ptr(E, RSI, top, RAX);
+    return true;
+
+  case AADDS:
+    load_int(E, RCX, RSI, top);
+    load_ptr(E, RAX, RSI, below);
+    null_check(E, pc);
+    emit(E, 0x3B); mem(E, RCX, RAX, offsetof(c0_array, count));
+    jcc_exit(E, CC_AE, pc);              /* unsigned, so index < 0 too */
+    emit(E, 0x48); emit2(E, 0x63, 0xC9); /* movsxd rcx, ecx */
+    emit2(E, 0x48, 0x63);                /* movsxd rdx, elt_size */
+    mem(E, RDX, RAX, offsetof(c0_array, elt_size));
+    emit2(E, 0x48, 0x0F); emit2(E, 0xAF, 0xCA);     /* imul rcx, rdx */
+    emit2(E, 0x48, 0x03);                /* add rcx, elems */
+    mem(E, RCX, RAX, offsetof(c0_array, elems));
+    store_ptr(E, RSI, below, RCX);
+    return true;
+
+  case IMLOAD:
+  case CMLOAD:
+  case AMLOAD:
+    load_ptr(E, RAX, RSI, top);
+    null_check(E, pc);
+    if (op == IMLOAD) {
+      emit2(E, 0x8B, 0x00);              /* mov eax, [rax] */
+      store_int(E, RSI, top, RAX);
+    } else if (op == CMLOAD) {
+      emit(E, 0x0F); emit2(E, 0xBE, 0x00);  /* movsx eax, byte [rax] */
+      store_int(E, RSI, top, RAX);
+    } else {
+      emit(E, 0x48); emit2(E, 0x8B, 0x00);  /* mov rax, [rax] */
+      store_ptr(E, RSI, top, RAX);
+    }
+    return true;
+
+  case IMSTORE:
+  case CMSTORE:
+  case AMSTORE:
+    if (op == AMSTORE) load_ptr(E, RCX, RSI, top);
+    else load_int(E, RCX, RSI, top);
+    load_ptr(E, RAX, RSI, below);
+    null_check(E, pc);
+    if (op == IMSTORE) {
+      emit2(E, 0x89, 0x08);              /* mov [rax], ecx */
+    } else if (op == CMSTORE) {
+      emit(E, 0x83); emit2(E, 0xE1, 0x7F);  /* and ecx, 0x7f */
+      emit2(E, 0x88, 0x08);              /* mov [rax], cl */
+    } else {
+      emit(E, 0x48); emit2(E, 0x89, 0x08);  /* mov [rax], rcx */
+    }
+    return true;
+
+  default:
+    /* Calls, returns, allocation and errors */
+    return false;
+  }
+}
+
+struct jit_code *jit_compile(struct bc0_file *bc0, size_t fn) {
+  REQUIRES(bc0 != NULL && fn < bc0->function_count);
+  struct function_info *fi = &bc0->function_pool[fn];
+  size_t n = fi->code_length;
+  int *depths = operand_depths(bc0, fn);
+  bool *native = xcalloc(n, sizeof(bool));
+  size_t *label = xcalloc(n, sizeof(size_t));
+  size_t *exits = xcalloc(n, sizeof(size_t));  /* 0 for none yet */
+  struct emitter E = { NULL, 0, 0, NULL, 0, 0 };
+  size_t compiled = 0;
+
+  // Entry: jmp [rcx + rdx*8]
+  emit(&E, 0xFF); emit2(&E, 0x24, 0xD1);
+
+  for (size_t pc = 0; pc < n; pc++) {
+    if (depths[pc] < 0) continue;
+    label[pc] = E.len;
+    if (translate(&E, bc0, fi, pc, (size_t)depths[pc])) {
+      native[pc] = true;
+      compiled++;
+    } else {
+      leave_at(&E, pc);
+      exits[pc] = label[pc];
+    }
+  }
+
+  if (compiled == 0) {
+    free(depths);
+    free(native);
+    free(label);
+    free(exits);
+    free(E.buf);
+    free(E.fixups);
+    return NULL;
+  }
+
+  // Stubs that leave at a pc after a failed check, then the jumps
+  for (size_t i = 0; i < E.nfixups; i++) {
+    struct fixup *f = &E.fixups[i];
+    size_t to;
+    if (!f->exit) {
+      to = label[f->pc];
+    } else {
+      if (exits[f->pc] == 0) {
+        exits[f->pc] = E.len;
+        leave_at(&E, f->pc);
+      }
+      to = exits[f->pc];
+    }
+    patch32(&E, f->at, (uint32_t)(int32_t)((long)to - (long)(f->at + 4)));
+  }
+
+  struct jit_code *J = xmalloc(sizeof(struct jit_code));
+  J->size = E.len;
+  J->code = mmap(NULL, J->size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (J->code == MAP_FAILED) {
+    // No executable memory: just keep interpreting
+    free(J);
+    J = NULL;
+  } else {
+    memcpy(J->code, E.buf, E.len);
+    if (mprotect(J->code, J->size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(J->code, J->size);
+      free(J);
+      J = NULL;
+    }
+  }
+
+  if (J != NULL) {
+    J->entry = xcalloc(n, sizeof(void*));
+    for (size_t pc = 0; pc < n; pc++)
+      if (native[pc]) J->entry[pc] = (ubyte*)J->code + label[pc];
+    // ISO C has no conversion from data to function pointers
+    memcpy(&J->run, &J->code, sizeof(J->run));
+    J->native = native;
+    J->depths = depths;
+    J->interp = xcalloc(n, sizeof(void*));
+    memcpy(J->interp, fi->dispatch, n * sizeof(void*));
+  } else {
+    free(native);
+    free(depths);
+  }
+
+  free(label);
+  free(exits);
+  free(E.buf);
+  free(E.fixups);
+  return J;
+}
+
+void jit_free(struct jit_code *J) {
+  if (J == NULL) return;
+  munmap(J->code, J->size);
+  free(J->entry);
+  free(J->native);
+  free(J->depths);
+  free(J->interp);
+  free(J);
+}
+
+#else /* not x86-64 Linux */
+
+struct jit_code *jit_compile(struct bc0_file *bc0, size_t fn) {
+  REQUIRES(bc0 != NULL && fn < bc0->function_count);
+  return NULL;
+}
+
+void jit_free(struct jit_code *J) {
+  ASSERT(J == NULL);
+}
+
+#endif
@@ -0,0 +1,41 @@
+/* C0VM baseline JIT for x86-64 Linux
+ * 15-122 Principles of Imperative Computation
+ *
+ * Compiles a function by stitching together a machine code template
+ * for each instruction.  The code works directly on the function's
+ * window of the value stack (locals and operand slots in memory, at
+ * offsets known from the analysis), so it can be entered at any
+ * instruction and can leave at any instruction: whenever it reaches
+ * something it has no template for (calls, returns, allocation), or an
+ * error the interpreter has to report, it returns the pc to the
+ * interpreter, which carries on from there with the same stack.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "c0vm.h"
+
+#ifndef _JIT_H_
+#define _JIT_H_
+
+/* Runs the compiled code from pc until it leaves; returns the pc the
+ * interpreter continues at */
+typedef size_t jit_fn(c0_value *V, c0_value *base, size_t pc, void **entry);
+
+struct jit_code {
+  jit_fn *run;
+  void **entry;     /* machine code address for each pc */
+  bool *native;     /* pc has a template (otherwise it leaves at once) */
+  int *depths;      /* operands on the stack before each pc */
+  void **interp;    /* the interpreter's own handlers for each pc */
+  void *code;       /* executable mapping */
+  size_t size;
+};
+
+/* NULL if nothing in the function can be compiled, or if this is not
+ * a machine the JIT supports */
+struct jit_code *jit_compile(struct bc0_file *bc0, size_t fn);
+
+void jit_free(struct jit_code *J);
+
+#endif /* _JIT_H_ */
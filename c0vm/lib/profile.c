@@ -0,0 +1,406 @@
+/* C0VM profiler
+ * 15-122 Principles of Imperative Computation
+ *
+ * Every instruction is charged the cycles from its own start to the
+ * start of the next one, so an invokenative is charged the time spent
+ * in the native.  Calls and returns are noticed from the instruction
+ * that ran before, which keeps the interpreter's side to one call.
+ */
+
+#define _POSIX_C_SOURCE 199309L  /* clock_gettime */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_instr.h"
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ticks(void) { return __rdtsc(); }
+#define TICKS "cycles"
+#else
+#include <time.h>
+static inline uint64_t ticks(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+#define TICKS "ns"
+#endif
+
+/* Deeper calls are charged to the call stack PROFILE_MAX_DEPTH deep,
+ * so that deep recursion does not make the folded file quadratic */
+#define PROFILE_MAX_DEPTH 256
+
+/* A node of the calling context tree: one for every distinct stack of
+ * calls, natives being leaves.  Nodes refer to each other by index. */
+struct node {
+  long id;            /* function index, or -1 - native pool index */
+  size_t parent;
+  size_t child;       /* first child, 0 for none (0 is the root) */
+  size_t sibling;     /* next child of parent, 0 for none */
+  uint64_t calls;
+  uint64_t cycles;    /* not counting children */
+};
+
+/* Names read from the .bc0 comments */
+struct names {
+  char **name;
+  size_t count;
+};
+
+static struct {
+  char *prefix;       /* NULL if not profiling */
+  char *filename;
+  bool started;
+  struct names functions, natives;
+
+  /* Kept from the program, which is freed before the reports are
+   * written */
+  size_t function_count, native_count;
+  uint16_t *native_index;   /* function_table_index of each native */
+
+  uint64_t op_count[256], op_cycles[256];
+  uint64_t *fn_calls, *fn_instrs, *fn_cycles;      /* by function */
+  uint64_t *native_calls, *native_cycles;          /* by native pool index */
+
+  struct node *nodes;
+  size_t node_count, node_cap;
+  size_t current;     /* node of the running function */
+  size_t depth;       /* calls below main */
+  size_t overflow;    /* calls beyond PROFILE_MAX_DEPTH */
+
+  /* What ran last, and still has to be charged */
+  int last_op;        /* -1 before the first instruction */
+  size_t last_fn;
+  size_t last_node;
+  long last_native;   /* native pool index, or -1 */
+  uint64_t last_tick;
+} prof;
+
+void profile_enable(const char *prefix, const char *filename) {
+  REQUIRES(prefix != NULL && filename != NULL);
+  prof.prefix = xmalloc(strlen(prefix) + 1);
+  strcpy(prof.prefix, prefix);
+  prof.filename = xmalloc(strlen(filename) + 1);
+  strcpy(prof.filename, filename);
+}
+
+/*** Names ***/
+
+static void add_name(struct names *N, const char *s, size_t len) {
+  N->name = xrealloc(N->name, (N->count + 1) * sizeof(char*));
+  N->name[N->count] = xcalloc(len + 1, 1);
+  memcpy(N->name[N->count], s, len);
+  N->count++;
+}
+
+// cc0 writes "#<name>" above every function and "... # name" after
+// every entry of the native pool. Images and hand-written files may
+// have neither, and then functions are only known by number.
+static void read_names(void) {
+  FILE *f = fopen(prof.filename, "r");
+  if (f == NULL) return;
+
+  enum { OTHER, FUNCTIONS, NATIVES } section = OTHER;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "# function_pool", 15) == 0) {
+      section = FUNCTIONS;
+    } else if (strncmp(line, "# native pool", 13) == 0) {
+      section = NATIVES;
+    } else if (section == FUNCTIONS && strncmp(line, "#<", 2) == 0) {
+      add_name(&prof.functions, line + 2, strcspn(line + 2, ">\n"));
+    } else if (section == NATIVES && line[0] != '#'
+               && strchr(line, '#') != NULL) {
+      char *s = strchr(line, '#') + 1;
+      s += strspn(s, " \t");
+      add_name(&prof.natives, s, strcspn(s, " \t\r\n"));
+    }
+  }
+  fclose(f);
+}
+
+static const char *function_name(size_t i, char buf[32]) {
+  if (prof.functions.count == prof.function_count)
+    return prof.functions.name[i];
+  sprintf(buf, "function%zu", i);
+  return buf;
+}
+
+static const char *native_name(size_t i, char buf[32]) {
+  if (prof.natives.count == prof.native_count)
+    return prof.natives.name[i];
+  sprintf(buf, "native%u", prof.native_index[i]);
+  return buf;
+}
+
+/*** Calling context tree ***/
+
+static size_t new_node(long id, size_t parent) {
+  if (prof.node_count == prof.node_cap) {
+    prof.node_cap = prof.node_cap == 0 ? 256 : 2 * prof.node_cap;
+    prof.nodes = xrealloc(prof.nodes, prof.node_cap * sizeof(struct node));
+  }
+  struct node *n = &prof.nodes[prof.node_count];
+  n->id = id;
+  n->parent = parent;
+  n->child = 0;
+  n->sibling = 0;
+  n->calls = 0;
+  n->cycles = 0;
+  if (prof.node_count > 0) {
+    n->sibling = prof.nodes[parent].child;
+    prof.nodes[parent].child = prof.node_count;
+  }
+  return prof.node_count++;
+}
+
+static size_t child(size_t parent, long id) {
+  for (size_t c = prof.nodes[parent].child; c != 0; c = prof.nodes[c].sibling)
+    if (prof.nodes[c].id == id) return c;
+  return new_node(id, parent);
+}
+
+/*** Counting ***/
+
+// Charge the cycles since the last instruction started to it.
+static void charge(uint64_t now) {
+  uint64_t d = now - prof.last_tick;
+  prof.last_tick = now;
+  if (prof.last_op < 0) return;
+
+  prof.op_cycles[prof.last_op] += d;
+  prof.nodes[prof.last_node].cycles += d;
+  if (prof.last_native >= 0)
+    prof.native_cycles[prof.last_native] += d;
+  else
+    prof.fn_cycles[prof.last_fn] += d;
+}
+
+void profile_instr(size_t fn, ubyte *P, size_t pc) {
+  charge(ticks());
+
+  // Follow the call the last instruction made or returned from
+  if (prof.last_op == INVOKESTATIC) {
+    prof.fn_calls[fn]++;
+    if (prof.depth++ < PROFILE_MAX_DEPTH)
+      prof.current = child(prof.current, (long)fn);
+    else
+      prof.overflow++;
+    prof.nodes[prof.current].calls++;
+  } else if (prof.last_op == RETURN) {
+    prof.depth--;
+    if (prof.overflow > 0) prof.overflow--;
+    else prof.current = prof.nodes[prof.current].parent;
+  }
+
+  ubyte op = P[pc];
+  prof.op_count[op]++;
+  prof.fn_instrs[fn]++;
+  prof.last_op = op;
+  prof.last_fn = fn;
+  prof.last_node = prof.current;
+  prof.last_native = -1;
+  if (op == INVOKENATIVE) {
+    size_t n = (P[pc + 1] << 8) | P[pc + 2];
+    prof.native_calls[n]++;
+    prof.last_native = (long)n;
+    prof.last_node = child(prof.current, -1 - (long)n);
+    prof.nodes[prof.last_node].calls++;
+  }
+}
+
+/*** Reports ***/
+
+static const uint64_t *sort_key;
+
+static int by_key_desc(const void *a, const void *b) {
+  uint64_t x = sort_key[*(const size_t*)a];
+  uint64_t y = sort_key[*(const size_t*)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Indices 0..n-1 in decreasing order of key.
+static size_t *sorted(const uint64_t *key, size_t n) {
+  size_t *order = xcalloc(n == 0 ? 1 : n, sizeof(size_t));
+  for (size_t i = 0; i < n; i++) order[i] = i;
+  sort_key = key;
+  qsort(order, n, sizeof(size_t), by_key_desc);
+  return order;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : 100.0 * (double)part / (double)whole;
+}
+
+static FILE *open_output(const char *suffix) {
+  char *name = xmalloc(strlen(prof.prefix) + strlen(suffix) + 1);
+  strcpy(name, prof.prefix);
+  strcat(name, suffix);
+  FILE *f = fopen(name, "w");
+  if (f == NULL) perror(name);
+  free(name);
+  return f;
+}
+
+static void write_report(FILE *f) {
+  char buf[32], buf2[32];
+  uint64_t total = 0, instrs = 0;
+  for (size_t op = 0; op < 256; op++) {
+    total += prof.op_cycles[op];
+    instrs += prof.op_count[op];
+  }
+  fprintf(f, "%" PRIu64 " instructions, %" PRIu64 " " TICKS "\n",
+          instrs, total);
+
+  fprintf(f, "\n%-24s %14s %16s %7s %10s\n", "opcode", "executed",
+          TICKS, "%", "per instr");
+  size_t *order = sorted(prof.op_cycles, 256);
+  for (size_t i = 0; i < 256; i++) {
+    size_t op = order[i];
+    if (prof.op_count[op] == 0) continue;
+    fprintf(f, "%-24s %14" PRIu64 " %16" PRIu64 " %6.2f%% %10.1f\n",
+            instr_name((ubyte)op), prof.op_count[op], prof.op_cycles[op],
+            percent(prof.op_cycles[op], total),
+            (double)prof.op_cycles[op] / (double)prof.op_count[op]);
+  }
+  free(order);
+
+  fprintf(f, "\n%-24s %14s %16s %7s %14s\n", "function", "calls",
+          "self " TICKS, "%", "instructions");
+  order = sorted(prof.fn_cycles, prof.function_count);
+  for (size_t i = 0; i < prof.function_count; i++) {
+    size_t fn = order[i];
+    if (prof.fn_instrs[fn] == 0) continue;
+    fprintf(f, "%-24s %14" PRIu64 " %16" PRIu64 " %6.2f%% %14" PRIu64 "\n",
+            function_name(fn, buf), prof.fn_calls[fn], prof.fn_cycles[fn],
+            percent(prof.fn_cycles[fn], total), prof.fn_instrs[fn]);
+  }
+  free(order);
+
+  fprintf(f, "\n%-24s %14s %16s %7s %10s\n", "native", "calls",
+          TICKS, "%", "per call");
+  order = sorted(prof.native_cycles, prof.native_count);
+  for (size_t i = 0; i < prof.native_count; i++) {
+    size_t n = order[i];
+    if (prof.native_calls[n] == 0) continue;
+    fprintf(f, "%-24s %14" PRIu64 " %16" PRIu64 " %6.2f%% %10.1f\n",
+            native_name(n, buf), prof.native_calls[n], prof.native_cycles[n],
+            percent(prof.native_cycles[n], total),
+            (double)prof.native_cycles[n] / (double)prof.native_calls[n]);
+  }
+  free(order);
+
+  // Call graph edges: calls of every caller/callee pair, summed over
+  // all the contexts they appear in
+  size_t nedges = 0;
+  size_t *edge = xcalloc(prof.node_count, sizeof(size_t));
+  uint64_t *calls = xcalloc(prof.node_count, sizeof(uint64_t));
+  for (size_t c = 1; c < prof.node_count; c++) {
+    struct node *n = &prof.nodes[c];
+    if (n->id < 0) continue;
+    long caller = prof.nodes[n->parent].id;
+    size_t e;
+    for (e = 0; e < nedges; e++) {
+      struct node *m = &prof.nodes[edge[e]];
+      if (m->id == n->id && prof.nodes[m->parent].id == caller) break;
+    }
+    if (e == nedges) edge[nedges++] = c;
+    calls[e] += n->calls;
+  }
+  fprintf(f, "\n%-24s    %-24s %14s\n", "caller", "callee", "calls");
+  order = sorted(calls, nedges);
+  for (size_t i = 0; i < nedges; i++) {
+    struct node *n = &prof.nodes[edge[order[i]]];
+    fprintf(f, "%-24s -> %-24s %14" PRIu64 "\n",
+            function_name((size_t)prof.nodes[n->parent].id, buf),
+            function_name((size_t)n->id, buf2), calls[order[i]]);
+  }
+  free(order);
+  free(edge);
+  free(calls);
+}
+
+// One line per calling context: "main;f;g cycles"
+static void write_folded(FILE *f) {
+  char buf[32];
+  size_t *path = xcalloc(PROFILE_MAX_DEPTH + 2, sizeof(size_t));
+  for (size_t c = 0; c < prof.node_count; c++) {
+    if (prof.nodes[c].cycles == 0) continue;
+    size_t len = 0;
+    for (size_t n = c; n != 0; n = prof.nodes[n].parent) path[len++] = n;
+    path[len++] = 0;
+    while (len-- > 0) {
+      long id = prof.nodes[path[len]].id;
+      fputs(id < 0 ? native_name((size_t)(-1 - id), buf)
+                   : function_name((size_t)id, buf), f);
+      fputc(len == 0 ? ' ' : ';', f);
+    }
+    fprintf(f, "%" PRIu64 "\n", prof.nodes[c].cycles);
+  }
+  free(path);
+}
+
+// Registered with atexit, so it also runs when the program ends with
+// error(); the other runtime errors raise a signal (see c0vm_abort.c).
+static void profile_finish(void) {
+  charge(ticks());
+  prof.last_op = -1;
+
+  FILE *f = open_output(".report");
+  if (f != NULL) {
+    write_report(f);
+    fclose(f);
+  }
+  f = open_output(".folded");
+  if (f != NULL) {
+    write_folded(f);
+    fclose(f);
+  }
+}
+
+// The VM raises these itself for failed assertions, memory and
+// arithmetic errors, so stdio is still in a sane state here.
+static void profile_signal(int sig) {
+  signal(sig, SIG_DFL);
+  profile_finish();
+  raise(sig);
+}
+
+bool profile_start(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  if (prof.prefix == NULL || prof.started) return false;
+
+  prof.started = true;
+  prof.function_count = bc0->function_count;
+  prof.native_count = bc0->native_count;
+  prof.native_index = xcalloc(bc0->native_count + 1, sizeof(uint16_t));
+  for (size_t i = 0; i < bc0->native_count; i++)
+    prof.native_index[i] = bc0->native_pool[i].function_table_index;
+  read_names();
+  prof.fn_calls = xcalloc(bc0->function_count, sizeof(uint64_t));
+  prof.fn_instrs = xcalloc(bc0->function_count, sizeof(uint64_t));
+  prof.fn_cycles = xcalloc(bc0->function_count, sizeof(uint64_t));
+  prof.native_calls = xcalloc(bc0->native_count + 1, sizeof(uint64_t));
+  prof.native_cycles = xcalloc(bc0->native_count + 1, sizeof(uint64_t));
+
+  // main was called once, from nowhere
+  prof.current = new_node(0, 0);
+  prof.nodes[0].calls = 1;
+  prof.fn_calls[0] = 1;
+  prof.last_op = -1;
+  prof.last_tick = ticks();
+
+  atexit(profile_finish);
+  signal(SIGABRT, profile_signal);
+  signal(SIGSEGV, profile_signal);
+  signal(SIGFPE, profile_signal);
+  return true;
+}
@@ -0,0 +1,30 @@
+/* C0VM profiler
+ * 15-122 Principles of Imperative Computation
+ *
+ * Counts how often each opcode and each function runs and how many
+ * cycles they take, how often each native is called, and which
+ * functions call which.  When the program exits it writes a sorted
+ * report to <prefix>.report and the cycles of every call stack to
+ * <prefix>.folded, in the folded format flamegraph.pl reads.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "c0vm.h"
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+/* Profile the next program executed, writing to files starting with
+ * prefix.  Names of functions and natives are taken from the comments
+ * cc0 leaves in the .bc0 file, if filename has them. */
+void profile_enable(const char *prefix, const char *filename);
+
+/* Called by execute: true if profiling was enabled, in which case the
+ * interpreter must call profile_instr before every instruction */
+bool profile_start(struct bc0_file *bc0);
+
+/* The instruction at pc of P, in function number fn, is about to run */
+void profile_instr(size_t fn, ubyte *P, size_t pc);
+
+#endif /* _PROFILE_H_ */
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,242 +7,492 @@
 #include "c0vm.h"
 #include "xalloc.h"
 #include "contracts.h"
+#include "jit.h"
+#include "analyze.h"
 
-/* Parse a hex character functionality */
-static inline bool parse_hex(int c, uint8_t *p) {
-  REQUIRES(p != NULL);
-
-  int v;
-  if ('0' <= c && c <= '9') {
-    v = c - '0';
-  } else if ('A' <= c && c <= 'F') {
-    v = c - 'A' + 10;
-  } else if ('a' <= c && c <= 'f') {
-    v = c - 'a' + 10;
-  } else {
-    return false;
-  }
+/* The whole file is read into one buffer and decoded from there.  A
+ * .bc0 file is hex text, decoded through a table; a .bc0b file is a
+ * precompiled image (see write_image) that needs no decoding. */
 
-  ASSERT(0 <= v && v < 16);
-  *p = v;
-  return true;
+struct reader {
+  const unsigned char *p;    /* next character */
+  const unsigned char *end;  /* one past the last character */
+};
+
+/* Classes of characters, other than the hex digits 0-15 */
+#define HEX_SPACE   0x10
+#define HEX_COMMENT 0x11
+#define HEX_OTHER   0xFF
+
+/* Worked out at compile time, so that programs can be read on several
+ * threads at once */
+#define HEX_CLASS(c)                                                    \
+  ((c) >= '0' && (c) <= '9' ? (c) - '0'                                 \
+   : (c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10                          \
+   : (c) >= 'a' && (c) <= 'f' ? (c) - 'a' + 10                          \
+   : (c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\v'           \
+     || (c) == '\f' || (c) == '\r' ? HEX_SPACE                         \
+   : (c) == '#' ? HEX_COMMENT : HEX_OTHER)
+#define HEX4(c) HEX_CLASS(c), HEX_CLASS(c + 1), HEX_CLASS(c + 2), \
+                HEX_CLASS(c + 3)
+#define HEX16(c) HEX4(c), HEX4(c + 4), HEX4(c + 8), HEX4(c + 12)
+#define HEX64(c) HEX16(c), HEX16(c + 16), HEX16(c + 32), HEX16(c + 48)
+
+static const uint8_t hex_table[256] = {
+  HEX64(0), HEX64(64), HEX64(128), HEX64(192)
+};
+
+/* Where a program that cannot be read or verified goes, once the
+ * reason is on stderr: back to try_read_program or try_analyze_program,
+ * or out of the process */
+static __thread jmp_buf *on_error = NULL;
+
+void bad_program(void) {
+  if (on_error != NULL) longjmp(*on_error, 1);
+  exit(1);
 }
 
-/* Read a byte from a file
- * 
+/* Read a byte from the buffer
+ *
  * SUCCESSFUL BYTE PARSE: return true, *b = byte
  * END OF FILE: return false, *s = NULL
- * ERROR: return false *s = non-null string (client must free) */
-static inline bool next_byte(FILE *F, uint8_t *b, char **s) {
-  REQUIRES(F != NULL && b != NULL && s != NULL);
-
-  // Scan for the first character
-  int c;
-  do {
-    c = fgetc(F);
-
-    // Advance over linecomments
-    if (c == '#') {
-      do { 
-        c = fgetc(F);
-      } while (c != '\n' && c != EOF);
-    }
-
-  } while (isspace(c));
-
-  // Are we done?
-  if (c == EOF) {
-    *s = NULL; // No error
-    return false;
-  } 
+ * ERROR: return false, *s = error message in buf */
+static inline bool next_byte(struct reader *R, uint8_t *b, char **s,
+                             char buf[100]) {
+  REQUIRES(R != NULL && b != NULL && s != NULL);
 
+  // Scan for the first character, advancing over line comments
   uint8_t hi;
-  if (!parse_hex(c, &hi)) {
-    *s = xcalloc(100, sizeof(char));
-    sprintf(*s, "expected a hex character, found '%c'", c);
-    return false;
+  while (true) {
+    if (R->p == R->end) {
+      *s = NULL; // No error
+      return false;
+    }
+    hi = hex_table[*R->p];
+    if (hi < 16) break;
+    if (hi == HEX_COMMENT) {
+      while (R->p < R->end && *R->p != '\n') R->p++;
+    } else if (hi == HEX_SPACE) {
+      R->p++;
+    } else {
+      sprintf(buf, "expected a hex character, found '%c'", *R->p);
+      *s = buf;
+      return false;
+    }
   }
+  int c = *R->p++;
 
   // The next character must follow immediately
-  int c2 = fgetc(F); 
-  if (c2 == EOF) {
-    *s = xcalloc(100, sizeof(char));
-    sprintf(*s, "expected 2 hex chars, found '%c', then end of file", c);
+  if (R->p == R->end) {
+    sprintf(buf, "expected 2 hex chars, found '%c', then end of file", c);
+    *s = buf;
     return false;
   }
-  
-  uint8_t lo;
-  if (!parse_hex(c2, &lo)) {
-    *s = xcalloc(100, sizeof(char));
-    sprintf(*s, "expected 2 hex chars, found '%c%c'", c, c2);
+
+  uint8_t lo = hex_table[*R->p];
+  if (lo >= 16) {
+    sprintf(buf, "expected 2 hex chars, found '%c%c'", c, *R->p);
+    *s = buf;
     return false;
   }
+  R->p++;
 
   *b = hi << 4 | lo;
   return true;
 }
 
-/* Read in various integer types from the file, possibly aborting program */
-uint32_t read_u32(FILE *F) {
-  REQUIRES(F != NULL);
-  uint8_t x[4];
-  char* errmsg;
-  if (!next_byte(F, x, &errmsg) || !next_byte(F, x+1, &errmsg) ||
-      !next_byte(F, x+2, &errmsg) || !next_byte(F, x+3, &errmsg)) {
-    if (errmsg == NULL) {
-      fprintf(stderr, "Expected 4-byte sequence, found end of file.\n");
-    } else {
-      fprintf(stderr, "Error while reading 4-byte sequence: %s\n", errmsg);
-      free(errmsg);
+/* Read in n bytes, aborting the program on an error */
+static void read_bytes(struct reader *R, uint8_t *x, size_t n, char *what) {
+  char buf[100];
+  char *errmsg;
+  for (size_t k = 0; k < n; k++) {
+    if (!next_byte(R, &x[k], &errmsg, buf)) {
+      if (errmsg == NULL) {
+        fprintf(stderr, "Expected %s, found end of file.\n", what);
+      } else {
+        fprintf(stderr, "Error while reading %s: %s\n", what, errmsg);
+      }
+      bad_program();
     }
-    fclose(F);
-    exit(1);
   }
+}
 
+/* Read in various integer types from the file, possibly aborting program */
+static uint32_t read_u32(struct reader *R) {
+  uint8_t x[4];
+  read_bytes(R, x, 4, "4-byte sequence");
   return ((uint32_t)x[0] << 24) |
     ((uint32_t)x[1] << 16) |
     ((uint32_t)x[2] << 8) |
     ((uint32_t)x[3]);
 }
 
-uint16_t read_u16(FILE *F) {
-  REQUIRES(F != NULL);
+static uint16_t read_u16(struct reader *R) {
   uint8_t x[2];
-  char* errmsg;
-  if (!next_byte(F, x, &errmsg) || !next_byte(F, x+1, &errmsg)) {
-    if (errmsg == NULL) {
-      fprintf(stderr, "Expected 2-byte sequence, found end of file.\n");
-    } else {
-      fprintf(stderr, "Error while reading 2-byte sequence: %s\n", errmsg);
-      free(errmsg);
+  read_bytes(R, x, 2, "2-byte sequence");
+  return ((uint16_t)x[0] << 8) | ((uint16_t)x[1]);
+}
+
+/* Read the whole file into memory; *len is its length */
+static unsigned char *read_file(char *filename, size_t *len) {
+  FILE *F = fopen(filename, "rb");
+  if (F == NULL) {
+    fprintf(stderr, "Error: could not open file '%s'\n", filename);
+    bad_program();
+  }
+
+  size_t capacity = 1 << 16;
+  unsigned char *buf = xmalloc(capacity);
+  size_t n = 0;
+  size_t got;
+  while ((got = fread(buf + n, 1, capacity - n, F)) > 0) {
+    n += got;
+    if (n == capacity) {
+      unsigned char *bigger = xmalloc(capacity * 2);
+      memcpy(bigger, buf, n);
+      free(buf);
+      buf = bigger;
+      capacity *= 2;
     }
+  }
+  if (ferror(F)) {
+    fprintf(stderr, "Error: could not read file '%s'\n", filename);
     fclose(F);
-    exit(1);
+    free(buf);
+    bad_program();
   }
+  fclose(F);
+  *len = n;
+  return buf;
+}
 
-  return ((uint16_t)x[0] << 8) | ((uint16_t)x[1]);
+/*** Precompiled images ***/
+
+/* A .bc0b image is the program laid out in native byte order, with
+ * every array at an aligned offset, so loading it is a matter of
+ * checking the header and pointing the pools into the buffer.  It is
+ * only meant to be read on the kind of machine that wrote it. */
+
+#define BC0B_MAGIC 0xC0C0B0B0
+#define BC0B_FORMAT 1
+
+struct bc0b_header {
+  uint32_t magic;           /* BC0B_MAGIC, in native byte order */
+  uint16_t format;          /* BC0B_FORMAT */
+  uint16_t version;         /* bytecode version, as in the .bc0 */
+  uint16_t int_count;
+  uint16_t string_count;
+  uint16_t function_count;
+  uint16_t native_count;
+  uint32_t int_offset;      /* int32_t[int_count] */
+  uint32_t string_offset;   /* char[string_count] */
+  uint32_t function_offset; /* struct bc0b_function[function_count] */
+  uint32_t native_offset;   /* struct native_info[native_count] */
+  uint32_t size;            /* of the whole image */
+};
+
+struct bc0b_function {
+  uint16_t num_args;
+  uint16_t num_vars;
+  uint16_t code_length;
+  uint16_t unused;
+  uint32_t code_offset;     /* ubyte[code_length] */
+};
+
+static bool is_image(unsigned char *buf, size_t len) {
+  uint32_t magic;
+  if (len < sizeof(magic)) return false;
+  memcpy(&magic, buf, sizeof(magic));
+  return magic == BC0B_MAGIC;
 }
 
-uint8_t read_u8(FILE *F) {
-  REQUIRES(F != NULL);
-  uint8_t x;
-  char* errmsg;
-  if (!next_byte(F, &x, &errmsg)) {
-    if (errmsg == NULL) {
-      fprintf(stderr, "Expected byte, found end of file.\n");
-    } else {
-      fprintf(stderr, "Error while reading byte: %s\n", errmsg);
-      free(errmsg);
-    }
-    fclose(F);
-    exit(1);
+static void bad_image(char *filename, char *msg) {
+  fprintf(stderr, "Error: %s is not a valid .bc0b image: %s\n",
+          filename, msg);
+  bad_program();
+}
+
+/* Does [offset, offset+n*size) lie inside an image of len bytes? */
+static bool in_image(size_t len, uint32_t offset, size_t n, size_t size) {
+  return offset <= len && n * size <= len - offset;
+}
+
+static struct bc0_file *load_image(unsigned char *buf, size_t len,
+                                   char *filename) {
+  struct bc0b_header h;
+  if (len < sizeof(h)) bad_image(filename, "truncated header");
+  memcpy(&h, buf, sizeof(h));
+  if (h.format != BC0B_FORMAT) bad_image(filename, "unknown format");
+  if (h.size != len) bad_image(filename, "wrong size");
+  if (!in_image(len, h.int_offset, h.int_count, sizeof(int32_t))
+      || h.int_offset % sizeof(int32_t) != 0
+      || !in_image(len, h.string_offset, h.string_count, 1)
+      || !in_image(len, h.function_offset, h.function_count,
+                   sizeof(struct bc0b_function))
+      || h.function_offset % sizeof(uint32_t) != 0
+      || !in_image(len, h.native_offset, h.native_count,
+                   sizeof(struct native_info))
+      || h.native_offset % sizeof(uint16_t) != 0)
+    bad_image(filename, "section out of bounds");
+
+  struct bc0_file *bc0 = xcalloc(1, sizeof(struct bc0_file));
+  bc0->magic = 0xC0C0FFEE;
+  bc0->version = h.version;
+  bc0->image = buf;
+
+  bc0->int_count = h.int_count;
+  bc0->int_pool = (int32_t*)(buf + h.int_offset);
+
+  /* The string pool is handed to c0vm_main.c, which moves it */
+  bc0->string_count = h.string_count;
+  bc0->string_pool = xcalloc(h.string_count, sizeof(char));
+  memcpy(bc0->string_pool, buf + h.string_offset, h.string_count);
+
+  bc0->function_count = h.function_count;
+  bc0->function_pool = xcalloc(h.function_count,
+                               sizeof(struct function_info));
+  struct bc0b_function *fs = (struct bc0b_function*)(buf + h.function_offset);
+  for (size_t j = 0; j < h.function_count; j++) {
+    if (!in_image(len, fs[j].code_offset, fs[j].code_length, 1))
+      bad_image(filename, "code out of bounds");
+    bc0->function_pool[j].num_args = fs[j].num_args;
+    bc0->function_pool[j].num_vars = fs[j].num_vars;
+    bc0->function_pool[j].code_length = fs[j].code_length;
+    bc0->function_pool[j].code = buf + fs[j].code_offset;
   }
 
-  return x;
+  bc0->native_count = h.native_count;
+  bc0->native_pool = (struct native_info*)(buf + h.native_offset);
+  return bc0;
 }
 
-/* Read a bytecode file */
-struct bc0_file* read_program(char *filename) {
-  FILE *F = fopen(filename, "r");
-  if (F == NULL) {
-    fprintf(stderr, "Error: could not open file '%s'\n", filename);
+/* Reserve n bytes aligned to align at the end of the image */
+static uint32_t image_alloc(size_t *size, size_t n, size_t align) {
+  *size = (*size + align - 1) / align * align;
+  uint32_t offset = (uint32_t)*size;
+  *size += n;
+  return offset;
+}
+
+void write_image(struct bc0_file *bc0, char *filename) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+
+  struct bc0b_header h;
+  memset(&h, 0, sizeof(h));
+  size_t size = sizeof(h);
+  h.magic = BC0B_MAGIC;
+  h.format = BC0B_FORMAT;
+  h.version = bc0->version;
+  h.int_count = bc0->int_count;
+  h.string_count = bc0->string_count;
+  h.function_count = bc0->function_count;
+  h.native_count = bc0->native_count;
+  h.int_offset = image_alloc(&size, h.int_count * sizeof(int32_t),
+                             sizeof(int32_t));
+  h.string_offset = image_alloc(&size, h.string_count, 1);
+  h.function_offset = image_alloc(&size, h.function_count
+                                  * sizeof(struct bc0b_function),
+                                  sizeof(uint32_t));
+  h.native_offset = image_alloc(&size, h.native_count
+                                * sizeof(struct native_info),
+                                sizeof(uint16_t));
+  uint32_t *code_offset = xcalloc(bc0->function_count + 1, sizeof(uint32_t));
+  for (size_t j = 0; j < bc0->function_count; j++)
+    code_offset[j] = image_alloc(&size, bc0->function_pool[j].code_length, 1);
+  if (size > UINT32_MAX) {
+    fprintf(stderr, "Error: program too large for a .bc0b image\n");
     exit(1);
   }
+  h.size = (uint32_t)size;
+
+  unsigned char *buf = xcalloc(size, 1);
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + h.int_offset, bc0->int_pool, h.int_count * sizeof(int32_t));
+  memcpy(buf + h.string_offset, bc0->string_pool, h.string_count);
+  for (size_t j = 0; j < bc0->function_count; j++) {
+    struct function_info *fi = &bc0->function_pool[j];
+    struct bc0b_function f;
+    memset(&f, 0, sizeof(f));
+    f.num_args = fi->num_args;
+    f.num_vars = fi->num_vars;
+    f.code_length = fi->code_length;
+    f.code_offset = code_offset[j];
+    memcpy(buf + h.function_offset + j * sizeof(f), &f, sizeof(f));
+    memcpy(buf + code_offset[j], fi->code, fi->code_length);
+  }
+  memcpy(buf + h.native_offset, bc0->native_pool,
+         h.native_count * sizeof(struct native_info));
+
+  FILE *F = fopen(filename, "wb");
+  if (F == NULL || fwrite(buf, 1, size, F) != size || fclose(F) != 0) {
+    fprintf(stderr, "Error: could not write image '%s'\n", filename);
+    exit(1);
+  }
+  free(code_offset);
+  free(buf);
+}
+
+/*** Text bytecode ***/
+
+/* Read a bytecode file or image */
+struct bc0_file* read_program(char *filename) {
+  size_t len;
+  unsigned char *buf = read_file(filename, &len);
+  if (is_image(buf, len)) return load_image(buf, len, filename);
+
+  struct reader R;
+  R.p = buf;
+  R.end = buf + len;
 
   /* Check magic number */
   uint8_t x[4];
   char *errmsg;
-  if (!next_byte(F, x, &errmsg) ||
-      !next_byte(F, x+1, &errmsg) ||
-      !next_byte(F, x+2, &errmsg) ||
-      !next_byte(F, x+3, &errmsg)) {
+  char msg[100];
+  if (!next_byte(&R, x, &errmsg, msg) ||
+      !next_byte(&R, x+1, &errmsg, msg) ||
+      !next_byte(&R, x+2, &errmsg, msg) ||
+      !next_byte(&R, x+3, &errmsg, msg)) {
     if (errmsg == NULL) {
       fprintf(stderr, "End of file reached while reading magic number.\n");
     } else {
       fprintf(stderr, "Error while trying to read magic number: %s\n", errmsg);
-      free(errmsg);
     }
     fprintf(stderr, "Are you sure %s is a C0 bytecode file?.\n", filename);
-    fclose(F);
-    exit(1);
+    bad_program();
   } else if (x[0] != 0xC0 || x[1] != 0xC0 || x[2] != 0xFF || x[3] != 0xEE) {
     fprintf(stderr, "Magic number is %02X%02X%02X%02X, which is wrong\n",
             x[0], x[1], x[2], x[3]);
     fprintf(stderr, "Are you sure %s is a C0 bytecode file?.\n", filename);
-    fclose(F);
-    exit(1);
+    bad_program();
   }
 
   /* Populate struct */
-  struct bc0_file* bc0 = xmalloc(sizeof(struct bc0_file));
+  struct bc0_file* bc0 = xcalloc(1, sizeof(struct bc0_file));
   bc0->magic = 0xC0C0FFEE;
-  size_t i = 4;   /* current bc0_file byte position */
 
-  bc0->version = read_u16(F);
-  i += 2;
-
-  bc0->int_count = read_u16(F);
-  i += 2;
+  bc0->version = read_u16(&R);
 
+  bc0->int_count = read_u16(&R);
   bc0->int_pool = xcalloc(bc0->int_count, sizeof(int32_t));
   for (size_t j = 0; j < bc0->int_count; j++) {
-    bc0->int_pool[j] = read_u32(F);
-    i += 4;
+    bc0->int_pool[j] = read_u32(&R);
   }
 
-  bc0->string_count = read_u16(F);
-  i += 2;
+  bc0->string_count = read_u16(&R);
   bc0->string_pool = xcalloc(bc0->string_count, sizeof(char));
-  for (size_t j = 0; j < bc0->string_count; j++) {
-    bc0->string_pool[j] = (char) read_u8(F);
-    i++;
-  }
+  read_bytes(&R, (uint8_t*)bc0->string_pool, bc0->string_count, "byte");
 
-  bc0->function_count = read_u16(F);
-  i += 2;
+  bc0->function_count = read_u16(&R);
   bc0->function_pool =
     xcalloc(bc0->function_count, sizeof(struct function_info));
   for (size_t j = 0; j < bc0->function_count; j++) {
-    bc0->function_pool[j].num_args = read_u16(F);
-    i += 2;
-    bc0->function_pool[j].num_vars = read_u16(F);
-    i += 2;
-    bc0->function_pool[j].code_length = read_u16(F);
-    i += 2;
-    bc0->function_pool[j].code = 
-      xcalloc(bc0->function_pool[j].code_length, sizeof(ubyte));
-    for (size_t k = 0; k < bc0->function_pool[j].code_length; k++) {
-      bc0->function_pool[j].code[k] = read_u8(F);
-      i++;
-    }
+    struct function_info *fi = &bc0->function_pool[j];
+    fi->num_args = read_u16(&R);
+    fi->num_vars = read_u16(&R);
+    fi->code_length = read_u16(&R);
+    fi->code = xcalloc(fi->code_length, sizeof(ubyte));
+    read_bytes(&R, fi->code, fi->code_length, "byte");
   }
 
-  bc0->native_count = read_u16(F);
-  i += 2;
+  bc0->native_count = read_u16(&R);
   bc0->native_pool = xcalloc(bc0->native_count, sizeof(struct native_info));
   for (size_t j = 0; j < bc0->native_count; j++) {
-    bc0->native_pool[j].num_args = read_u16(F);
-    i += 2;
-    bc0->native_pool[j].function_table_index = read_u16(F);
-    i += 2;
+    bc0->native_pool[j].num_args = read_u16(&R);
+    bc0->native_pool[j].function_table_index = read_u16(&R);
   }
 
-  fclose(F);
+  free(buf);
+  return bc0;
+}
+
+/* Read a program, or return NULL if read_program would end the process.
+ * What was read of a broken file so far is not freed. */
+struct bc0_file *try_read_program(char *filename) {
+  jmp_buf here;
+  jmp_buf *outer = on_error;
+  struct bc0_file *bc0 = NULL;
+  on_error = &here;
+  if (setjmp(here) == 0) bc0 = read_program(filename);
+  on_error = outer;
   return bc0;
 }
 
+/* Verify a program, or return false if analyze_program would end the
+ * process.  What the analysis allocated so far is not freed. */
+bool try_analyze_program(struct bc0_file *bc0) {
+  jmp_buf here;
+  jmp_buf *outer = on_error;
+  bool ok = false;
+  on_error = &here;
+  if (setjmp(here) == 0) {
+    analyze_program(bc0);
+    ok = true;
+  }
+  on_error = outer;
+  return ok;
+}
+
+/* A copy of a program that no execute has filled in yet, with pools of
+ * its own, so that another context can run it at the same time */
+struct bc0_file *copy_program(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL && bc0->natives == NULL && bc0->strings == NULL);
+  struct bc0_file *copy = xcalloc(1, sizeof(struct bc0_file));
+  copy->magic = bc0->magic;
+  copy->version = bc0->version;
+
+  copy->int_count = bc0->int_count;
+  copy->int_pool = xcalloc(bc0->int_count, sizeof(int32_t));
+  memcpy(copy->int_pool, bc0->int_pool, bc0->int_count * sizeof(int32_t));
+
+  copy->string_count = bc0->string_count;
+  copy->string_pool = xcalloc(bc0->string_count, sizeof(char));
+  memcpy(copy->string_pool, bc0->string_pool, bc0->string_count);
+
+  copy->function_count = bc0->function_count;
+  copy->function_pool =
+    xcalloc(bc0->function_count, sizeof(struct function_info));
+  for (size_t j = 0; j < bc0->function_count; j++) {
+    struct function_info *fi = &copy->function_pool[j];
+    fi->num_args = bc0->function_pool[j].num_args;
+    fi->num_vars = bc0->function_pool[j].num_vars;
+    fi->code_length = bc0->function_pool[j].code_length;
+    fi->code = xcalloc(fi->code_length, sizeof(ubyte));
+    memcpy(fi->code, bc0->function_pool[j].code, fi->code_length);
+  }
+
+  copy->native_count = bc0->native_count;
+  copy->native_pool = xcalloc(bc0->native_count, sizeof(struct native_info));
+  memcpy(copy->native_pool, bc0->native_pool,
+         bc0->native_count * sizeof(struct native_info));
+  return copy;
+}
+
 void free_program(struct bc0_file *program)
 {
   REQUIRES(program != NULL);
 
-  free(program->int_pool);
   // Don't free the string pool, it's stack allocated
   // free(program->string_pool);
 
-  for (size_t j = 0; j < program->function_count; j++)
-    free(program->function_pool[j].code);
+  for (size_t j = 0; j < program->function_count; j++) {
+    if (program->image == NULL) free(program->function_pool[j].code);
+    free(program->function_pool[j].pcinfo);
+    free(program->function_pool[j].dispatch);
+    jit_free(program->function_pool[j].jit);
+    for (size_t k = 0; k < program->function_pool[j].loop_count; k++) {
+      free(program->function_pool[j].loops[k].accesses);
+      free(program->function_pool[j].loops[k].fast);
+    }
+    free(program->function_pool[j].loops);
+  }
   free(program->function_pool);
+  free(program->natives);
+  free(program->strings);
 
-  free(program->native_pool);
+  if (program->image == NULL) {
+    free(program->int_pool);
+    free(program->native_pool);
+  }
+  free(program->image);
   free(program);
 }
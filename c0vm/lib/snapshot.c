@@ -0,0 +1,130 @@
+/* C0VM snapshots
+ * 15-122 Principles of Imperative Computation
+ *
+ * The pieces of the file format the heap, the strings and the VM
+ * share.  A program is known by a hash of everything in its .bc0 file,
+ * so a snapshot is only restored for the program it was taken of.
+ */
+
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS, MAP_FIXED_NOREPLACE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "contracts.h"
+#include "c0vm.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "C0VMSNAP"
+#define SNAPSHOT_VERSION 1
+#define PAGE 4096
+
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t bytes) {
+  const unsigned char *s = p;
+  for (size_t i = 0; i < bytes; i++)
+    h = (h ^ s[i]) * 1099511628211u;  /* FNV-1a */
+  return h;
+}
+
+static uint64_t program_hash(struct bc0_file *bc0) {
+  uint64_t h = 14695981039346656037u;
+  h = hash_bytes(h, &bc0->version, sizeof(bc0->version));
+  h = hash_bytes(h, &bc0->int_count, sizeof(bc0->int_count));
+  h = hash_bytes(h, bc0->int_pool, bc0->int_count * sizeof(int32_t));
+  h = hash_bytes(h, &bc0->string_count, sizeof(bc0->string_count));
+  h = hash_bytes(h, bc0->string_pool, bc0->string_count);
+  h = hash_bytes(h, &bc0->function_count, sizeof(bc0->function_count));
+  for (size_t i = 0; i < bc0->function_count; i++) {
+    struct function_info *fi = &bc0->function_pool[i];
+    h = hash_bytes(h, &fi->num_args, sizeof(fi->num_args));
+    h = hash_bytes(h, &fi->num_vars, sizeof(fi->num_vars));
+    h = hash_bytes(h, &fi->code_length, sizeof(fi->code_length));
+    h = hash_bytes(h, fi->code, fi->code_length);
+  }
+  h = hash_bytes(h, &bc0->native_count, sizeof(bc0->native_count));
+  for (size_t i = 0; i < bc0->native_count; i++) {
+    struct native_info *ni = &bc0->native_pool[i];
+    h = hash_bytes(h, &ni->num_args, sizeof(ni->num_args));
+    h = hash_bytes(h, &ni->function_table_index,
+                   sizeof(ni->function_table_index));
+  }
+  return h;
+}
+
+bool snapshot_put_header(FILE *f, struct bc0_file *bc0) {
+  return snapshot_put(f, SNAPSHOT_MAGIC, 8)
+    && snapshot_put_word(f, SNAPSHOT_VERSION)
+    && snapshot_put_word(f, sizeof(c0_value))
+    && snapshot_put_word(f, program_hash(bc0));
+}
+
+bool snapshot_check_header(FILE *f, struct bc0_file *bc0) {
+  char magic[8];
+  uint64_t version, value_size, hash;
+  return snapshot_get(f, magic, 8)
+    && memcmp(magic, SNAPSHOT_MAGIC, 8) == 0
+    && snapshot_get_word(f, &version) && version == SNAPSHOT_VERSION
+    && snapshot_get_word(f, &value_size) && value_size == sizeof(c0_value)
+    && snapshot_get_word(f, &hash) && hash == program_hash(bc0);
+}
+
+bool snapshot_put(FILE *f, const void *p, size_t bytes) {
+  return bytes == 0 || fwrite(p, 1, bytes, f) == bytes;
+}
+
+bool snapshot_get(FILE *f, void *p, size_t bytes) {
+  return bytes == 0 || fread(p, 1, bytes, f) == bytes;
+}
+
+bool snapshot_put_word(FILE *f, uint64_t w) {
+  return snapshot_put(f, &w, sizeof(w));
+}
+
+bool snapshot_get_word(FILE *f, uint64_t *w) {
+  return snapshot_get(f, w, sizeof(*w));
+}
+
+// A byte per page, 1 if the page follows and 0 if it is all zero
+bool snapshot_put_pages(FILE *f, const unsigned char *p, size_t bytes) {
+  static const unsigned char zero[PAGE];
+  for (size_t off = 0; off < bytes; off += PAGE) {
+    size_t n = bytes - off < PAGE ? bytes - off : PAGE;
+    unsigned char present = memcmp(p + off, zero, n) != 0;
+    if (!snapshot_put(f, &present, 1)) return false;
+    if (present && !snapshot_put(f, p + off, n)) return false;
+  }
+  return true;
+}
+
+bool snapshot_get_pages(FILE *f, unsigned char *p, size_t bytes) {
+  for (size_t off = 0; off < bytes; off += PAGE) {
+    size_t n = bytes - off < PAGE ? bytes - off : PAGE;
+    unsigned char present;
+    if (!snapshot_get(f, &present, 1) || present > 1) return false;
+    if (present && !snapshot_get(f, p + off, n)) return false;
+  }
+  return true;
+}
+
+void *snapshot_map(uintptr_t addr, size_t bytes) {
+  REQUIRES(addr % PAGE == 0 && bytes % PAGE == 0);
+#ifdef MAP_ANONYMOUS
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_FIXED_NOREPLACE
+  flags |= MAP_FIXED_NOREPLACE;
+#endif
+  void *p = mmap((void*)addr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  if (p != (void*)addr) {  /* only a hint, on older kernels */
+    munmap(p, bytes);
+    return NULL;
+  }
+  return p;
+#else
+  (void)addr;
+  (void)bytes;
+  return NULL;
+#endif
+}
@@ -0,0 +1,48 @@
+/* C0VM snapshots
+ * 15-122 Principles of Imperative Computation
+ *
+ * A snapshot is the state of a run stopped between two instructions,
+ * written so that a later run of the same program can carry on from
+ * there instead of starting over.  The file holds, in order:
+ *
+ *  - a header naming the program and the kind of c0_value it is for,
+ *  - the VM's strings (see strings.h),
+ *  - the heap (see gc.h),
+ *  - the operand stack, the call frames and the pc (see c0vm.c).
+ *
+ * Objects are never moved, and nothing says which of their words are
+ * pointers, so the memory of the strings and the heap is put back at
+ * the addresses it had; a snapshot cannot be restored if some of them
+ * are taken.  Memory the natives made is not in a snapshot (see
+ * c0vm.c for how the VM keeps that from mattering).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "c0vm.h"
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/* Write and check the header for program bc0 */
+bool snapshot_put_header(FILE *f, struct bc0_file *bc0);
+bool snapshot_check_header(FILE *f, struct bc0_file *bc0);
+
+/* Plain data, and words in the byte order of the machine */
+bool snapshot_put(FILE *f, const void *p, size_t bytes);
+bool snapshot_get(FILE *f, void *p, size_t bytes);
+bool snapshot_put_word(FILE *f, uint64_t w);
+bool snapshot_get_word(FILE *f, uint64_t *w);
+
+/* The contents of mapped memory, leaving out the pages that are all
+ * zero; snapshot_get_pages expects p to be zeroed already */
+bool snapshot_put_pages(FILE *f, const unsigned char *p, size_t bytes);
+bool snapshot_get_pages(FILE *f, unsigned char *p, size_t bytes);
+
+/* bytes (whole pages) of zeroed memory mapped at exactly addr, or NULL
+ * if that cannot be done */
+void *snapshot_map(uintptr_t addr, size_t bytes);
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,358 @@
+/* C0VM strings
+ * 15-122 Principles of Imperative Computation
+ *
+ * Every string made here lives in a chunk of its arena, so a string
+ * can be told apart from one a native made by its address.  Its
+ * header sits just before the pointer the program sees: for a flat
+ * string the characters follow, for a rope its two halves.
+ */
+
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "xalloc.h"
+#include "contracts.h"
+#include "strings.h"
+#include "snapshot.h"
+
+#define STRING_CHUNK (1 << 16)     /* bytes in a chunk of strings */
+#define ROPE_MIN 64                /* shorter joins are copied */
+
+enum string_kind { FLAT, INTERNED, ROPE };
+
+/* In the header of every string, so that a pointer into the middle of
+ * one is not taken for a string of its own */
+#define STRING_MAGIC 0xC0573200u
+
+struct header {
+  uint32_t length;
+  uint32_t kind;                   /* STRING_MAGIC | string_kind */
+};
+
+struct rope {
+  char *left, *right;
+  char *flat;                      /* once flattened, else NULL */
+};
+
+struct range {
+  uintptr_t start, end;
+};
+
+struct string_arena {
+  struct range *chunks;            /* sorted by address */
+  size_t chunk_count, chunk_cap;
+  uintptr_t lowest, highest;
+  unsigned char *bump, *limit;
+
+  char **table;                    /* interned strings, open addressing */
+  size_t table_count, table_cap;
+};
+
+/*** Allocation ***/
+
+static size_t whole_pages(size_t bytes) {
+  return (bytes + 4095) & ~(size_t)4095;
+}
+
+// Chunks are mapped straight from the kernel, like those of the heap,
+// so that a snapshot can put them back where they were
+static unsigned char *map_chunk(size_t bytes) {
+#ifdef MAP_ANONYMOUS
+  void *p = mmap(NULL, whole_pages(bytes), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  return p;
+#else
+  return xmalloc(bytes);
+#endif
+}
+
+static void unmap_chunk(struct range *c) {
+#ifdef MAP_ANONYMOUS
+  munmap((void*)c->start, whole_pages(c->end - c->start));
+#else
+  free((void*)c->start);
+#endif
+}
+
+static void add_chunk(struct string_arena *strings, unsigned char *p,
+                      size_t bytes) {
+  if (strings->chunk_count == strings->chunk_cap) {
+    strings->chunk_cap = strings->chunk_cap == 0 ? 16 : 2 * strings->chunk_cap;
+    strings->chunks = xrealloc(strings->chunks,
+                               strings->chunk_cap * sizeof(struct range));
+  }
+  size_t i = strings->chunk_count++;
+  while (i > 0 && strings->chunks[i - 1].start > (uintptr_t)p) {
+    strings->chunks[i] = strings->chunks[i - 1];
+    i--;
+  }
+  strings->chunks[i].start = (uintptr_t)p;
+  strings->chunks[i].end = (uintptr_t)p + bytes;
+  if (strings->lowest == 0 || (uintptr_t)p < strings->lowest)
+    strings->lowest = (uintptr_t)p;
+  if ((uintptr_t)p + bytes > strings->highest)
+    strings->highest = (uintptr_t)p + bytes;
+}
+
+// A string of kind with room for bytes after its header
+static char *allocate(struct string_arena *strings, enum string_kind kind,
+                      size_t length, size_t bytes) {
+  if (length > UINT32_MAX) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  size_t size = (sizeof(struct header) + bytes + 7) & ~(size_t)7;
+  unsigned char *p;
+  if (size > STRING_CHUNK / 4) {
+    p = map_chunk(size);
+    add_chunk(strings, p, size);
+  } else {
+    if ((size_t)(strings->limit - strings->bump) < size) {
+      strings->bump = map_chunk(STRING_CHUNK);
+      strings->limit = strings->bump + STRING_CHUNK;
+      add_chunk(strings, strings->bump, STRING_CHUNK);
+    }
+    p = strings->bump;
+    strings->bump += size;
+  }
+  struct header *h = (struct header*)p;
+  h->length = (uint32_t)length;
+  h->kind = STRING_MAGIC | kind;
+  return (char*)(h + 1);
+}
+
+static char *flat_copy(struct string_arena *strings, enum string_kind kind,
+                       const char *s, size_t length) {
+  char *t = allocate(strings, kind, length, length + 1);
+  memcpy(t, s, length);
+  t[length] = '\0';
+  return t;
+}
+
+// The header of s, or NULL if s was not made here
+static struct header *header_of(struct string_arena *strings, const char *s) {
+  uintptr_t p = (uintptr_t)s;
+  if (p < strings->lowest || p >= strings->highest) return NULL;
+  struct range *c = NULL;
+  size_t lo = 0, hi = strings->chunk_count;
+  while (lo < hi && c == NULL) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (p < strings->chunks[mid].start) hi = mid;
+    else if (p >= strings->chunks[mid].end) lo = mid + 1;
+    else c = &strings->chunks[mid];
+  }
+  if (c == NULL || p < c->start + sizeof(struct header)) return NULL;
+  struct header *h = (struct header*)s - 1;
+  return (h->kind & ~(uint32_t)0xFF) == STRING_MAGIC ? h : NULL;
+}
+
+/*** Interning ***/
+
+static size_t hash(const char *s, size_t length) {
+  size_t h = 2166136261u;          /* FNV-1a */
+  for (size_t i = 0; i < length; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+static void table_insert(struct string_arena *strings, char *s) {
+  size_t mask = strings->table_cap - 1;
+  size_t i = hash(s, ((struct header*)s - 1)->length) & mask;
+  while (strings->table[i] != NULL) i = (i + 1) & mask;
+  strings->table[i] = s;
+  strings->table_count++;
+}
+
+// Make room in the table for one more
+static void table_reserve(struct string_arena *strings) {
+  if (2 * (strings->table_count + 1) > strings->table_cap) {
+    char **old = strings->table;
+    size_t old_cap = strings->table_cap;
+    strings->table_cap = old_cap == 0 ? 64 : 2 * old_cap;
+    strings->table = xcalloc(strings->table_cap, sizeof(char*));
+    strings->table_count = 0;
+    for (size_t i = 0; i < old_cap; i++)
+      if (old[i] != NULL) table_insert(strings, old[i]);
+    free(old);
+  }
+}
+
+char *vm_string_intern(struct string_arena *strings, const char *s) {
+  REQUIRES(s != NULL);
+  size_t length = strlen(s);
+  table_reserve(strings);
+
+  size_t mask = strings->table_cap - 1;
+  for (size_t i = hash(s, length) & mask; strings->table[i] != NULL;
+       i = (i + 1) & mask) {
+    char *t = strings->table[i];
+    if (((struct header*)t - 1)->length == length
+        && memcmp(t, s, length) == 0)
+      return t;
+  }
+  char *t = flat_copy(strings, INTERNED, s, length);
+  table_insert(strings, t);
+  return t;
+}
+
+/*** Operations ***/
+
+char *vm_string_copy(struct string_arena *strings, const char *s) {
+  REQUIRES(s != NULL);
+  return flat_copy(strings, FLAT, s, strlen(s));
+}
+
+char *vm_string_flatten(struct string_arena *strings, char *s) {
+  struct header *h = header_of(strings, s);
+  if (h == NULL || h->kind != (STRING_MAGIC | ROPE)) return s;
+  struct rope *r = (struct rope*)s;
+  if (r->flat != NULL) return r->flat;
+
+  // Copy the pieces left to right, keeping the right halves of the
+  // ropes on the way down to come back to
+  char *flat = allocate(strings, FLAT, h->length, (size_t)h->length + 1);
+  size_t pos = 0;
+  char **pending = NULL;
+  size_t count = 0, cap = 0;
+  char *next = s;
+  while (next != NULL) {
+    struct header *nh = header_of(strings, next);
+    struct rope *nr = (struct rope*)next;
+    if (nh != NULL && nh->kind == (STRING_MAGIC | ROPE) && nr->flat == NULL) {
+      if (count == cap) {
+        cap = cap == 0 ? 16 : 2 * cap;
+        pending = xrealloc(pending, cap * sizeof(char*));
+      }
+      pending[count++] = nr->right;
+      next = nr->left;
+      continue;
+    }
+    if (nh != NULL && nh->kind == (STRING_MAGIC | ROPE)) next = nr->flat;
+    size_t length = nh != NULL ? nh->length : strlen(next);
+    memcpy(flat + pos, next, length);
+    pos += length;
+    next = count > 0 ? pending[--count] : NULL;
+  }
+  free(pending);
+  ASSERT(pos == h->length);
+  flat[pos] = '\0';
+
+  r->flat = flat;
+  return flat;
+}
+
+int32_t vm_string_known_length(struct string_arena *strings, char *s) {
+  struct header *h = header_of(strings, s);
+  return h != NULL ? (int32_t)h->length : -1;
+}
+
+int32_t vm_string_length(struct string_arena *strings, char *s) {
+  REQUIRES(s != NULL);
+  struct header *h = header_of(strings, s);
+  return (int32_t)(h != NULL ? h->length : strlen(s));
+}
+
+char *vm_string_join(struct string_arena *strings, char *a, char *b) {
+  REQUIRES(a != NULL && b != NULL);
+  size_t la = (size_t)vm_string_length(strings, a);
+  size_t lb = (size_t)vm_string_length(strings, b);
+  if (la + lb < ROPE_MIN) {
+    char *t = allocate(strings, FLAT, la + lb, la + lb + 1);
+    memcpy(t, vm_string_flatten(strings, a), la);
+    memcpy(t + la, vm_string_flatten(strings, b), lb);
+    t[la + lb] = '\0';
+    return t;
+  }
+  char *t = allocate(strings, ROPE, la + lb, sizeof(struct rope));
+  struct rope *r = (struct rope*)t;
+  r->left = a;
+  r->right = b;
+  r->flat = NULL;
+  return t;
+}
+
+bool vm_string_equal(struct string_arena *strings, char *a, char *b) {
+  REQUIRES(a != NULL && b != NULL);
+  if (a == b) return true;
+  struct header *ha = header_of(strings, a);
+  struct header *hb = header_of(strings, b);
+  if (ha != NULL && hb != NULL && ha->kind == (STRING_MAGIC | INTERNED)
+      && hb->kind == (STRING_MAGIC | INTERNED))
+    return false;
+  int32_t length = vm_string_length(strings, a);
+  if (vm_string_length(strings, b) != length) return false;
+  return memcmp(vm_string_flatten(strings, a), vm_string_flatten(strings, b),
+                (size_t)length) == 0;
+}
+
+struct string_arena *vm_strings_new(void) {
+  return xcalloc(1, sizeof(struct string_arena));
+}
+
+/*** Snapshots ***/
+
+bool vm_strings_save(struct string_arena *strings, FILE *f) {
+  bool ok = snapshot_put_word(f, strings->chunk_count);
+  for (size_t i = 0; ok && i < strings->chunk_count; i++) {
+    struct range *c = &strings->chunks[i];
+    ok = snapshot_put_word(f, c->start)
+      && snapshot_put_word(f, c->end - c->start)
+      && snapshot_put_pages(f, (unsigned char*)c->start,
+                            whole_pages(c->end - c->start));
+  }
+  ok = ok && snapshot_put_word(f, (uintptr_t)strings->bump)
+    && snapshot_put_word(f, (uintptr_t)strings->limit)
+    && snapshot_put_word(f, strings->table_count);
+  for (size_t i = 0; ok && i < strings->table_cap; i++)
+    if (strings->table[i] != NULL)
+      ok = snapshot_put_word(f, (uintptr_t)strings->table[i]);
+  return ok;
+}
+
+bool vm_strings_restore(struct string_arena *strings, FILE *f) {
+  REQUIRES(strings->chunk_count == 0 && strings->table_count == 0);
+  uint64_t chunks, bump, limit, interned;
+  bool ok = snapshot_get_word(f, &chunks);
+  for (uint64_t i = 0; ok && i < chunks; i++) {
+    uint64_t start, bytes;
+    ok = snapshot_get_word(f, &start) && snapshot_get_word(f, &bytes)
+      && bytes > 0 && bytes <= SIZE_MAX / 2;
+    unsigned char *p = NULL;
+    if (ok) ok = (p = snapshot_map((uintptr_t)start,
+                                   whole_pages((size_t)bytes))) != NULL;
+    if (!ok) break;
+    add_chunk(strings, p, (size_t)bytes);
+    ok = snapshot_get_pages(f, p, whole_pages((size_t)bytes));
+  }
+  ok = ok && snapshot_get_word(f, &bump) && snapshot_get_word(f, &limit)
+    && snapshot_get_word(f, &interned);
+  if (ok) {
+    strings->bump = (unsigned char*)(uintptr_t)bump;
+    strings->limit = (unsigned char*)(uintptr_t)limit;
+  }
+  for (uint64_t i = 0; ok && i < interned; i++) {
+    uint64_t s;
+    ok = snapshot_get_word(f, &s)
+      && header_of(strings, (char*)(uintptr_t)s) != NULL;
+    if (!ok) break;
+    table_reserve(strings);
+    table_insert(strings, (char*)(uintptr_t)s);
+  }
+  return ok;
+}
+
+void vm_strings_free(struct string_arena *strings) {
+  for (size_t i = 0; i < strings->chunk_count; i++)
+    unmap_chunk(&strings->chunks[i]);
+  free(strings->chunks);
+  free(strings->table);
+  free(strings);
+}
@@ -0,0 +1,61 @@
+/* C0VM strings
+ * 15-122 Principles of Imperative Computation
+ *
+ * Strings the VM makes itself: the constants of the string pool, each
+ * interned once when the program is loaded, and the results of
+ * string_join.  Each has a header in front of it with its length, so
+ * string_length takes constant time on them, and interned strings are
+ * equal exactly when they are the same pointer.
+ *
+ * A long join is not copied but kept as a rope of its two halves until
+ * something needs its characters, and then flattened once, so building
+ * a string up with string_join in a loop takes linear time.  Any other
+ * string the VM makes is an ordinary NUL-terminated char array; only
+ * ropes need vm_string_flatten before they are given to a native.
+ * Strings from natives can be passed to all of these as well.
+ *
+ * Each VM context has an arena of its own, and only its strings are
+ * recognized as the VM's by the functions below.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _STRINGS_H_
+#define _STRINGS_H_
+
+struct string_arena;
+
+/* A new arena, with no strings in it */
+struct string_arena *vm_strings_new(void);
+
+/* The one interned copy of s */
+char *vm_string_intern(struct string_arena *A, const char *s);
+
+/* s if it is not a rope, else its characters as a flat string */
+char *vm_string_flatten(struct string_arena *A, char *s);
+
+/* A flat copy of s, made in the arena */
+char *vm_string_copy(struct string_arena *A, const char *s);
+
+/* The length of s if the arena made it, without looking at its
+ * characters, or -1 if it did not (a string from a native, say) */
+int32_t vm_string_known_length(struct string_arena *A, char *s);
+
+/* These take strings that are not NULL */
+int32_t vm_string_length(struct string_arena *A, char *s);
+char *vm_string_join(struct string_arena *A, char *a, char *b);
+bool vm_string_equal(struct string_arena *A, char *a, char *b);
+
+/* Write the arena to a snapshot (see snapshot.h), or read it back
+ * into one that is still empty.  After a failed restore, the arena
+ * can only be freed. */
+bool vm_strings_save(struct string_arena *A, FILE *f);
+bool vm_strings_restore(struct string_arena *A, FILE *f);
+
+/* Give back the arena and every string made in it; none may be used
+ * after */
+void vm_strings_free(struct string_arena *A);
+
+#endif /* _STRINGS_H_ */
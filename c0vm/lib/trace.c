@@ -0,0 +1,214 @@
+/* C0VM instruction tracer
+ * 15-122 Principles of Imperative Computation
+ *
+ * Rings are dumped from signal handlers, so entries are formatted by
+ * hand into a buffer and written with write(2), not stdio.
+ */
+
+#define _POSIX_C_SOURCE 200809L  /* sigaction, sched_yield */
+
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_instr.h"
+#include "trace.h"
+
+/* Rings that are dumped on a signal or at exit; a ring beyond the
+ * first TRACE_LIVE at once is still recorded, but only dumped by the
+ * VM itself */
+#define TRACE_LIVE 64
+
+static struct trace *live[TRACE_LIVE];
+
+/* Dumps of live rings under way, counted before a dump looks in live;
+ * trace_free waits for them, as one may have picked up its ring */
+static int dumping = 0;
+
+/* The handlers for the fatal signals from before ours */
+static struct sigaction old_abrt, old_segv, old_fpe;
+
+/*** Formatting ***/
+
+static size_t put_str(char *buf, size_t n, const char *s) {
+  while (*s != '\0') buf[n++] = *s++;
+  return n;
+}
+
+static size_t put_uint(char *buf, size_t n, uint64_t x, unsigned base) {
+  char digits[20];
+  size_t k = 0;
+  do {
+    digits[k++] = "0123456789abcdef"[x % base];
+    x /= base;
+  } while (x != 0);
+  while (k > 0) buf[n++] = digits[--k];
+  return n;
+}
+
+static size_t put_value(char *buf, size_t n, c0_value v) {
+  if (val_is_int(v)) {
+    int32_t i = val2int_unchecked(v);
+    if (i < 0) buf[n++] = '-';
+    return put_uint(buf, n, i < 0 ? -(uint64_t)i : (uint64_t)i, 10);
+  }
+  void *p = val2ptr_unchecked(v);
+  if (p == NULL) return put_str(buf, n, "NULL");
+  n = put_str(buf, n, "0x");
+  return put_uint(buf, n, (uintptr_t)p, 16);
+}
+
+// One line, "  <fn>:<pc> <opcode> <top>", as --snapshot takes <fn>:<pc>
+static size_t format_entry(char buf[96], const struct trace_entry *e) {
+  size_t n = put_str(buf, 0, "  ");
+  n = put_uint(buf, n, e->fn, 10);
+  buf[n++] = ':';
+  n = put_uint(buf, n, e->pc, 10);
+  buf[n++] = ' ';
+  const char *name = instr_name(e->op);
+  size_t start = n;
+  if (name != NULL) n = put_str(buf, n, name);
+  else n = put_uint(buf, put_str(buf, n, "0x"), e->op, 16);
+  do buf[n++] = ' '; while (n < start + 14);
+  n = put_value(buf, n, e->top);
+  buf[n++] = '\n';
+  return n;
+}
+
+static size_t format_header(char buf[96], uint64_t shown, uint64_t count) {
+  size_t n = put_str(buf, 0, "C0VM trace: the last ");
+  n = put_uint(buf, n, shown, 10);
+  n = put_str(buf, n, " of ");
+  n = put_uint(buf, n, count, 10);
+  n = put_str(buf, n, " steps, oldest first\n");
+  return n;
+}
+
+// Every line of the dump in turn, to out, which returns false to stop
+static void dump(struct trace *t, bool (*out)(void *where, char *buf,
+                                                size_t n), void *where) {
+  char buf[96];
+  uint64_t count = __atomic_load_n(&t->count, __ATOMIC_ACQUIRE);
+  uint64_t shown = count < t->mask + 1 ? count : t->mask + 1;
+  if (!out(where, buf, format_header(buf, shown, count))) return;
+  for (uint64_t i = count - shown; i < count; i++) {
+    struct trace_entry e = t->ring[i & t->mask];
+    if (!out(where, buf, format_entry(buf, &e))) return;
+  }
+}
+
+static bool out_fd(void *where, char *buf, size_t n) {
+  int fd = *(int*)where;
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w <= 0) return false;
+    buf += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static bool out_file(void *where, char *buf, size_t n) {
+  return fwrite(buf, 1, n, (FILE*)where) == n;
+}
+
+void trace_print(struct trace *t, FILE *f) {
+  REQUIRES(t != NULL && f != NULL);
+  dump(t, out_file, f);
+  fflush(f);
+}
+
+/*** Dumping on signals and at exit ***/
+
+static void dump_live(bool forget) {
+  int fd = STDERR_FILENO;
+  __atomic_add_fetch(&dumping, 1, __ATOMIC_SEQ_CST);
+  for (size_t i = 0; i < TRACE_LIVE; i++) {
+    struct trace *t = forget
+      ? __atomic_exchange_n(&live[i], NULL, __ATOMIC_SEQ_CST)
+      : __atomic_load_n(&live[i], __ATOMIC_SEQ_CST);
+    if (t != NULL) dump(t, out_fd, &fd);
+  }
+  __atomic_sub_fetch(&dumping, 1, __ATOMIC_SEQ_CST);
+}
+
+static void trace_usr1(int sig) {
+  (void)sig;
+  dump_live(false);
+}
+
+// The VM raises these itself for failed assertions, memory and
+// arithmetic errors; the handler from before ours gets the signal next.
+static void trace_fatal(int sig) {
+  dump_live(true);
+  sigaction(sig, sig == SIGABRT ? &old_abrt
+            : sig == SIGSEGV ? &old_segv : &old_fpe, NULL);
+  raise(sig);
+}
+
+// Registered with atexit, for error() and natives that exit
+static void trace_exit(void) {
+  fflush(stderr);
+  dump_live(true);
+}
+
+static void install_handlers(void) {
+  static bool installed = false;
+  if (__atomic_exchange_n(&installed, true, __ATOMIC_ACQ_REL)) return;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = trace_usr1;
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = trace_fatal;
+  sigaction(SIGABRT, &sa, &old_abrt);
+  sigaction(SIGSEGV, &sa, &old_segv);
+  sigaction(SIGFPE, &sa, &old_fpe);
+  atexit(trace_exit);
+}
+
+/*** Rings ***/
+
+struct trace *trace_new(size_t size) {
+  REQUIRES(size > 0);
+  size_t entries = 1;
+  while (entries < size) entries *= 2;
+
+  struct trace *t = xmalloc(sizeof(struct trace));
+  t->ring = xcalloc(entries, sizeof(struct trace_entry));
+  t->mask = entries - 1;
+  t->count = 0;
+
+  install_handlers();
+  for (size_t i = 0; i < TRACE_LIVE; i++) {
+    struct trace *none = NULL;
+    if (__atomic_compare_exchange_n(&live[i], &none, t, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      break;
+  }
+  return t;
+}
+
+// Blocking SIGUSR1 here would not do: the handler may be running on
+// any other thread.  Once the ring is out of live, no dump that starts
+// can find it, and those under way are waited for.  A handler never
+// waits, so one that interrupts this thread finishes first.
+void trace_free(struct trace *t) {
+  REQUIRES(t != NULL);
+  for (size_t i = 0; i < TRACE_LIVE; i++) {
+    struct trace *mine = t;
+    __atomic_compare_exchange_n(&live[i], &mine, NULL, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  while (__atomic_load_n(&dumping, __ATOMIC_SEQ_CST) != 0) sched_yield();
+  free(t->ring);
+  free(t);
+}
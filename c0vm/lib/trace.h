@@ -0,0 +1,72 @@
+/* C0VM instruction tracer
+ * 15-122 Principles of Imperative Computation
+ *
+ * With $C0VM_TRACE set to a number of entries, the path a run takes is
+ * recorded in a ring that keeps the last that many steps.  A step is
+ * the start of a basic block: the function number, the pc and opcode
+ * of its first instruction, and the value on top of the operand stack
+ * just before that runs.  Blocks start at the top of a function, at
+ * jump targets, after conditional branches and after calls, so what
+ * runs from one step to the next is the code that follows the first,
+ * up to a jump or call.  Recording every instruction would cost
+ * several times as much.
+ *
+ * The ring is written to the error stream of the run when it ends,
+ * normally or with a runtime error, and to stderr when the process
+ * gets SIGUSR1, or ends some other way (error(), a signal) with a run
+ * under way.
+ *
+ * Only the VM's thread writes a ring, without locks: an entry is
+ * filled in before the count that makes it visible goes up, so a
+ * dump from a signal handler or another thread sees whole entries,
+ * except that the oldest may be overwritten while it is written out.
+ * A ring is not freed while a dump from a signal handler is under way,
+ * since that dump may have picked it up (see trace_free).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "c0vm.h"
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+struct trace_entry {
+  uint16_t fn;            /* index in the function pool */
+  uint16_t pc;
+  ubyte op;
+  c0_value top;           /* top of the operand stack, or int 0 */
+};
+
+struct trace {
+  struct trace_entry *ring;
+  size_t mask;            /* entries in ring, minus one */
+  uint64_t count;         /* steps ever recorded */
+};
+
+/* A ring of at least size entries (rounded up to a power of two),
+ * dumped if the process ends or gets SIGUSR1 before trace_free */
+struct trace *trace_new(size_t size);
+void trace_free(struct trace *t);
+
+/* The instruction op at pc of function fn is about to run, with
+ * operands from base to top (exclusive) */
+static inline void trace_record(struct trace *t, size_t fn, size_t pc,
+                                ubyte op, const c0_value *base,
+                                const c0_value *top) {
+  uint64_t count = t->count;
+  struct trace_entry *e = &t->ring[count & t->mask];
+  e->fn = (uint16_t)fn;
+  e->pc = (uint16_t)pc;
+  e->op = op;
+  if (top > base) e->top = top[-1];
+  else e->top = int2val(0);
+  __atomic_store_n(&t->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/* Write the entries in the ring, oldest first */
+void trace_print(struct trace *t, FILE *f);
+
+#endif /* _TRACE_H_ */
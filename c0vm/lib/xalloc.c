@@ -36,3 +36,16 @@ void* xmalloc(size_t size) {
   }
   return p;
 }
+
+/* xrealloc(p, size) returns a non-NULL pointer to the
+ * object at p resized to size size and exits if the
+ * allocation fails.  Like realloc, the contents are kept.
+ */
+void* xrealloc(void* p, size_t size) {
+  p = realloc(p, size);
+  if (p == NULL) {
+    fprintf(stderr, "allocation failed\n");
+    abort();
+  }
+  return p;
+}
@@ -24,4 +24,9 @@ void* xcalloc(size_t nobj, size_t size);
  */
 void* xmalloc(size_t size);
 
+/* xrealloc(p, size) resizes the object at p (which may be NULL)
+ * to size size, like realloc, and exits if the allocation fails.
+ */
+void* xrealloc(void* p, size_t size);
+
 #endif
@@ -14,6 +14,8 @@
 #include "lib/file_io.h"
 
 #include "encode.h"
+#include "packcode.h"
+#include "parallel.h"
 #include "compress.h"
 
 
@@ -25,6 +27,10 @@ bool v_verbose = false;
 void very_verbose_compress() {
   v_verbose = true;
 }
+size_t index_interval = 0;
+void index_compress(size_t interval) {
+  index_interval = interval;
+}
 
 
 /* Compressed file format:
@@ -37,33 +43,90 @@ uint8_t*                 - padded_letter_codes: concatenation of codes of the
                            symbols in use, padded to the next byte
 uint32_t                 - code_len: length of compressed code
 uint8_t[padded_code_len] - code: compressed code, padded to next byte
+
+With a seek index (compress with -i), the magic number is MAGIC_INDEXED
+and code_start is followed by
+uint32_t                 - src_len: length of the source
+uint32_t                 - interval: source bytes between index entries
+uint32_t[num_entries]    - offsets: bit in code where the code of source
+                           byte i*interval starts, for each i with
+                           i*interval < src_len
 */
 
-// Compress src to file fname (or STDOUT) using codetable table
-//   fname_size is the number of bytes written to fname
-void compress_src(codetable_t table, symbol_t *src, size_t src_len,
-                  char *fname, size_t *fname_size) {
-  FILE *stream = xfopen(fname, "w");
+// A seek index, as above
+struct seek_index {
+  uint32_t src_len;
+  uint32_t interval;
+  size_t num_entries;
+  uint32_t *offsets;
+};
 
-  if (c_verbose) {
-    printf("Compressing text using\n");
-    print_codetable(table);
+static size_t index_entries(size_t src_len, size_t interval) {
+  return src_len/interval + (src_len%interval == 0 ? 0 : 1);
+}
+
+// Bytes write_index writes for an index of num_entries entries
+static size_t index_size(size_t num_entries) {
+  return 2*sizeof(uint32_t) + num_entries*sizeof(uint32_t);
+}
+
+// Write an index of src for E, with an entry every interval bytes
+static void write_index(hencoder *E, symbol_t *src, size_t src_len,
+                        size_t interval, FILE *stream) {
+  uint32_t src_len32 = (uint32_t)src_len;
+  uint32_t interval32 = (uint32_t)interval;
+  fwrite(&src_len32, sizeof(uint32_t), 1, stream);
+  fwrite(&interval32, sizeof(uint32_t), 1, stream);
+  uint32_t offset = 0;
+  for (size_t i = 0; i < src_len; i += interval) {
+    fwrite(&offset, sizeof(uint32_t), 1, stream);
+    size_t len = src_len - i < interval ? src_len - i : interval;
+    offset += (uint32_t)encoded_length(E, src + i, len);
   }
-  // Magic number
-  uint32_t magic = MAGIC;
-  fwrite(&magic, sizeof(uint32_t), 1, stream);
+}
 
-  // Starting position of code segment
-  unsigned int num_symbols = codetable_size(table);  // may be NUM_SYMBOLS
-  size_t table_len = total_code_length(table);
-  uint16_t code_start = sizeof(uint8_t) // num_symbols
-        + num_symbols * sizeof(uint8_t) // letters
-        + num_symbols * sizeof(uint8_t) // code length of each letter
-        + num_padded_bytes(table_len) * sizeof(uint8_t); // letter codes
+static void bad_index(void) {
+  fprintf(stderr, "Bad seek index\n");
+  exit(1);
+}
 
-  fwrite(&code_start, sizeof(uint16_t), 1, stream);
+// Read the index written by write_index; its offsets are checked
+// against code_len once that is known
+static struct seek_index *read_index(FILE *code_stream) {
+  struct seek_index *X = xmalloc(sizeof(struct seek_index));
+  if (fread(&X->src_len, sizeof(uint32_t), 1, code_stream) != 1
+      || fread(&X->interval, sizeof(uint32_t), 1, code_stream) != 1
+      || X->interval == 0)
+    bad_index();
+  X->num_entries = index_entries(X->src_len, X->interval);
+  X->offsets = xcalloc(X->num_entries + 1, sizeof(uint32_t));
+  if (fread(X->offsets, sizeof(uint32_t), X->num_entries, code_stream)
+      != X->num_entries)
+    bad_index();
   if (v_verbose)
-    printf("Code segment starts at byte %u\n", code_start);
+    printf("Seek index of %zu entries, every %u bytes of %u\n",
+           X->num_entries, X->interval, X->src_len);
+  return X;
+}
+
+// Check the offsets of X, and make the code length the last of them
+static void check_index(struct seek_index *X, uint32_t code_len) {
+  X->offsets[X->num_entries] = code_len;
+  for (size_t i = 0; i < X->num_entries; i++)
+    if (X->offsets[i] > X->offsets[i+1] || (i == 0 && X->offsets[0] != 0))
+      bad_index();
+}
+
+static void seek_index_free(struct seek_index *X) {
+  free(X->offsets);
+  free(X);
+}
+
+// Write the symbols in use in table and their codes, from
+// num_symbols8 to padded_letter_codes above
+static void write_codes(codetable_t table, hencoder *E, FILE *stream) {
+  unsigned int num_symbols = codetable_size(table);  // may be NUM_SYMBOLS
+  size_t table_len = total_code_length(table);
 
   // Number of symbols in use
   uint8_t num_symbols8 = (uint8_t)num_symbols; // cast to byte
@@ -84,100 +147,42 @@ void compress_src(codetable_t table, symbol_t *src, size_t src_len,
       //if (v_verbose) printf("  #  Code of '%c' (0x%02X) -> %s (%u bits) \n", i, i, table[i], cl);
     }
 
-  // Code of each symbol in use
-  bit_t *letter_codes = xcalloc(table_len + 1, sizeof(bit_t));
-  uint8_t  c = 0;  // Character
-  uint16_t k = 0;  // Code
-  for (unsigned short i = 0; i < NUM_SYMBOLS; i++)  // Write letters
+  // Code of each symbol in use, which is how the symbols in use encode
+  symbol_t *letters = xcalloc(num_symbols, sizeof(symbol_t));
+  unsigned int c = 0;
+  for (unsigned short i = 0; i < NUM_SYMBOLS; i++)
     if (table[i] != NULL) { // character is in use
-      uint8_t cl = strlen(table[i]);
-      strcpy(letter_codes + k, table[i]);
-      c++;
-      k +=cl;
+      letters[c++] = (symbol_t)i;
       if (v_verbose)
         printf("  #  Code of '%c' (0x%02X) -> %s (%u bits) \n",
-               i, i, table[i], cl);
+               i, i, table[i], (unsigned int)strlen(table[i]));
     }
-  if (c_verbose) printf("==> Calling your pack ...               ");
-  uint8_t *padded_codes = pack(letter_codes);
-  if (c_verbose) printf("called!\n");
-  //if (v_verbose) printf("done packing %u bytes (%u bits)\n", num_padded_bytes(table_len), (unsigned int)table_len);
-  free(letter_codes);
+  size_t letter_codes_len;
+  uint8_t *padded_codes = encode_packed(E, letters, num_symbols,
+                                        &letter_codes_len);
+  ASSERT(letter_codes_len == table_len);
+  free(letters);
   fwrite(padded_codes, sizeof(uint8_t), num_padded_bytes(table_len), stream);
   free(padded_codes);
-
-  if (c_verbose) printf("==> Calling your encode_src ...         ");
-  bit_t *bits = encode_src(table, src, src_len);
-  if (c_verbose) printf("called!\n");
-  uint32_t bits_len = (uint32_t)strlen(bits);
-
-  // Source length
-  fwrite(&bits_len, sizeof(uint32_t), 1, stream);
-  // Source message
-  if (c_verbose) printf("==> Calling your pack ...               ");
-  uint8_t *padded_bits = pack(bits);
-  if (c_verbose) printf("called!\n");
-  free(bits);
-  fwrite(padded_bits, sizeof(uint8_t), num_padded_bytes(bits_len), stream);
-  free(padded_bits);
-
-  *fname_size = file_size(stream);
-  fclose(stream);
 }
 
-
-void compress(char *src_fname, char *code_fname) {
-  size_t src_len;
-  symbol_t *src = (symbol_t *)read_file_to_byte_array(src_fname, &src_len);
-
-  freqtable_t F = build_freqtable(src_fname);
-  if (c_verbose) printf("==> Calling your build_htree ...        ");
-  htree *H  = build_htree(F);
-  if (c_verbose) printf("called!\n");
-  if (c_verbose) printf("==> Calling your htree_to_codetable ... ");
-  codetable_t C = htree_to_codetable(H);
-  if (c_verbose) printf("called!\n");
-
-  size_t code_fname_size;
-  compress_src(C, src, src_len, code_fname, &code_fname_size);
-
-  freqtable_free(F);
-  htree_free(H);
-  codetable_free(C);
-  free(src);
-
-  printf("Deflated %s (%u bytes) into %s (%u bytes): %d%% compression ratio\n",
-         src_fname == NULL ? "STDOUT" : src_fname, (unsigned int)src_len,
-         code_fname, (unsigned int)code_fname_size,
-         (int)(100 - (100*code_fname_size)/src_len));
+// Bytes write_codes writes for table
+static size_t codes_size(codetable_t table) {
+  unsigned int num_symbols = codetable_size(table);
+  return sizeof(uint8_t) // num_symbols
+    + num_symbols * sizeof(uint8_t) // letters
+    + num_symbols * sizeof(uint8_t) // code length of each letter
+    + num_padded_bytes(total_code_length(table)) * sizeof(uint8_t); // letter codes
 }
 
-
-void uncompress(char *src_fname, char *code_fname) {
-  FILE *code_stream = xfopen(code_fname, "r");
-  size_t code_fname_size = file_size(code_stream);
-
-  // Read magic number
-  uint32_t magic;
-  fread(&magic, sizeof(uint32_t), 1, code_stream);
-  if (magic != MAGIC) {
-    fprintf(stderr, "Bad magic number %d\n", magic);
-    exit(1);
-  }
-
-  // Starting position of code segment
-  uint16_t code_start;
-  fread(&code_start, sizeof(uint16_t), 1, code_stream);
-  if (v_verbose)
-    printf("Code segment starts at byte %u\n", code_start);
-
+// Read the symbols in use and their codes written by write_codes
+static codetable_t read_codes(FILE *code_stream) {
   // Number of symbols in use
   uint8_t num_symbols8;
   fread(&num_symbols8, sizeof(uint8_t), 1, code_stream);
   unsigned int num_symbols = num_symbols8 == 0 ? NUM_SYMBOLS : num_symbols8;
   if (num_symbols == 1) {
-    printf("%s has a single symbol in its code table: that can't be!\n",
-           src_fname);
+    fprintf(stderr, "Code table has a single symbol: that can't be!\n");
     exit(1);
   }
   if (v_verbose) printf("%u letters in use, ", num_symbols);
@@ -193,13 +198,13 @@ void uncompress(char *src_fname, char *code_fname) {
   // Size of each symbol in use
   uint8_t *code_sizes = xcalloc(num_symbols, sizeof(uint8_t));
   fread(code_sizes, sizeof(uint8_t), num_symbols, code_stream);
-  uint16_t overall_code_size = 0;
+  unsigned int overall_code_size = 0;
   for (unsigned short i = 0; i < num_symbols; i++) {
     // if (v_verbose) printf("  # Code of '%c' (0x%02X) is %u bits\n", letters_in_use[i], letters_in_use[i], code_sizes[i]);
     overall_code_size += code_sizes[i];
   }
   // Code of each symbol in use
-  uint16_t padded_overall_code_size = code_start - 1 - 2*num_symbols;
+  uint16_t padded_overall_code_size = num_padded_bytes(overall_code_size);
   uint8_t *padded_letter_codes = xcalloc(padded_overall_code_size, sizeof(uint8_t));
   fread(padded_letter_codes, sizeof(uint8_t), padded_overall_code_size, code_stream);
 
@@ -223,33 +228,534 @@ void uncompress(char *src_fname, char *code_fname) {
     printf("Retrieved the following code table:\n");
     print_codetable(table);
   }
+  return table;
+}
+
+// Compress src to file fname (or STDOUT) using codetable table
+//   fname_size is the number of bytes written to fname
+void compress_src(codetable_t table, symbol_t *src, size_t src_len,
+                  char *fname, size_t *fname_size) {
+  FILE *stream = xfopen(fname, "w");
+
+  if (c_verbose) {
+    printf("Compressing text using\n");
+    print_codetable(table);
+  }
+  if (index_interval > 0 && src_len > UINT32_MAX) {
+    fprintf(stderr, "Source of %zu bytes is too long for a seek index\n",
+            src_len);
+    exit(1);
+  }
+  // Magic number
+  uint32_t magic = index_interval > 0 ? MAGIC_INDEXED : MAGIC;
+  fwrite(&magic, sizeof(uint32_t), 1, stream);
+
+  // Starting position of code segment
+  uint16_t code_start = codes_size(table);
+
+  fwrite(&code_start, sizeof(uint16_t), 1, stream);
+  if (v_verbose)
+    printf("Code segment starts at byte %u\n", code_start);
+
+  hencoder *E = hencoder_new(table);
+  size_t index_len = 0;
+  if (index_interval > 0) {
+    write_index(E, src, src_len, index_interval, stream);
+    index_len = index_size(index_entries(src_len, index_interval));
+  }
+  write_codes(table, E, stream);
+
+  size_t code_len;
+  uint8_t *padded_bits = encode_packed(E, src, src_len, &code_len);
+  hencoder_free(E);
+  if (code_len > UINT32_MAX) {
+    fprintf(stderr, "Code of %zu bits is too long for a .hip file\n",
+            code_len);
+    exit(1);
+  }
+  uint32_t bits_len = (uint32_t)code_len;
+
+  // Source length
+  fwrite(&bits_len, sizeof(uint32_t), 1, stream);
+  // Source message
+  fwrite(padded_bits, sizeof(uint8_t), num_padded_bytes(bits_len), stream);
+  free(padded_bits);
+
+  *fname_size = sizeof(uint32_t) + sizeof(uint16_t) + index_len
+    + code_start + sizeof(uint32_t) + num_padded_bytes(bits_len);
+  if (fname != NULL) fclose(stream);
+  else fflush(stream);
+}
+
+
+void compress(char *src_fname, char *code_fname) {
+  size_t src_len;
+  symbol_t *src = (symbol_t *)read_file_to_byte_array(src_fname, &src_len);
+
+  freqtable_t F = xcalloc(NUM_SYMBOLS, sizeof(unsigned int));
+  count_frequencies(F, src, src_len);
+  if (c_verbose) printf("==> Calling your build_htree ...        ");
+  htree *H  = build_htree(F);
+  if (c_verbose) printf("called!\n");
+  if (c_verbose) printf("==> Calling your htree_to_codetable ... ");
+  codetable_t C = htree_to_codetable(H);
+  if (c_verbose) printf("called!\n");
+
+  size_t code_fname_size;
+  compress_src(C, src, src_len, code_fname, &code_fname_size);
+
+  freqtable_free(F);
+  htree_free(H);
+  codetable_free(C);
+  free(src);
+
+  // The code may be going down a pipe on STDOUT
+  fprintf(code_fname == NULL ? stderr : stdout,
+          "Deflated %s (%u bytes) into %s (%u bytes): %d%% compression ratio\n",
+          src_fname == NULL ? "STDIN" : src_fname, (unsigned int)src_len,
+          code_fname == NULL ? "STDOUT" : code_fname,
+          (unsigned int)code_fname_size,
+          (int)(100 - (100*code_fname_size)/src_len));
+}
+
+
+/* Compressed file format in blocks:
+uint32_t                 - magic: MAGIC_BLOCKS
+uint32_t                 - block_size: most source bytes in a block
+then for each block:
+uint32_t                 - src_len: source bytes in the block, 0 after the
+                           last block
+uint8_t                  - new_codes: 1 if the block has its own code table,
+                           0 if it uses the one of the block before
+num_symbols8 to padded_letter_codes as above, if new_codes is 1
+uint32_t                 - code_len: length of the block's code
+uint8_t[padded_code_len] - code: the block's code, padded to next byte
+
+No block's code is longer than its source, so the lengths in front of
+each block are an index of the stream: blocks are read one after the
+other without decoding them, and decoded in parallel.
+*/
+
+// A code table, and its integer codes
+struct codes {
+  codetable_t table;
+  hencoder *E;
+};
+
+// Code table for frequencies F, of at least one symbol
+static struct codes *codes_new(freqtable_t F) {
+  // Huffman codes need two symbols; a single symbol gets a bogus second
+  // one, and a code of a bit
+  unsigned int n = 0;
+  symbol_t some = 0;
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++)
+    if (F[c] != 0) {
+      n++;
+      some = (symbol_t)c;
+    }
+  ASSERT(n > 0);
+  if (n == 1) F[some ^ 1] = 1;
+  htree *H = build_htree(F);
+  struct codes *K = xmalloc(sizeof(struct codes));
+  K->table = htree_to_codetable(H);
+  K->E = hencoder_new(K->table);
+  htree_free(H);
+  return K;
+}
+
+static void codes_free(struct codes *K) {
+  codetable_free(K->table);
+  hencoder_free(K->E);
+  free(K);
+}
+
+/* Up to one block for each thread is read, coded in parallel, and
+ * written out in order */
+struct block {
+  symbol_t *src;
+  size_t src_len;
+  uint8_t *code;          // room for block_size bytes
+  size_t code_len;
+  unsigned int freq[NUM_SYMBOLS];
+  size_t batch_bits;      // bits of code with the batch's own table
+  size_t shared_bits;     // with the table of the batch before
+  struct codes *codes;    // what the block is compressed with
+  hdecoder *D;            // what the block is uncompressed with
+  bool ok;
+};
+
+struct batch {
+  struct block *blocks;
+  size_t count;           // blocks in use
+  hencoder *batch_E;
+  hencoder *shared_E;     // or NULL
+};
+
+static void count_job(void *env, size_t i) {
+  struct block *b = &((struct batch*)env)->blocks[i];
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++) b->freq[c] = 0;
+  count_frequencies(b->freq, b->src, b->src_len);
+}
+
+static void cost_job(void *env, size_t i) {
+  struct batch *batch = env;
+  struct block *b = &batch->blocks[i];
+  b->batch_bits = encoded_length(batch->batch_E, b->src, b->src_len);
+  b->shared_bits = batch->shared_E == NULL ? SIZE_MAX
+    : encoded_length(batch->shared_E, b->src, b->src_len);
+}
+
+static void encode_job(void *env, size_t i) {
+  struct block *b = &((struct batch*)env)->blocks[i];
+  b->code_len = encode_into(b->codes->E, b->src, b->src_len, b->code);
+}
+
+static void decode_job(void *env, size_t i) {
+  struct block *b = &((struct batch*)env)->blocks[i];
+  b->ok = decode_into(b->D, b->code, b->code_len, b->src, b->src_len)
+    == b->src_len;
+}
+
+static struct batch *batch_new(unsigned int threads, size_t block_size) {
+  struct batch *batch = xcalloc(1, sizeof(struct batch));
+  batch->blocks = xcalloc(threads, sizeof(struct block));
+  for (unsigned int i = 0; i < threads; i++) {
+    batch->blocks[i].src = xcalloc(block_size, sizeof(symbol_t));
+    batch->blocks[i].code = xcalloc(block_size, sizeof(uint8_t));
+  }
+  return batch;
+}
+
+static void batch_free(struct batch *batch, unsigned int threads) {
+  for (unsigned int i = 0; i < threads; i++) {
+    free(batch->blocks[i].src);
+    free(batch->blocks[i].code);
+  }
+  free(batch->blocks);
+  free(batch);
+}
+
+// Choose the codes for each block of batch, given the codes of the
+// batch before (or NULL), returning the batch's own codes if any
+// block uses them
+static struct codes *choose_codes(struct batch *batch, struct codes *shared,
+                                  unsigned int threads) {
+  // The batch's own table is built from the frequencies of all of it
+  parallel_for(threads, batch->count, count_job, batch);
+  freqtable_t F = xcalloc(NUM_SYMBOLS, sizeof(unsigned int));
+  for (size_t i = 0; i < batch->count; i++)
+    for (unsigned short c = 0; c < NUM_SYMBOLS; c++)
+      F[c] += batch->blocks[i].freq[c];
+  struct codes *own = codes_new(F);
+  freqtable_free(F);
+
+  // Keep the table of the batch before if that makes a shorter batch
+  batch->batch_E = own->E;
+  batch->shared_E = shared == NULL ? NULL : shared->E;
+  parallel_for(threads, batch->count, cost_job, batch);
+  size_t own_len = 8*codes_size(own->table);
+  size_t shared_len = 0;
+  for (size_t i = 0; i < batch->count; i++) {
+    own_len += batch->blocks[i].batch_bits;
+    if (batch->blocks[i].shared_bits == SIZE_MAX) shared_len = SIZE_MAX;
+    if (shared_len != SIZE_MAX) shared_len += batch->blocks[i].shared_bits;
+  }
+  bool use_own = own_len < shared_len;
+
+  // A block whose code would come out longer than it gets a table
+  // of its own
+  bool own_used = false;
+  for (size_t i = 0; i < batch->count; i++) {
+    struct block *b = &batch->blocks[i];
+    size_t bits = use_own ? b->batch_bits : b->shared_bits;
+    if (bits <= 8*b->src_len) {
+      b->codes = use_own ? own : shared;
+      own_used = own_used || use_own;
+    } else {
+      b->codes = codes_new(b->freq);
+    }
+  }
+  if (!own_used) {
+    codes_free(own);
+    own = NULL;
+  }
+  return own;
+}
+
+void compress_blocks(char *src_fname, char *code_fname, size_t block_size,
+                     unsigned int threads) {
+  REQUIRES(0 < block_size && block_size <= MAX_BLOCK_SIZE);
+  REQUIRES(0 < threads && threads <= MAX_THREADS);
+  FILE *src_stream = xfopen(src_fname, "r");
+  FILE *code_stream = xfopen(code_fname, "w");
+
+  uint32_t magic = MAGIC_BLOCKS;
+  fwrite(&magic, sizeof(uint32_t), 1, code_stream);
+  uint32_t block_size32 = (uint32_t)block_size;
+  fwrite(&block_size32, sizeof(uint32_t), 1, code_stream);
+  size_t code_fname_size = 2*sizeof(uint32_t);
+
+  struct batch *batch = batch_new(threads, block_size);
+  struct codes *shared = NULL;  // codes of the last block written
+  size_t total_src_len = 0;
+  unsigned int num_blocks = 0;
+
+  while (true) {
+    batch->count = 0;
+    while (batch->count < threads) {
+      struct block *b = &batch->blocks[batch->count];
+      b->src_len = fread(b->src, sizeof(symbol_t), block_size, src_stream);
+      if (b->src_len == 0) break;
+      batch->count++;
+    }
+    if (batch->count == 0) break;
+
+    struct codes *own = choose_codes(batch, shared, threads);
+    parallel_for(threads, batch->count, encode_job, batch);
+
+    struct codes *last = shared;
+    for (size_t i = 0; i < batch->count; i++) {
+      struct block *b = &batch->blocks[i];
+      uint8_t new_codes = b->codes != last;
+      uint32_t src_len32 = (uint32_t)b->src_len;
+      uint32_t code_len = (uint32_t)b->code_len;
+      ASSERT(num_padded_bytes(code_len) <= block_size);
+      fwrite(&src_len32, sizeof(uint32_t), 1, code_stream);
+      fwrite(&new_codes, sizeof(uint8_t), 1, code_stream);
+      if (new_codes) write_codes(b->codes->table, b->codes->E, code_stream);
+      fwrite(&code_len, sizeof(uint32_t), 1, code_stream);
+      fwrite(b->code, sizeof(uint8_t), num_padded_bytes(code_len),
+             code_stream);
+
+      if (v_verbose)
+        printf("Block %u: %u bytes into %u bits, %s code table\n",
+               num_blocks, src_len32, code_len, new_codes ? "own" : "shared");
+      code_fname_size += 2*sizeof(uint32_t) + sizeof(uint8_t)
+        + (new_codes ? codes_size(b->codes->table) : 0)
+        + num_padded_bytes(code_len);
+      total_src_len += b->src_len;
+      num_blocks++;
+      last = b->codes;
+    }
+
+    // Only the codes of the last block carry on to the next batch
+    for (size_t i = 0; i < batch->count; i++) {
+      struct codes *K = batch->blocks[i].codes;
+      if (K != shared && K != own && K != last) codes_free(K);
+    }
+    if (shared != NULL && shared != last) codes_free(shared);
+    if (own != NULL && own != last) codes_free(own);
+    shared = last;
+    if (batch->count < threads) break;
+  }
+  if (ferror(src_stream)) {
+    perror(src_fname == NULL ? "STDIN" : src_fname);
+    exit(1);
+  }
+  uint32_t end = 0;
+  fwrite(&end, sizeof(uint32_t), 1, code_stream);
+  code_fname_size += sizeof(uint32_t);
+
+  if (shared != NULL) codes_free(shared);
+  batch_free(batch, threads);
+  if (src_fname != NULL) fclose(src_stream);
+  if (code_fname != NULL) fclose(code_stream);
+  else fflush(code_stream);
+
+  // The code may be going down a pipe on STDOUT
+  fprintf(code_fname == NULL ? stderr : stdout,
+          "Deflated %s (%zu bytes) in %u blocks into %s (%zu bytes): "
+          "%d%% compression ratio\n",
+          src_fname == NULL ? "STDIN" : src_fname, total_src_len, num_blocks,
+          code_fname == NULL ? "STDOUT" : code_fname, code_fname_size,
+          total_src_len == 0 ? 0
+          : (int)(100 - (100*code_fname_size)/total_src_len));
+}
+
+static void bad_block(unsigned int block) {
+  fprintf(stderr, "Block %u of the compressed file is corrupt\n", block);
+  exit(1);
+}
+
+// Uncompress the blocks of code_stream, past its magic number, into
+// src_fname (or STDOUT)
+static void uncompress_blocks(FILE *code_stream, char *src_fname,
+                              char *code_fname, unsigned int threads) {
+  uint32_t block_size;
+  if (fread(&block_size, sizeof(uint32_t), 1, code_stream) != 1
+      || block_size == 0 || block_size > MAX_BLOCK_SIZE)
+    bad_block(0);
+  FILE *src_stream = xfopen(src_fname, "w");
+  size_t code_fname_size = 2*sizeof(uint32_t);
+
+  struct batch *batch = batch_new(threads, block_size);
+  // Decoders made for a batch, after the one carried on from before
+  hdecoder **made = xcalloc(threads + 1, sizeof(hdecoder*));
+  size_t num_made = 0;
+  hdecoder *D = NULL;
+  size_t total_src_len = 0;
+  unsigned int num_blocks = 0;
+  bool end = false;
+
+  while (!end) {
+    batch->count = 0;
+    while (batch->count < threads) {
+      unsigned int block = num_blocks + batch->count;
+      struct block *b = &batch->blocks[batch->count];
+      uint32_t src_len;
+      if (fread(&src_len, sizeof(uint32_t), 1, code_stream) != 1)
+        bad_block(block);  // no end marker
+      code_fname_size += sizeof(uint32_t);
+      if (src_len == 0) {
+        end = true;
+        break;
+      }
+
+      uint8_t new_codes;
+      if (src_len > block_size
+          || fread(&new_codes, sizeof(uint8_t), 1, code_stream) != 1
+          || new_codes > 1 || (new_codes == 0 && D == NULL))
+        bad_block(block);
+      if (new_codes) {
+        codetable_t C = read_codes(code_stream);
+        D = hdecoder_new(C);
+        made[num_made++] = D;
+        code_fname_size += codes_size(C);
+        codetable_free(C);
+      }
+
+      uint32_t code_len;
+      if (fread(&code_len, sizeof(uint32_t), 1, code_stream) != 1
+          || num_padded_bytes(code_len) > block_size
+          || fread(b->code, sizeof(uint8_t), num_padded_bytes(code_len),
+                   code_stream) != num_padded_bytes(code_len))
+        bad_block(block);
+      b->src_len = src_len;
+      b->code_len = code_len;
+      b->D = D;
+      code_fname_size += sizeof(uint32_t) + sizeof(uint8_t)
+        + num_padded_bytes(code_len);
+      batch->count++;
+    }
+
+    parallel_for(threads, batch->count, decode_job, batch);
+    for (size_t i = 0; i < batch->count; i++) {
+      struct block *b = &batch->blocks[i];
+      if (!b->ok) bad_block(num_blocks);
+      fwrite(b->src, sizeof(symbol_t), b->src_len, src_stream);
+      if (v_verbose)
+        printf("Block %u: %u bits into %u bytes\n", num_blocks,
+               (unsigned int)b->code_len, (unsigned int)b->src_len);
+      total_src_len += b->src_len;
+      num_blocks++;
+    }
+
+    // Only the last decoder carries on to the next batch
+    for (size_t i = 0; i < num_made; i++)
+      if (made[i] != D) hdecoder_free(made[i]);
+    num_made = 0;
+    if (D != NULL) made[num_made++] = D;
+  }
+
+  if (D != NULL) hdecoder_free(D);
+  free(made);
+  batch_free(batch, threads);
+  if (code_fname != NULL) fclose(code_stream);
+  if (src_fname != NULL) fclose(src_stream);
+  else fflush(src_stream);
+
+  // The source may be going down a pipe on STDOUT
+  fprintf(src_fname == NULL ? stderr : stdout,
+          "Inflated %s (%zu bytes) in %u blocks into %s (%zu bytes): "
+          "%d%% compression ratio\n",
+          code_fname == NULL ? "STDIN" : code_fname, code_fname_size,
+          num_blocks, src_fname == NULL ? "STDOUT" : src_fname,
+          total_src_len, total_src_len == 0 ? 0
+          : (int)(100 - (100*code_fname_size)/total_src_len));
+}
+
+
+// Decoding the ranges of a seek index in parallel; a range whose code
+// does not end where the next one starts is reported after all are done
+struct ranges {
+  hdecoder *D;
+  uint8_t *code;
+  uint32_t code_len;
+  struct seek_index *X;
+  symbol_t *src;
+  bool *ok;      // for each range
+};
+
+static void range_job(void *env, size_t i) {
+  struct ranges *R = env;
+  struct seek_index *X = R->X;
+  size_t first = i * X->interval;
+  size_t count = X->src_len - first < X->interval
+    ? X->src_len - first : X->interval;
+  size_t stop = decode_range(R->D, R->code, R->code_len, X->offsets[i],
+                             R->src + first, count);
+  R->ok[i] = stop == X->offsets[i+1];
+}
+
+void uncompress(char *src_fname, char *code_fname, unsigned int threads) {
+  FILE *code_stream = xfopen(code_fname, "r");
+
+  // Read magic number
+  uint32_t magic;
+  fread(&magic, sizeof(uint32_t), 1, code_stream);
+  if (magic == MAGIC_BLOCKS) {
+    uncompress_blocks(code_stream, src_fname, code_fname, threads);
+    return;
+  }
+  if (magic != MAGIC && magic != MAGIC_INDEXED) {
+    fprintf(stderr, "Bad magic number %d\n", magic);
+    exit(1);
+  }
+
+  // Starting position of code segment
+  uint16_t code_start;
+  fread(&code_start, sizeof(uint16_t), 1, code_stream);
+  if (v_verbose)
+    printf("Code segment starts at byte %u\n", code_start);
+  struct seek_index *X = NULL;
+  if (magic == MAGIC_INDEXED) X = read_index(code_stream);
+
+  codetable_t table = read_codes(code_stream);
 
   // Code length
   uint32_t code_len;
   fread(&code_len, sizeof(uint32_t), 1, code_stream);
   if (v_verbose) printf("Code length is %u bit\n", code_len);
+  size_t code_fname_size = sizeof(uint32_t) + sizeof(uint16_t) + code_start
+    + sizeof(uint32_t) + num_padded_bytes(code_len)
+    + (X == NULL ? 0 : index_size(X->num_entries));
   // Code
   uint8_t *code = xcalloc(num_padded_bytes(code_len), sizeof(uint8_t));
   fread(code, sizeof(uint8_t), num_padded_bytes(code_len), code_stream);
-  fclose(code_stream);
-
-  if (c_verbose) printf("==> Calling your unpack ...             ");
-  bit_t *bits = unpack(code, num_padded_bytes(code_len));
-  //printf("code is %d", code[3]);
-  //printf("unpacked is %s ", bits);
-  if (c_verbose) printf("called!\n");
-  //  if (v_verbose) printf("Code is %u bits:\n%s\n", (unsigned int)strlen(bits), bits);
-  bits[code_len] = '\0';  // drops padding
-  free(code);
+  if (code_fname != NULL) fclose(code_stream);
 
-  htree *H = htree_from_codetable(table);
+  hdecoder *D = hdecoder_new(table);
 
   size_t src_len;
-  if (c_verbose) printf("==> Calling your decode_src ...         ");
-  symbol_t *src = decode_src(H, bits, &src_len);
-  if (c_verbose) printf("called!\n");
+  symbol_t *src;
+  if (X == NULL) {
+    src = decode_packed(D, code, code_len, &src_len);
+  } else {
+    // Each range of the index decodes straight into its place in src
+    check_index(X, code_len);
+    src_len = X->src_len;
+    src = xcalloc(src_len + 1, sizeof(symbol_t));
+    bool *ok = xcalloc(X->num_entries + 1, sizeof(bool));
+    struct ranges R = { D, code, code_len, X, src, ok };
+    parallel_for(threads, X->num_entries, range_job, &R);
+    for (size_t i = 0; i < X->num_entries; i++)
+      if (!ok[i]) bad_index();
+    free(ok);
+    seek_index_free(X);
+  }
   codetable_free(table);
-  htree_free(H);
+  hdecoder_free(D);
+  free(code);
 
   FILE *src_stream = xfopen(src_fname, "w");
   fwrite(src, sizeof(symbol_t), src_len, src_stream);
@@ -257,13 +763,78 @@ void uncompress(char *src_fname, char *code_fname) {
   free(src);
 
   if (c_verbose)
-    printf("\nDecoded %u bits into %u characters (%u bits)",
+    printf("\nDecoded %u bits into %u characters (%u bits)\n",
            (unsigned int)code_len, (unsigned int)src_len, (unsigned int)(8*src_len));
 
-  free(bits);
-  if (src_fname == NULL) printf("\n"); // Add newline if printing to terminal
-  printf("Inflated %s (%u bytes) into %s (%u bytes): %d%% compression ratio\n",
-         code_fname, (unsigned int)code_fname_size,
-         src_fname == NULL ? "STDOUT" : src_fname, (unsigned int)src_len,
-         (int)(100 - (100*code_fname_size)/src_len));
+  // The source may be going down a pipe on STDOUT
+  fprintf(src_fname == NULL ? stderr : stdout,
+          "Inflated %s (%u bytes) into %s (%u bytes): %d%% compression ratio\n",
+          code_fname == NULL ? "STDIN" : code_fname,
+          (unsigned int)code_fname_size,
+          src_fname == NULL ? "STDOUT" : src_fname, (unsigned int)src_len,
+          src_len == 0 ? 0 : (int)(100 - (100*code_fname_size)/src_len));
+}
+
+
+void uncompress_range(char *src_fname, char *code_fname,
+                      size_t first, size_t len) {
+  FILE *code_stream = xfopen(code_fname, "r");
+
+  uint32_t magic;
+  fread(&magic, sizeof(uint32_t), 1, code_stream);
+  if (magic != MAGIC_INDEXED) {
+    fprintf(stderr, "%s has no seek index: compress it with -i\n",
+            code_fname == NULL ? "STDIN" : code_fname);
+    exit(1);
+  }
+  uint16_t code_start;
+  fread(&code_start, sizeof(uint16_t), 1, code_stream);
+  struct seek_index *X = read_index(code_stream);
+  codetable_t table = read_codes(code_stream);
+  uint32_t code_len;
+  fread(&code_len, sizeof(uint32_t), 1, code_stream);
+  check_index(X, code_len);
+
+  if (first > X->src_len) first = X->src_len;
+  if (len > X->src_len - first) len = X->src_len - first;
+  FILE *src_stream = xfopen(src_fname, "w");
+  if (len > 0) {
+    // Only the code of the index entries the range overlaps is read
+    size_t e0 = first / X->interval;
+    size_t e1 = (first + len - 1) / X->interval + 1;
+    size_t start = X->offsets[e0], end = X->offsets[e1];
+    size_t skip = start/8;
+    size_t num_bytes = num_padded_bytes(end) - skip;
+    if (fseek(code_stream, (long)skip, SEEK_CUR) != 0)
+      for (size_t i = 0; i < skip; i++) fgetc(code_stream);  // a pipe
+    uint8_t *code = xcalloc(num_bytes + 1, sizeof(uint8_t));
+    if (fread(code, sizeof(uint8_t), num_bytes, code_stream) != num_bytes) {
+      fprintf(stderr, "Code ends early\n");
+      exit(1);
+    }
+
+    size_t src_first = e0 * X->interval;
+    size_t src_end = e1 * X->interval < X->src_len
+      ? e1 * X->interval : X->src_len;
+    symbol_t *src = xcalloc(src_end - src_first, sizeof(symbol_t));
+    hdecoder *D = hdecoder_new(table);
+    if (decode_range(D, code, end - 8*skip, start - 8*skip, src,
+                     src_end - src_first) != end - 8*skip)
+      bad_index();
+    hdecoder_free(D);
+    free(code);
+
+    fwrite(src + (first - src_first), sizeof(symbol_t), len, src_stream);
+    free(src);
+  }
+  if (src_fname != NULL) fclose(src_stream);
+  else fflush(src_stream);
+  if (code_fname != NULL) fclose(code_stream);
+  codetable_free(table);
+  seek_index_free(X);
+
+  fprintf(src_fname == NULL ? stderr : stdout,
+          "Extracted bytes %zu to %zu of %s into %s\n", first, first + len,
+          code_fname == NULL ? "STDIN" : code_fname,
+          src_fname == NULL ? "STDOUT" : src_fname);
 }
@@ -14,9 +14,18 @@
 // Set verbose flag
 void verbose_compress();
 void very_verbose_compress();
+// Give compressed files a seek index, with an entry every interval
+// bytes of source (0 for none)
+void index_compress(size_t interval);
 
-// Magic number for compressed files
+// Magic numbers for compressed files, in one piece, in blocks, or in
+// one piece with a seek index
 #define MAGIC 0xC0DEBEAD
+#define MAGIC_BLOCKS 0xC0DEB10C
+#define MAGIC_INDEXED 0xC0DEB1DE
+
+// Largest block, so that the code of a block fits a 32-bit bit count
+#define MAX_BLOCK_SIZE (256*1024*1024)
 
 // Compress src to file fname (or STDOUT) using codetable table
 //   fname_size is the number of bytes written to fname
@@ -26,7 +35,18 @@ void compress_text(codetable_t table, symbol_t *src, size_t src_len,
 // Compress src_fname (or STDIN) to code_fname (or STDOUT)
 void compress(char *src_fname, char *code_fname);
 
-// Uncompress code_fname (or STDIN) into src_fname (or STDOUT)
-void uncompress(char *src_fname, char *code_fname);
+// Compress src_fname (or STDIN) to code_fname (or STDOUT) a block of
+// block_size bytes at a time, coding up to threads blocks at once
+void compress_blocks(char *src_fname, char *code_fname, size_t block_size,
+                     unsigned int threads);
+
+// Uncompress code_fname (or STDIN) into src_fname (or STDOUT), in one
+// piece or a block at a time, decoding up to threads blocks at once
+void uncompress(char *src_fname, char *code_fname, unsigned int threads);
+
+// Uncompress len bytes from byte first on of code_fname (or STDIN), which
+// has a seek index, into src_fname (or STDOUT)
+void uncompress_range(char *src_fname, char *code_fname,
+                      size_t first, size_t len);
 
 #endif /* _COMPRESS_H_ */
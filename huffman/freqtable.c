@@ -29,6 +29,15 @@ bool is_freqtable(freqtable_t table)
 // freqtable_t build_freqtable(char *fname);
 
 
+// Add the occurrences of each symbol in src to table
+void count_frequencies(freqtable_t table, symbol_t *src, size_t src_len) {
+  REQUIRES(is_freqtable(table));
+  REQUIRES(src != NULL || src_len == 0);
+  for (size_t i = 0; i < src_len; i++)
+    table[src[i]]++;
+}
+
+
 // Read frequency table from frequency file (or STDIN)
 freqtable_t read_freqtable(char *fname) {
   unsigned int max_line_length = 20;  // Longest expected line
@@ -4,6 +4,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef _FREQTABLE_H_
 #define _FREQTABLE_H_
@@ -21,6 +22,9 @@ bool is_freqtable(freqtable_t table);
 // Build a frequency table from a source file
 freqtable_t build_freqtable(char *fname);
 
+// Add the occurrences of each symbol in src to table
+void count_frequencies(freqtable_t table, symbol_t *src, size_t src_len);
+
 // Read frequency table from frequency file
 freqtable_t read_freqtable(char *fname);
 
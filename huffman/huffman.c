@@ -435,7 +435,6 @@ uint8_t* pack(bit_t *bits) {
     index++;
   }
   // Check if last byte needs to be padded with 0s.
-  printf("what %d\n", (int)index);
   if (index != 0) {
     while (index < 8) {
       temp[index] = '0';
@@ -446,7 +445,6 @@ uint8_t* pack(bit_t *bits) {
   }
   // Free temporary string.
   free(temp);
-  printf("res is %d, %d, %d,", (int)result[0], (int)result[length-2], (int)result[length-1]);
   return result;
 }
 
@@ -467,7 +465,7 @@ bit_t* unpack(uint8_t *c, size_t len) {
   REQUIRES(c != NULL);
 
   // Initalize variables.
-  temp = xcalloc(8, sizeof(char));
+  char *temp = xcalloc(8, sizeof(char));
   ASSERT(temp != NULL);
 
   size_t length = 8 * len + 1; 
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "file_io.h"
 #include "xalloc.h"
@@ -26,38 +27,50 @@ FILE* xfopen (char *fname, char *mode) {
 }
 
 
-// returns the number of bytes in a file (or MAX_STDIN)
+// returns the number of bytes in a file (or 0 for a pipe or terminal)
 size_t file_size(FILE *F) {
-  if (F == stdin) return MAX_STDIN_LEN;
-
-  fseek(F, 0L, SEEK_END);
-  unsigned size = ftell(F);
-  rewind(F);
-  return size;
+  long pos = ftell(F);
+  if (pos < 0 || fseek(F, 0L, SEEK_END) != 0) return 0;
+  long size = ftell(F);
+  fseek(F, pos, SEEK_SET);
+  return size < 0 ? 0 : (size_t)size;
 }
 
 
+// Reads all of stream into an array with room for extra more bytes
+// after them, reporting number of bytes read in *size
+static byte_t* read_all(FILE *stream, size_t extra, size_t *size) {
+  size_t limit = file_size(stream);  // exact, unless stream is a pipe
+  if (limit == 0) limit = 4096;
+  byte_t *bytes = xcalloc(limit + extra, sizeof(byte_t));
+  size_t n = 0;
+  while (true) {
+    n += fread(bytes + n, sizeof(byte_t), limit - n, stream);
+    if (n < limit) break;
+    int c = fgetc(stream);  // full: is there more?
+    if (c == EOF) break;
+    byte_t *more = xcalloc(2*limit + extra, sizeof(byte_t));
+    memcpy(more, bytes, n);
+    free(bytes);
+    bytes = more;
+    limit *= 2;
+    bytes[n++] = (byte_t)c;
+  }
+  *size = n;
+  return bytes;
+}
+
 byte_t* read_file_to_byte_array(char *fname, size_t *size) {
   FILE *stream = xfopen(fname, "r");
-  *size = file_size(stream);
-  byte_t* bytes = xcalloc(*size, sizeof(byte_t));
-  fread(bytes, sizeof(byte_t), *size, stream);
+  byte_t* bytes = read_all(stream, 0, size);
   if (fname != NULL) fclose(stream);
   return bytes;
 }
 
 char* read_file_to_char_array(char *fname, size_t *size) {
   FILE *stream = xfopen(fname, "r");
-  *size = file_size(stream);
-  char* chars = xcalloc(*size + 1, sizeof(char));
-
-  unsigned n = 0;
-  int c;
-  while ((c = fgetc(stream)) != EOF) {
-    chars[n] = c;
-    n++;
-  }
-  chars[n] = '\0';
+  char* chars = (char*)read_all(stream, 1, size);
+  chars[*size] = '\0';
   if (fname != NULL) fclose(stream);
 
   strtok(chars, "\n");  // remove trailing new lines
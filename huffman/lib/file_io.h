@@ -9,13 +9,10 @@
 
 #include <stdint.h>
 
-
-#define MAX_STDIN_LEN 1000
-
 // open filename in given mode, exiting program in case of error
 FILE* xfopen(char *fname, char *mode);
 
-// returns the number of bytes in a file (or MAX_STDIN)
+// returns the number of bytes in a file (or 0 for a pipe or terminal)
 size_t file_size(FILE *F);
 
 
@@ -16,6 +16,7 @@
 #include "htree.h"
 #include "encode.h"
 #include "compress.h"
+#include "parallel.h"
 
 #define NOP 0
 #define ENCODE 1
@@ -30,7 +31,11 @@ void usage(char *prog_name, char option) {
       || option == 'h'
       || option == 'a'
       || option == 'f'
-      || option == 'r')
+      || option == 'r'
+      || option == 'b'
+      || option == 'j'
+      || option == 'i'
+      || option == 'x')
     fprintf(stderr, "Option -%c requires an argument.\n", option);
   else if (isprint(option) || option == 0) {
     if (option != 0) fprintf(stderr, "Unknown option `-%c'.\n", option);
@@ -62,6 +67,20 @@ void usage(char *prog_name, char option) {
     fprintf(stderr, "\t-C __or__ --compress\n");
     fprintf(stderr, "\t   compress <s-file> (or STDIN) into <h-file> (or STDOUT)\n\n");
 
+    fprintf(stderr, "\t-b <k> __or__ --blocks <k>\n");
+    fprintf(stderr, "\t   with -C, compress <k> KB at a time, in bounded memory\n\n");
+
+    fprintf(stderr, "\t-j <n> __or__ --jobs <n>\n");
+    fprintf(stderr, "\t   with -C or -U, code <n> blocks at once on <n> threads\n");
+    fprintf(stderr, "\t   (with -C, in blocks of 1024 KB unless -b or -i say otherwise)\n\n");
+
+    fprintf(stderr, "\t-i <k> __or__ --index <k>\n");
+    fprintf(stderr, "\t   with -C but not -b, give <h-file> a seek index entry every <k> KB,\n");
+    fprintf(stderr, "\t   for -U to decode on -j threads and for -x\n\n");
+
+    fprintf(stderr, "\t-x <first>:<len> __or__ --extract <first>:<len>\n");
+    fprintf(stderr, "\t   with -U, uncompress only <len> bytes from byte <first> on\n\n");
+
     fprintf(stderr, "\t-U __or__ uncompress\n");
     fprintf(stderr, "\t   uncompress <h-file> (or STDIN) into <s-file> (or STDOUT)\n\n");
 
@@ -120,6 +139,11 @@ int main (int argc, char **argv) {
   bool print_htree_flag     = false;
   bool print_codetable_flag = false;
   bool verbose = false;
+  size_t block_size = 0;  // compress in one piece
+  unsigned int threads = 1;
+  bool indexed = false;
+  bool extract = false;
+  size_t extract_first = 0, extract_len = 0;
 
 
   if (argc == 1) usage(argv[0], 0);
@@ -134,6 +158,10 @@ int main (int argc, char **argv) {
           {"binascii",        required_argument, 0, 'a'},
           {"freq",            required_argument, 0, 'f'},
           {"htree",           required_argument, 0, 'r'},
+          {"blocks",          required_argument, 0, 'b'},
+          {"jobs",            required_argument, 0, 'j'},
+          {"index",           required_argument, 0, 'i'},
+          {"extract",         required_argument, 0, 'x'},
           // Operations
           {"encode",          no_argument,       0, 'E'},
           {"decode",          no_argument,       0, 'D'},
@@ -152,7 +180,7 @@ int main (int argc, char **argv) {
       // getopt_long stores the option index here.
       int option_index = 0;
 
-      c = getopt_long (argc, argv, "EDCUFQRTVWHs:h:a:f:r:",
+      c = getopt_long (argc, argv, "EDCUFQRTVWHs:h:a:f:r:b:j:i:x:",
                        long_options, &option_index);
 
       if (c == -1) break; // end of the options
@@ -163,6 +191,45 @@ int main (int argc, char **argv) {
       case 'a': binascii_fname   = optarg;    break;
       case 'f': frequency_fname  = optarg;    break;
       case 'r': codetable_fname  = optarg;    break;
+      case 'b': {
+        long k = atol(optarg);
+        if (k <= 0 || k > MAX_BLOCK_SIZE/1024) {
+          fprintf(stderr, "Blocks must be 1 to %d KB\n", MAX_BLOCK_SIZE/1024);
+          exit(1);
+        }
+        block_size = (size_t)k * 1024;
+        break;
+      }
+      case 'j': {
+        long n = atol(optarg);
+        if (n <= 0 || n > MAX_THREADS) {
+          fprintf(stderr, "Jobs must be 1 to %d\n", MAX_THREADS);
+          exit(1);
+        }
+        threads = (unsigned int)n;
+        break;
+      }
+      case 'i': {
+        long k = atol(optarg);
+        if (k <= 0 || k > 1024*1024) {
+          fprintf(stderr, "Index entries must be 1 KB to 1 GB apart\n");
+          exit(1);
+        }
+        index_compress((size_t)k * 1024);
+        indexed = true;
+        break;
+      }
+      case 'x': {
+        unsigned long first, len;
+        if (sscanf(optarg, "%lu:%lu", &first, &len) != 2) {
+          fprintf(stderr, "Option -x takes <first>:<len>\n");
+          exit(1);
+        }
+        extract = true;
+        extract_first = first;
+        extract_len = len;
+        break;
+      }
 
       case 'E': op_flag = ENCODE;             break;
       case 'D': op_flag = DECODE;             break;
@@ -188,6 +255,14 @@ int main (int argc, char **argv) {
       }
   }
 
+  // Only a file in one piece has a seek index; -j alone keeps it in one
+  // piece when there is an index
+  if (indexed && block_size > 0) {
+    fprintf(stderr, "Options -i and -b don't go together: "
+                    "a file in blocks has no seek index\n");
+    exit(1);
+  }
+
   freqtable_t F = NULL;
   htree *H      = NULL;
   codetable_t C = NULL;
@@ -268,7 +343,12 @@ int main (int argc, char **argv) {
       C = htree_to_codetable_verbose(H, verbose);
       print_codetable(C);
     }
-    compress(source_fname, compressed_fname);
+    if (block_size == 0 && threads > 1 && !indexed)
+      block_size = 1024 * 1024;
+    if (block_size > 0)
+      compress_blocks(source_fname, compressed_fname, block_size, threads);
+    else
+      compress(source_fname, compressed_fname);
     break;
 
   case UNCOMPRESS:
@@ -276,7 +356,11 @@ int main (int argc, char **argv) {
       printf("Use -V flag to display the code table\n");
     if (print_freqtable_flag)
       printf("The frequency table is not available while uncompressing\n");
-    uncompress(source_fname, compressed_fname);
+    if (extract)
+      uncompress_range(source_fname, compressed_fname,
+                       extract_first, extract_len);
+    else
+      uncompress(source_fname, compressed_fname, threads);
     break;
 
   case WRITE_FREQ:
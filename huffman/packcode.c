@@ -0,0 +1,374 @@
+/* Huffman coding straight to and from packed bytes
+ *
+ * 15-122 Principles of Imperative Computation
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "lib/contracts.h"
+#include "lib/xalloc.h"
+
+#include "htree.h"
+#include "packcode.h"
+
+
+/*******************************************/
+/*  Encoding into packed bytes             */
+/*******************************************/
+
+// Codes up to this long go into the accumulator in one piece
+#define WORD_BITS 56
+
+struct hencoder {
+  uint64_t word[NUM_SYMBOLS];  // code of each symbol, in the low bits
+  unsigned int len[NUM_SYMBOLS];  // its length, or 0 for no code
+  bitstring_t long_code[NUM_SYMBOLS];  // copy of codes over WORD_BITS
+};
+
+hencoder* hencoder_new(codetable_t table) {
+  REQUIRES(is_codetable(table));
+  hencoder *E = xcalloc(1, sizeof(hencoder));
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++) {
+    bitstring_t code = table[c];
+    if (code == NULL) continue;
+    E->len[c] = strlen(code);
+    if (E->len[c] > WORD_BITS) {
+      E->long_code[c] = xcalloc(E->len[c] + 1, sizeof(bit_t));
+      strcpy(E->long_code[c], code);
+    } else {
+      for (unsigned int i = 0; i < E->len[c]; i++)
+        E->word[c] = (E->word[c] << 1) | (code[i] == '1');
+    }
+  }
+  return E;
+}
+
+void hencoder_free(hencoder *E) {
+  REQUIRES(E != NULL);
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++)
+    if (E->long_code[c] != NULL) free(E->long_code[c]);
+  free(E);
+}
+
+/* Codes go into the low end of a 64-bit accumulator, and whole bytes
+ * leave from the top of what it holds, so that after a flush it holds
+ * at most 7 bits and always has room for the next code.
+ */
+#define FLUSH()                                       \
+  while (have >= 8) {                                 \
+    have -= 8;                                        \
+    code[n++] = (uint8_t)(acc >> have);               \
+  }
+
+size_t encoded_length(hencoder *E, symbol_t *src, size_t src_len) {
+  REQUIRES(E != NULL);
+  REQUIRES(src != NULL || src_len == 0);
+  size_t bits = 0;
+  for (size_t i = 0; i < src_len; i++) {
+    if (E->len[src[i]] == 0) return SIZE_MAX;
+    bits += E->len[src[i]];
+  }
+  return bits;
+}
+
+size_t encode_into(hencoder *E, symbol_t *src, size_t src_len,
+                   uint8_t *code) {
+  REQUIRES(E != NULL && code != NULL);
+  REQUIRES(src != NULL || src_len == 0);
+
+  uint64_t acc = 0;
+  unsigned int have = 0;  // bits in acc
+  size_t n = 0;           // bytes written
+  size_t bits = 0;
+  for (size_t i = 0; i < src_len; i++) {
+    symbol_t c = src[i];
+    ASSERT(E->len[c] != 0);
+    bits += E->len[c];
+    if (E->len[c] <= WORD_BITS) {
+      acc = (acc << E->len[c]) | E->word[c];
+      have += E->len[c];
+    } else {
+      for (unsigned int j = 0; j < E->len[c]; j++) {
+        acc = (acc << 1) | (E->long_code[c][j] == '1');
+        have++;
+        FLUSH();
+      }
+    }
+    FLUSH();
+  }
+  if (have > 0) code[n++] = (uint8_t)(acc << (8 - have));
+  ASSERT(n == bits/8 + (bits%8 == 0 ? 0 : 1));
+  return bits;
+}
+
+uint8_t* encode_packed(hencoder *E, symbol_t *src, size_t src_len,
+                       size_t *code_len) {
+  REQUIRES(E != NULL && code_len != NULL);
+  REQUIRES(src != NULL || src_len == 0);
+
+  size_t bits = encoded_length(E, src, src_len);
+  if (bits == SIZE_MAX) {
+    fprintf(stderr, "Source has a symbol with no associated code\n");
+    exit(1);
+  }
+  size_t num_bytes = bits/8 + (bits%8 == 0 ? 0 : 1);
+  uint8_t *code = xcalloc(num_bytes + 1, sizeof(uint8_t));
+  *code_len = encode_into(E, src, src_len, code);
+  return code;
+}
+
+
+/*******************************************/
+/*  Decoding tables                        */
+/*******************************************/
+
+/* A table of width w is indexed by the next w bits of the code, most
+ * significant bit first.  Its entry either has the symbol whose code
+ * starts with those bits and how many of them the code uses, or says
+ * to look up the bits after them in a further table.
+ */
+struct decode_entry {
+  uint16_t value;  // symbol, or start of the next table
+  uint8_t len;     // bits used up; 0 if no code starts with these bits
+  uint8_t sub;     // width of the next table, or 0 for a symbol
+};
+
+struct hdecoder {
+  struct decode_entry *tables;  // the first table, then all the others
+  size_t size;                  // entries in use
+  size_t limit;                 // entries allocated
+  unsigned int bits;            // width of the first table
+  unsigned int min_len;         // length of the shortest code
+};
+
+/* The codes as a binary trie: node 0 is the root, and a node without
+ * children is the leaf of a symbol */
+struct trie_node {
+  int child[2];     // -1 if absent
+  bool is_symbol;   // some code ends here
+  symbol_t value;
+  unsigned int depth;
+  unsigned int height;  // longest path down to a leaf
+};
+
+// A prefix-free code of NUM_SYMBOLS symbols has fewer nodes than this
+// only if it is also complete; codes from a corrupt file may not be
+#define MAX_TRIE_NODES (2*NUM_SYMBOLS)
+
+static void bad_codetable(char *why) {
+  fprintf(stderr, "Bad code table: %s\n", why);
+  exit(1);
+}
+
+static bool trie_leaf(struct trie_node *T, int n) {
+  return T[n].child[0] < 0 && T[n].child[1] < 0;
+}
+
+// Add the codes of table to T, returning the number of nodes
+static int build_trie(codetable_t table, struct trie_node *T) {
+  int nodes = 1;
+  T[0].child[0] = T[0].child[1] = -1;
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++) {
+    bitstring_t code = table[c];
+    if (code == NULL) continue;
+    if (code[0] == '\0') bad_codetable("empty code");
+    int n = 0;
+    for (size_t i = 0; code[i] != '\0'; i++) {
+      int b = code[i] == '1';
+      if (T[n].is_symbol) bad_codetable("not prefix-free");  // shorter
+      if (T[n].child[b] < 0) {
+        if (nodes == MAX_TRIE_NODES) bad_codetable("too many code bits");
+        T[n].child[b] = nodes;
+        T[nodes].child[0] = T[nodes].child[1] = -1;
+        T[nodes].depth = T[n].depth + 1;
+        nodes++;
+      }
+      n = T[n].child[b];
+    }
+    if (!trie_leaf(T, n) || T[n].is_symbol)  // a longer code, or the same
+      bad_codetable("not prefix-free");
+    T[n].is_symbol = true;
+    T[n].value = c;
+  }
+  return nodes;
+}
+
+static unsigned int trie_height(struct trie_node *T, int n) {
+  unsigned int h = 0;
+  for (int b = 0; b < 2; b++)
+    if (T[n].child[b] >= 0) {
+      unsigned int hb = trie_height(T, T[n].child[b]) + 1;
+      if (hb > h) h = hb;
+    }
+  T[n].height = h;
+  return h;
+}
+
+static unsigned int min_unsigned(unsigned int x, unsigned int y) {
+  return x < y ? x : y;
+}
+
+// Fill in a table of width w for the codes below node n, returning
+// where it starts
+static size_t fill_table(hdecoder *D, struct trie_node *T, int n,
+                         unsigned int w) {
+  size_t base = D->size;
+  // Entries name the start of a further table in 16 bits
+  if (base > UINT16_MAX || D->limit - D->size < ((size_t)1 << w))
+    bad_codetable("too many decoding tables");
+  D->size += (size_t)1 << w;
+
+  for (size_t i = 0; i < ((size_t)1 << w); i++) {
+    int m = n;
+    unsigned int l = 0;
+    while (m >= 0 && l < w && !trie_leaf(T, m)) {
+      m = T[m].child[(i >> (w - 1 - l)) & 1];
+      l++;
+    }
+    struct decode_entry e = { 0, 0, 0 };
+    if (m >= 0 && trie_leaf(T, m)) {
+      e.value = T[m].value;
+      e.len = l;
+    } else if (m >= 0) {
+      unsigned int sub = min_unsigned(DECODE_SUB_BITS, T[m].height);
+      e.value = (uint16_t)fill_table(D, T, m, sub);
+      e.len = w;
+      e.sub = sub;
+    }
+    D->tables[base + i] = e;
+  }
+  return base;
+}
+
+hdecoder* hdecoder_new(codetable_t table) {
+  REQUIRES(is_codetable(table));
+
+  struct trie_node *T = xcalloc(MAX_TRIE_NODES, sizeof(struct trie_node));
+  int nodes = build_trie(table, T);
+  trie_height(T, 0);
+
+  hdecoder *D = xmalloc(sizeof(hdecoder));
+  D->bits = min_unsigned(DECODE_BITS, T[0].height);
+  D->min_len = T[0].height;
+  for (unsigned short c = 0; c < NUM_SYMBOLS; c++)
+    if (table[c] != NULL && strlen(table[c]) < D->min_len)
+      D->min_len = strlen(table[c]);
+
+  // Only the nodes below the first table head further tables
+  size_t deep = 0;
+  for (int n = 0; n < nodes; n++)
+    if (!trie_leaf(T, n) && T[n].depth >= D->bits) deep++;
+  D->limit = ((size_t)1 << D->bits) + deep * ((size_t)1 << DECODE_SUB_BITS);
+  D->tables = xcalloc(D->limit, sizeof(struct decode_entry));
+  D->size = 0;
+  fill_table(D, T, 0, D->bits);
+
+  free(T);
+  return D;
+}
+
+void hdecoder_free(hdecoder *D) {
+  REQUIRES(D != NULL);
+  free(D->tables);
+  free(D);
+}
+
+
+/*******************************************/
+/*  Decoding packed bytes                  */
+/*******************************************/
+
+/* The code is read into a 64-bit window, most significant bit first,
+ * a byte at a time whenever fewer than 57 bits are left in it, so
+ * that a lookup always finds as many bits as the table is wide.
+ * Bits past the end of the code read as 0.
+ */
+#define REFILL()                                              \
+  while (have <= 56) {                                        \
+    if (next < num_bytes)                                     \
+      window |= (uint64_t)code[next] << (56 - have);          \
+    next++;                                                   \
+    have += 8;                                                \
+  }
+
+static void bad_code(void) {
+  fprintf(stderr, "Code cannot be decoded\n");
+  exit(1);
+}
+
+// Decode the code from bit start up to bit end into src, which has
+// room for src_max symbols, or with fill, only until src is full;
+// returns the number of symbols and puts the bit after them in stop,
+// or returns SIZE_MAX if the code cannot be decoded
+static size_t decode_bits(hdecoder *D, uint8_t *code, size_t start,
+                          size_t end, symbol_t *src, size_t src_max,
+                          bool fill, size_t *stop) {
+  size_t num_bytes = end/8 + (end%8 == 0 ? 0 : 1);
+  size_t next = start/8; // next byte to go into window
+  uint64_t window = 0;
+  unsigned int have = 0; // bits in window
+  size_t used = start;   // bits decoded
+  size_t n = 0;
+
+  REFILL();
+  window <<= start%8;
+  have -= start%8;
+  while (used < end && !(fill && n == src_max)) {
+    REFILL();
+    struct decode_entry e = D->tables[window >> (64 - D->bits)];
+    while (e.sub != 0) {
+      window <<= e.len;
+      have -= e.len;
+      used += e.len;
+      REFILL();
+      e = D->tables[e.value + (window >> (64 - e.sub))];
+    }
+    if (e.len == 0) return SIZE_MAX;
+    window <<= e.len;
+    have -= e.len;
+    used += e.len;
+    if (used > end) return SIZE_MAX;  // last code runs into the padding
+    if (n == src_max) return SIZE_MAX;
+    src[n++] = (symbol_t)e.value;
+  }
+  *stop = used;
+  return n;
+}
+
+size_t decode_into(hdecoder *D, uint8_t *code, size_t code_len,
+                   symbol_t *src, size_t src_max) {
+  REQUIRES(D != NULL);
+  REQUIRES(code != NULL || code_len == 0);
+  REQUIRES(src != NULL || src_max == 0);
+  size_t stop;
+  return decode_bits(D, code, 0, code_len, src, src_max, false, &stop);
+}
+
+size_t decode_range(hdecoder *D, uint8_t *code, size_t code_len,
+                    size_t start, symbol_t *src, size_t count) {
+  REQUIRES(D != NULL && start <= code_len);
+  REQUIRES(code != NULL || code_len == 0);
+  REQUIRES(src != NULL || count == 0);
+  size_t stop;
+  if (decode_bits(D, code, start, code_len, src, count, true, &stop)
+      != count)
+    return SIZE_MAX;  // bad code, or code ran out first
+  return stop;
+}
+
+symbol_t* decode_packed(hdecoder *D, uint8_t *code, size_t code_len,
+                        size_t *src_len) {
+  REQUIRES(D != NULL && src_len != NULL);
+  REQUIRES(code != NULL || code_len == 0);
+
+  // Every symbol uses up at least min_len bits
+  size_t src_max = code_len / D->min_len;
+  symbol_t *src = xcalloc(src_max + 1, sizeof(symbol_t));
+  *src_len = decode_into(D, code, code_len, src, src_max);
+  if (*src_len == SIZE_MAX) bad_code();
+  return src;
+}
@@ -0,0 +1,62 @@
+/* Huffman coding straight to and from packed bytes
+ *
+ * 15-122 Principles of Imperative Computation
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "htree.h"
+
+#ifndef _PACKCODE_H_
+#define _PACKCODE_H_
+
+// Bits the first decoding table looks up at once; codes that are
+// longer carry on in smaller tables of DECODE_SUB_BITS bits each
+#define DECODE_BITS 11
+#define DECODE_SUB_BITS 6
+
+// Codes of a code table as integers
+typedef struct hencoder hencoder;
+
+// Build the integer codes for table
+hencoder* hencoder_new(codetable_t table);
+// Dispose of the integer codes
+void hencoder_free(hencoder *E);
+
+// Length in bits of the code for src, or SIZE_MAX if some symbol in
+// src has no code
+size_t encoded_length(hencoder *E, symbol_t *src, size_t src_len);
+// Encode src into code, which has room for the padded bytes of its
+// code, returning the length of the code in bits
+size_t encode_into(hencoder *E, symbol_t *src, size_t src_len,
+                   uint8_t *code);
+// Encode src into packed bytes, padded to the next byte, putting the
+// length of the code in bits in code_len
+uint8_t* encode_packed(hencoder *E, symbol_t *src, size_t src_len,
+                       size_t *code_len);
+
+// Decoding tables for the codes of a code table
+typedef struct hdecoder hdecoder;
+
+// Build the decoding tables for table, which must be prefix-free
+hdecoder* hdecoder_new(codetable_t table);
+// Dispose of the decoding tables
+void hdecoder_free(hdecoder *D);
+
+// Decode the first code_len bits of the packed bytes in code into
+// src, which has room for src_max symbols, returning how many there
+// are, or SIZE_MAX if the code cannot be decoded into that many
+size_t decode_into(hdecoder *D, uint8_t *code, size_t code_len,
+                   symbol_t *src, size_t src_max);
+// Decode count symbols from bit start on of the first code_len bits of
+// the packed bytes in code into src, returning the bit after them, or
+// SIZE_MAX if they cannot be decoded
+size_t decode_range(hdecoder *D, uint8_t *code, size_t code_len,
+                    size_t start, symbol_t *src, size_t count);
+// Decode the first code_len bits of the packed bytes in code,
+// putting decoded length in src_len
+symbol_t* decode_packed(hdecoder *D, uint8_t *code, size_t code_len,
+                        size_t *src_len);
+
+#endif /* _PACKCODE_H_ */
@@ -0,0 +1,60 @@
+/* Running independent jobs on worker threads
+ *
+ * 15-122 Principles of Imperative Computation
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "lib/contracts.h"
+#include "lib/xalloc.h"
+
+#include "parallel.h"
+
+
+// Worker t runs jobs t, t + stride, t + 2*stride, ...
+struct worker {
+  void (*job)(void *env, size_t i);
+  void *env;
+  size_t first;
+  size_t stride;
+  size_t n;
+};
+
+static void *run_worker(void *arg) {
+  struct worker *w = arg;
+  for (size_t i = w->first; i < w->n; i += w->stride)
+    w->job(w->env, i);
+  return NULL;
+}
+
+void parallel_for(unsigned int threads, size_t n,
+                  void (*job)(void *env, size_t i), void *env) {
+  REQUIRES(threads > 0 && job != NULL);
+  size_t stride = threads < n ? threads : n;
+  if (stride <= 1) {
+    for (size_t i = 0; i < n; i++) job(env, i);
+    return;
+  }
+
+  struct worker *W = xcalloc(stride, sizeof(struct worker));
+  pthread_t *T = xcalloc(stride, sizeof(pthread_t));
+  for (size_t t = 0; t < stride; t++) {
+    W[t].job = job;
+    W[t].env = env;
+    W[t].first = t;
+    W[t].stride = stride;
+    W[t].n = n;
+  }
+  for (size_t t = 1; t < stride; t++)
+    if (pthread_create(&T[t], NULL, run_worker, &W[t]) != 0) {
+      fprintf(stderr, "Could not start a thread\n");
+      exit(1);
+    }
+  run_worker(&W[0]);
+  for (size_t t = 1; t < stride; t++)
+    pthread_join(T[t], NULL);
+  free(W);
+  free(T);
+}
@@ -0,0 +1,19 @@
+/* Running independent jobs on worker threads
+ *
+ * 15-122 Principles of Imperative Computation
+ */
+
+#include <stdlib.h>
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+// Most threads -j asks for
+#define MAX_THREADS 256
+
+// Run job(env, i) for each i < n, on up to threads threads at once
+// (the caller's among them), returning when all are done
+void parallel_for(unsigned int threads, size_t n,
+                  void (*job)(void *env, size_t i), void *env);
+
+#endif /* _PARALLEL_H_ */
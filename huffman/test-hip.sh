@@ -0,0 +1,91 @@
+#!/bin/sh
+# Huffman coding
+#
+# Tests of uncompressing crafted and corrupt .hip files
+# 15-122 Principles of Imperative Computation
+#
+# Run with "make check", or as HUFF=<binary> sh test-hip.sh
+
+HUFF=${HUFF:-./huff-fast}
+TMP=${TMPDIR:-/tmp}/test-hip.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+zeros() { head -c "$1" /dev/zero; }
+
+# expect_error <name> <message> <command...>: the command must exit with
+# status 1 (not a signal) and print <message> on stderr
+expect_error() {
+  name=$1; message=$2; shift 2
+  "$@" >"$TMP/out" 2>"$TMP/err"
+  status=$?
+  if [ $status -eq 1 ] && grep -q "$message" "$TMP/err"; then
+    echo "ok:     $name"
+  else
+    echo "FAILED: $name (status $status)"; cat "$TMP/err"
+    failed=1
+  fi
+}
+
+# Codes of 'a', 'b', 'c' as 255-bit strings 000..., 1000..., 11000...:
+# prefix-free, but incomplete, with 765 bits and more trie nodes than
+# any complete code of 256 symbols
+incomplete_codes() {
+  printf '\003abc\377\377\377'
+  zeros 31; printf '\001'; zeros 31; printf '\003'; zeros 32
+}
+
+# One piece: magic 0xC0DEBEAD, code_start 103, codes, code_len 0
+{ printf '\255\276\336\300\147\000'; incomplete_codes; zeros 4; } \
+  >"$TMP/incomplete.hip"
+expect_error "incomplete code table" "Bad code table" \
+  "$HUFF" -U -h "$TMP/incomplete.hip" -s "$TMP/src"
+
+# In blocks: magic 0xC0DEB10C, block_size 1024, then a block of 1 byte
+# with the codes, and code_len 0
+{ printf '\014\261\336\300\000\004\000\000\001\000\000\000\001'
+  incomplete_codes; zeros 8; } >"$TMP/incomplete-blocks.hip"
+expect_error "incomplete code table in a block" "Bad code table" \
+  "$HUFF" -U -h "$TMP/incomplete-blocks.hip" -s "$TMP/src"
+
+# expect_same <name> <file> <file>: the files must be the same
+expect_same() {
+  if cmp -s "$2" "$3"; then echo "ok:     $1"
+  else echo "FAILED: $1"; failed=1
+  fi
+}
+
+# A seek index is only for files in one piece
+SRC=data/source/nobody.jpg
+expect_error "-i with -b" "don't go together" \
+  "$HUFF" -C -i 1 -b 4 -s "$SRC" -h "$TMP/indexed.hip"
+expect_error "-i with -b and -j" "don't go together" \
+  "$HUFF" -C -i 1 -b 4 -j 2 -s "$SRC" -h "$TMP/indexed.hip"
+
+# -i with -j compresses in one piece, with the index
+"$HUFF" -C -i 1 -j 2 -s "$SRC" -h "$TMP/indexed.hip" >/dev/null
+head -c 4 "$TMP/indexed.hip" >"$TMP/magic"
+printf '\336\261\336\300' >"$TMP/indexed-magic"
+expect_same "-i with -j writes a seek index" "$TMP/magic" "$TMP/indexed-magic"
+"$HUFF" -U -j 2 -h "$TMP/indexed.hip" -s "$TMP/src" >/dev/null
+expect_same "-i with -j round trip" "$TMP/src" "$SRC"
+"$HUFF" -U -x 500:700 -h "$TMP/indexed.hip" -s "$TMP/part" >/dev/null
+head -c 1200 "$SRC" | tail -c 700 >"$TMP/expected-part"
+expect_same "-x from an indexed file" "$TMP/part" "$TMP/expected-part"
+
+# Seek index entry 3 three bits off (it follows the magic, code_start,
+# src_len and interval): still in order, but not where its range starts.
+# Codes can fall back into step, so for some offsets (one bit off, say)
+# the range decodes right all the same
+for i in 1 2 3 4; do cat "$SRC"; done >"$TMP/big"
+"$HUFF" -C -i 1 -s "$TMP/big" -h "$TMP/big.hip" >/dev/null
+b=$(od -An -tu1 -j26 -N1 "$TMP/big.hip")
+printf "\\$(printf %03o $(( (b + 3) % 256 )))" |
+  dd of="$TMP/big.hip" bs=1 seek=26 conv=notrunc 2>/dev/null
+expect_error "bad seek index entry" "Bad seek index" \
+  "$HUFF" -U -j 4 -h "$TMP/big.hip" -s "$TMP/src"
+expect_error "-x with a bad seek index entry" "Bad seek index" \
+  "$HUFF" -U -x 3100:100 -h "$TMP/big.hip" -s "$TMP/part"
+
+exit $failed